@@ -0,0 +1,132 @@
+/* encoder benchmark for the JPEG and PNG tables in README.md
+ *
+ * compile with
+ *
+ * gcc -O2 -o imgbench imgbench.c ../src/image_format.c \
+ *   -I../libharvid/ -I../src/ \
+ *   `pkg-config --cflags libavformat libavcodec libavutil libpng` -ljpeg -lpng -lz -lpthread
+ *
+ * and run
+ *
+ * ./imgbench [seconds per row]
+ *
+ * Every image is encoded repeatedly on a single thread, using a synthetic
+ * test image with gradients, edges and noise. JPEG is encoded from
+ * YUV 4:2:0 at quality 75, PNG from RGB24.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <vinfo.h>
+#include <ffcompat.h>
+#include "enums.h"
+#include "image_format.h"
+
+/* dlog implementation required by image_format.c */
+#ifndef NDEBUG
+int debug_section = 0;
+#endif
+int debug_level  = 0;
+
+void dlog(int level, const char *format, ...) {}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* horizontal and vertical gradients, a grid of hard edges and some noise */
+static uint8_t pixel(int x, int y, int w, int h, int c) {
+  int v = (c == 0 ? 255 * x / w : c == 1 ? 255 * y / h : 255 * (x + y) / (w + h));
+  if (((x / 16) + (y / 16)) % 7 == 0) v = 255 - v;
+  v += (rand() % 17) - 8;
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static uint8_t *test_rgb(int w, int h) {
+  uint8_t *b = malloc((size_t)w * h * 3);
+  int x, y, c;
+  srand(1);
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      for (c = 0; c < 3; ++c)
+        b[3 * (y * w + x) + c] = pixel(x, y, w, h, c);
+  return b;
+}
+
+static uint8_t *test_yuv420(const uint8_t *rgb, int w, int h) {
+  uint8_t *b = malloc((size_t)w * h * 3 / 2);
+  uint8_t *u = b + w * h;
+  uint8_t *v = u + (w / 2) * (h / 2);
+  int x, y;
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      const uint8_t *p = &rgb[3 * (y * w + x)];
+      b[y * w + x] = (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;
+      if (!(x & 1) && !(y & 1)) {
+        u[(y / 2) * (w / 2) + x / 2] = 128 + ((-43 * p[0] - 85 * p[1] + 128 * p[2]) >> 8);
+        v[(y / 2) * (w / 2) + x / 2] = 128 + ((128 * p[0] - 107 * p[1] - 21 * p[2]) >> 8);
+      }
+    }
+  }
+  return b;
+}
+
+static void bench(const char *size, const char *name, int fmt, int opts, VInfo *ji, int pix_fmt, uint8_t *buf, double secs) {
+  const double t0 = now();
+  double t;
+  size_t len = 0;
+  int n = 0;
+  do {
+    uint8_t *out = NULL;
+    len = format_image(&out, fmt, opts, ji, pix_fmt, buf, NULL);
+    free(out);
+    ++n;
+  } while ((t = now() - t0) < secs);
+  printf("| %-9s | %-30s | %8.2f | %8.0f | %7lu |\n",
+      size, name, 1000. * t / n, n / t, (unsigned long) len);
+}
+
+int main(int argc, char **argv) {
+  static const int sizes[][2] = {{160, 90}, {640, 360}, {1920, 1080}};
+  static const struct { const char *name; int opts; } jpg[] = {
+    {"baseline (default)", 75},
+    {"baseline, optimize", 75 | JPG_OPTIMIZE},
+    {"baseline, dct=ifast", 75 | JPG_DCT_IFAST},
+    {"baseline, dct=islow", 75 | JPG_DCT_ISLOW},
+    {"baseline, dct=float", 75 | JPG_DCT_FLOAT},
+    {"progressive", 75 | JPG_PROGRESSIVE},
+  };
+  static const struct { const char *name; int opts; } png[] = {
+    {"libpng default", 0},
+    {"fast (level=1 rle filter=up)", PNGENC_FAST},
+    {"level=1 filter=sub", 0x02 | (PNGENC_FILTER_SUB << 8)},
+    {"level=0 filter=none", 0x01 | (PNGENC_FILTER_NONE << 8)},
+  };
+  const double secs = argc > 1 ? atof(argv[1]) : 1.0;
+  unsigned int s, i;
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    const int w = sizes[s][0], h = sizes[s][1];
+    uint8_t *rgb = test_rgb(w, h);
+    uint8_t *yuv = test_yuv420(rgb, w, h);
+    char size[16];
+    VInfo ji;
+    memset(&ji, 0, sizeof(VInfo));
+    ji.out_width = ji.movie_width = w;
+    ji.out_height = ji.movie_height = h;
+    snprintf(size, sizeof(size), "%dx%d", w, h);
+    for (i = 0; i < sizeof(jpg) / sizeof(jpg[0]); ++i)
+      bench(size, jpg[i].name, FMT_JPG, jpg[i].opts, &ji, AV_PIX_FMT_YUV420P, yuv, secs);
+    for (i = 0; i < sizeof(png) / sizeof(png[0]); ++i)
+      bench(size, png[i].name, FMT_PNG, png[i].opts, &ji, AV_PIX_FMT_RGB24, rgb, secs);
+    free(yuv);
+    free(rgb);
+  }
+  return 0;
+}
@@ -20,6 +20,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <pthread.h>
 #include <assert.h>
 
@@ -31,6 +33,27 @@
 
 #define DEFAULT_PIX_FMT (AV_PIX_FMT_RGB24) // TODO global default
 
+/* default max. time a request waits for a decoder object */
+#define DCTL_QUEUE_TIMEOUT (2000)
+
+/* number of wait-times kept for the status page */
+#define DCTL_WAIT_SAMPLES (512)
+
+/* without keyframe index, the decoder seeks unless the target
+ * is at most this many frames ahead (see ff_render) */
+#define DCTL_SEQ_FRAMES (32)
+
+/* close decoders that were not used for this long [sec] */
+#define DCTL_GC_AGE (600)
+/* .. checking at most once per interval [sec] */
+#define DCTL_GC_INTERVAL (60)
+
+/* max. time a purge waits for busy decoders to be released [ms] */
+#define DCTL_UNPIN_TIMEOUT (5000)
+
+/* max. number of files waiting for a decoder to be pre-opened */
+#define DCTL_WARM_QUEUE (8)
+
 //#define HASH_EMIT_KEYS 3
 #define HASH_FUNCTION HASH_SAX
 #include "uthash.h"
@@ -42,12 +65,15 @@
 #define VOF_PENDING 8 ///< decoder is just opening a file (my_open_movie)
 #define VOF_INFO 16   ///< decoder is currently in use for info (size/fps) lookup only
 
-/* id + fmt */
-#define CLKEYLEN (offsetof(JVOBJECT, frame) - offsetof(JVOBJECT, id))
+/* id + fmt, info lookups do not depend on the lowres level */
+#define CLKEYLEN (offsetof(JVOBJECT, lowres) - offsetof(JVOBJECT, id))
+
+struct JVD;
 
 typedef struct JVOBJECT {
   unsigned short id;    // file ID from VidMap
   int fmt;              // pixel format
+  int lowres;           // reduced quality decode level, -1: any (closed)
   int64_t frame;        // decoded frame-number
   time_t lru;           // least recently used time
   int hitcount_decoder; // least-frequently used idea
@@ -56,7 +82,20 @@ typedef struct JVOBJECT {
   int flags;
   int infolock_refcnt;
   void *decoder;        // opaque ffdecoder
+  double used_since;    // time when VOF_USED was set
+  int bulk;             // VOF_USED by a request of DCTL_PRIO_BULK
+  int warm;             // opened in the background and not used yet
+  int pinned;           // VOF_USED by dctrl_pin_decoder()
+  int cancel;           // the file was purged: stop using the decoder, invalidate it on release
+  struct JVD *jvd;      // owner, to signal release
   struct JVOBJECT *next;
+  int indexed;          // decoder index: 1: by file, 2: spare
+  int idle;             // decoder index: 1: in the file's open list, 2: closed list, 3: ready
+  int sorted;           // decoder index: in the file's array of open decoders
+  struct JVOBJECT *lru_prev; // decoder index: idle objects of all files (spare list)
+  struct JVOBJECT *lru_next;
+  struct JVOBJECT *fl_prev;  // decoder index: idle objects of the file
+  struct JVOBJECT *fl_next;
   UT_hash_handle hhi;
   UT_hash_handle hhf;
 } /*__attribute__((__packed__)) */ JVOBJECT;
@@ -65,10 +104,45 @@ typedef struct VidMap {
   unsigned short id;
   char *fn;
   time_t lru;
+  int width;      // movie geometry, 0 until the file was opened
+  int height;
+  int max_lowres; // lowres levels supported by the codec
   UT_hash_handle hh;
   UT_hash_handle hr;
 } VidMap;
 
+/* decoder objects of a file */
+typedef struct DCFile {
+  unsigned short id;
+  int n;                 // objects assigned to the file
+  int n_open;
+  int size;
+  JVOBJECT **dec;        // open decoders, ordered by decoded frame-number
+  JVOBJECT *open_head;   // idle open decoders, most recently used first
+  JVOBJECT *open_tail;
+  JVOBJECT *closed_head; // idle objects without decoder
+  JVOBJECT *closed_tail;
+  JVOBJECT *ready;       // idle pre-opened decoder, kept for the next request
+  void *keymap;          // keyframe lookup, NULL until known, see file_keymap()
+  UT_hash_handle hh;
+} DCFile;
+
+/* file to pre-open a decoder for, see warm_thread() */
+typedef struct DCWarm {
+  unsigned short id;
+  int fmt;
+  int lowres;
+} DCWarm;
+
+/* request waiting for a decoder object, see dctrl_get_decoder() */
+typedef struct DCWaiter {
+  pthread_cond_t cond;
+  int granted;          // a decoder object was released for this request, try again
+  int prio;             // DCTL_PRIO_*
+  double since;         // time of arrival
+  struct DCWaiter *next;
+} DCWaiter;
+
 typedef struct JVD {
   JVOBJECT *jvo; // list of all decoder objects
   JVOBJECT *jvf; // hash-index of jvo
@@ -78,31 +152,73 @@ typedef struct JVD {
   unsigned short monotonic; // monotonic count for VidMap ID (wrap-around case is handled)
   int max_objects; // config
   int cache_size;  // config
+  int lowres_max;  // config, max reduced resolution level for thumbnails
+  int lowres_skip; // config, skip loop-filter/idct for thumbnails
   int busycnt; // prevent cache purge/cleanup while decoders are active
   int purge_in_progress;
+  unsigned int avail_seq; // incremented whenever a decoder object is released
+  DCWaiter *queue_head; // FIFO of requests waiting for a decoder object
+  DCWaiter *queue_tail;
+  int queue_len;
+  int queue_timeout;    // config, max. time to wait for a decoder [ms]
+  double hold_avg;      // average time a decoder is in use [ms]
+  int bulk_used;        // decoder objects in use by bulk requests
+  int queue_max;        // stats: max. queue length
+  unsigned int queued;  // stats: requests that had to wait
+  unsigned int rejected;// stats: requests whose deadline could not be met
+  unsigned int timedout;// stats: requests that waited until their deadline
+  float wait_ms[DCTL_WAIT_SAMPLES]; // stats: recent wait-times
+  unsigned int wait_n;
   pthread_mutex_t lock_jvo;  // lock to modify (append to) jvo list (TODO consolidate w/ lock_jdh)
   pthread_rwlock_t lock_jdh; // lock for jvo index-hash
   pthread_rwlock_t lock_vml; // lock to modify monotonic (TODO consolidate w/ lock_jdh)
   pthread_mutex_t lock_busy; // lock to modify busycnt;
+  pthread_cond_t cond_busy;  // signalled when busycnt drops to zero or a purge completes
+  pthread_mutex_t lock_avail; // lock for avail_seq, the queue and its stats
+  pthread_cond_t cond_avail;  // signalled when a decoder object is released
+  DCFile *files;        // decoder index: file-ID -> decoder objects
+  JVOBJECT *lru_head;   // decoder index: idle objects assigned to a file, most recently used first
+  JVOBJECT *lru_tail;
+  JVOBJECT *spare;      // decoder index: objects not assigned to any file
+  int n_objects;        // number of allocated decoder objects
+  pthread_mutex_t lock_idx; // lock for the decoder index, a leaf: no other lock is taken while holding it
+  DCWarm warm[DCTL_WARM_QUEUE]; // files to pre-open a decoder for
+  int warm_n;
+  int warm_run;         // the warm_thread is active
+  unsigned int warmed;  // stats: decoders opened in the background
+  pthread_t warm_thread;
+  pthread_mutex_t lock_warm; // lock for the warm queue
+  pthread_cond_t cond_warm;  // signalled when a file is added to the warm queue
 } JVD;
 
 ///////////////////////////////////////////////////////////////////////////////
 // ffdecoder wrappers
 
-static inline int my_decode(void *vd, unsigned long frame, uint8_t *b, int w, int h) {
+static inline int my_decode(void *vd, unsigned long frame, uint8_t *b, int w, int h, int xoff, int ys, FrameSink *sink) {
   int rv;
   ff_resize(vd, w, h, b, NULL);
-  rv = ff_render(vd, frame, b, w, h, 0, w, w);
+  ff_set_sink(vd, sink);
+  rv = ff_render(vd, frame, b, w, h, xoff, w, ys);
+  ff_set_sink(vd, NULL);
   ff_set_bufferptr(vd, NULL);
   return rv;
 }
 
-static inline int my_open_movie(void **vd, char *fn, int render_fmt) {
+static inline int my_decode_key(void *vd, unsigned long frame, uint8_t *b, int w, int h, int64_t *actual) {
+  int rv;
+  ff_resize(vd, w, h, b, NULL);
+  rv = ff_render_key(vd, frame, b, w, h, 0, w, w, actual);
+  ff_set_bufferptr(vd, NULL);
+  return rv;
+}
+
+static inline int my_open_movie(void **vd, char *fn, int render_fmt, int lowres, int skip) {
   if (!fn) {
     dlog(DLOG_ERR, "DCTL: trying to open file w/o filename.\n");
     return -1;
   }
   ff_create(vd);
+  ff_set_quality(*vd, lowres, skip);
   assert (
          render_fmt == AV_PIX_FMT_YUV420P
       || render_fmt == AV_PIX_FMT_YUV440P
@@ -141,92 +257,582 @@ static inline void my_get_info_canonical(void *vd, VInfo *i, int w, int h) {
 // Video object management
 //
 
-static JVOBJECT *newjvo (JVOBJECT *jvo, pthread_mutex_t *appendlock) {
+static void queue_grant(JVD *jvd);
+
+static double dctrl_now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/* wake up threads waiting for a decoder object
+ * @param held time the object was in use [ms], 0: unknown
+ * @param bulk the object was used by a bulk request
+ */
+static void signal_avail(JVD *jvd, double held, int bulk) {
+  pthread_mutex_lock(&jvd->lock_avail);
+  jvd->avail_seq++;
+  if (bulk) {
+    jvd->bulk_used--;
+  }
+  if (held > 0) {
+    jvd->hold_avg = jvd->hold_avg > 0 ? .9 * jvd->hold_avg + .1 * held : held;
+  }
+  pthread_cond_broadcast(&jvd->cond_avail);
+  queue_grant(jvd);
+  pthread_mutex_unlock(&jvd->lock_avail);
+}
+
+/* Admission queue
+ * Requests that find no available decoder object line up in FIFO order,
+ * interactive requests ahead of bulk ones. Every released object is
+ * granted to the first request in line that does not hold a grant yet,
+ * it then competes for a decoder again. Requests arriving while others
+ * of the same or higher priority are queued go to the end of their line.
+ * Bulk requests leave one decoder object to interactive ones.
+ * NB. lock_avail needs to be held when calling these
+ */
+
+static int bulk_full(JVD *jvd) {
+  return jvd->bulk_used >= (jvd->max_objects > 1 ? jvd->max_objects - 1 : 1);
+}
+
+/* a request of the given priority has to line up behind queued ones */
+static int queue_busy(JVD *jvd, int prio) {
+  if (prio == DCTL_PRIO_BULK) {
+    return jvd->queue_head != NULL || bulk_full(jvd);
+  }
+  return jvd->queue_head != NULL && jvd->queue_head->prio == DCTL_PRIO_INTERACTIVE;
+}
+
+static void queue_grant(JVD *jvd) {
+  DCWaiter *cptr;
+  for (cptr = jvd->queue_head; cptr; cptr = cptr->next) {
+    if (cptr->prio == DCTL_PRIO_BULK && bulk_full(jvd)) {
+      return;
+    }
+    if (!cptr->granted) {
+      cptr->granted = 1;
+      pthread_cond_signal(&cptr->cond);
+      return;
+    }
+  }
+}
+
+/* @return 0 if queued, -1 if the request's deadline can not be met */
+static int queue_enter(JVD *jvd, DCWaiter *w, double remaining) {
+  DCWaiter *cptr, *prev = NULL;
+  int ahead = 0;
+  double estimate;
+
+  if (w->prio == DCTL_PRIO_BULK) {
+    prev = jvd->queue_tail;
+    ahead = jvd->queue_len;
+  } else {
+    /* overtake bulk requests */
+    for (cptr = jvd->queue_head; cptr && cptr->prio == DCTL_PRIO_INTERACTIVE; cptr = cptr->next) {
+      prev = cptr;
+      ++ahead;
+    }
+  }
+
+  /* every decoder object serves one request per hold-time */
+  estimate = (ahead + 1) * jvd->hold_avg / (jvd->max_objects > 0 ? jvd->max_objects : 1);
+  if (ahead > 0 && estimate > remaining) {
+    jvd->rejected++;
+    return -1;
+  }
+
+  pthread_cond_init(&w->cond, NULL);
+  /* first in line: a decoder may have been released meanwhile */
+  w->granted = !prev && !(w->prio == DCTL_PRIO_BULK && bulk_full(jvd));
+  if (prev) {
+    w->next = prev->next;
+    prev->next = w;
+  } else {
+    w->next = jvd->queue_head;
+    jvd->queue_head = w;
+  }
+  if (!w->next) jvd->queue_tail = w;
+  if (++jvd->queue_len > jvd->queue_max) jvd->queue_max = jvd->queue_len;
+  jvd->queued++;
+  return 0;
+}
+
+static void queue_leave(JVD *jvd, DCWaiter *w, int admitted) {
+  DCWaiter *prev = NULL, *cptr = jvd->queue_head;
+  while (cptr && cptr != w) {
+    prev = cptr;
+    cptr = cptr->next;
+  }
+  assert(cptr);
+  if (prev) prev->next = w->next;
+  else jvd->queue_head = w->next;
+  if (jvd->queue_tail == w) jvd->queue_tail = prev;
+  jvd->queue_len--;
+  pthread_cond_destroy(&w->cond);
+  if (admitted) {
+    jvd->wait_ms[jvd->wait_n++ % DCTL_WAIT_SAMPLES] = dctrl_now() - w->since;
+  }
+  /* an unused grant goes to the next in line. After an admission more
+   * objects may be idle, let the next one try as well. */
+  if (w->granted || admitted) {
+    queue_grant(jvd);
+  }
+}
+
+/* wait until a decoder object was released for this request
+ * @return 0 on success, non-zero if the deadline passed
+ */
+static int queue_wait(JVD *jvd, DCWaiter *w, const struct timespec *deadline) {
+  while (!w->granted) {
+    if (pthread_cond_timedwait(&w->cond, &jvd->lock_avail, deadline) && !w->granted) {
+      return -1;
+    }
+  }
+  w->granted = 0;
+  return 0;
+}
+
+/* queue up (if not yet queued) and wait for a turn to look for a decoder again
+ * @return 0: try again, -1: the deadline can not be met, the request left the queue
+ */
+static int admission_wait(JVD *jvd, DCWaiter *w, int *queued, const struct timespec *deadline) {
+  int rv = 0;
+  pthread_mutex_lock(&jvd->lock_avail);
+  if (!*queued) {
+    if (queue_enter(jvd, w, jvd->queue_timeout - (dctrl_now() - w->since))) {
+      pthread_mutex_unlock(&jvd->lock_avail);
+      return -1;
+    }
+    *queued = 1;
+  }
+  if (queue_wait(jvd, w, deadline)) {
+    queue_leave(jvd, w, 0);
+    jvd->timedout++;
+    *queued = 0;
+    rv = -1;
+  }
+  pthread_mutex_unlock(&jvd->lock_avail);
+  return rv;
+}
+
+/* bulk requests claim a slot before looking for a decoder object
+ * @return 0 on success, -1 if bulk requests use all decoder objects they may
+ */
+static int bulk_reserve(JVD *jvd) {
+  int rv = -1;
+  pthread_mutex_lock(&jvd->lock_avail);
+  if (!bulk_full(jvd)) {
+    jvd->bulk_used++;
+    rv = 0;
+  }
+  pthread_mutex_unlock(&jvd->lock_avail);
+  return rv;
+}
+
+/* return a slot that did not lead to a decoder object */
+static void bulk_unreserve(JVD *jvd) {
+  pthread_mutex_lock(&jvd->lock_avail);
+  jvd->bulk_used--;
+  /* a release may have skipped bulk requests meanwhile */
+  queue_grant(jvd);
+  pthread_mutex_unlock(&jvd->lock_avail);
+}
+
+/* leave the queue once a decoder was found (or opening the file failed) */
+static void admission_done(JVD *jvd, DCWaiter *w, int *queued) {
+  if (!*queued) {
+    return;
+  }
+  pthread_mutex_lock(&jvd->lock_avail);
+  queue_leave(jvd, w, 1);
+  pthread_mutex_unlock(&jvd->lock_avail);
+  *queued = 0;
+}
+
+static unsigned int avail_seq(JVD *jvd) {
+  unsigned int seq;
+  pthread_mutex_lock(&jvd->lock_avail);
+  seq = jvd->avail_seq;
+  pthread_mutex_unlock(&jvd->lock_avail);
+  return seq;
+}
+
+/* wait until a decoder object was released after \a seq was read
+ * @param deadline absolute time to give up, NULL: wait forever
+ * @return 0 if an object was released, non-zero on timeout
+ */
+static int wait_avail(JVD *jvd, unsigned int seq, const struct timespec *deadline) {
+  int rv;
+  pthread_mutex_lock(&jvd->lock_avail);
+  while (jvd->avail_seq == seq) {
+    if (!deadline) {
+      pthread_cond_wait(&jvd->cond_avail, &jvd->lock_avail);
+    } else if (pthread_cond_timedwait(&jvd->cond_avail, &jvd->lock_avail, deadline)) {
+      break;
+    }
+  }
+  rv = jvd->avail_seq == seq;
+  pthread_mutex_unlock(&jvd->lock_avail);
+  return rv;
+}
+
+static JVOBJECT *newjvo (JVD *jvd) {
   debugmsg(DEBUG_DCTL, "DCTL: newjvo() allocated new decoder object\n");
   JVOBJECT *n = calloc(1, sizeof(JVOBJECT));
   n->fmt = AV_PIX_FMT_NONE;
+  n->lowres = -1;
   n->frame = -1;
+  n->jvd = jvd;
   pthread_mutex_init(&n->lock, NULL);
-  JVOBJECT *cptr = jvo;
-  pthread_mutex_lock(appendlock);
+  JVOBJECT *cptr = jvd->jvo;
+  pthread_mutex_lock(&jvd->lock_jvo);
   while (cptr && cptr->next) cptr = cptr->next;
   if (cptr) cptr->next = n;
-  pthread_mutex_unlock(appendlock);
+  pthread_mutex_unlock(&jvd->lock_jvo);
   return(n);
 }
 
-/* return idle decoder-object for given file-id
- * prefer decoders with nearby (lower) frame-number
- *
- * this function is non-blocking (no locking):
- * there is no guarantee that the returned object's state
- * was not changed meanwhile.
+/* Decoder index
+ * Decoder objects that are assigned to a file are kept per file-ID:
+ * open decoders in an array sorted by the frame that was decoded last,
+ * and idle ones in a list of open and a list of closed objects, most
+ * recently used first. An idle pre-opened decoder is kept apart.
+ * Idle objects of all files are also kept in a global LRU list,
+ * objects without file in a spare list.
+ * Objects that are claimed by a request (or opened) are not idle,
+ * they return to the idle lists when released.
+ * NB. lock_idx needs to be held when calling these
  */
-static JVOBJECT *testjvd(JVOBJECT *jvo, unsigned short id, int fmt, int64_t frame) {
-  JVOBJECT *cptr;
-  JVOBJECT *dec_closed = NULL;
-  JVOBJECT *dec_open = NULL;
-  time_t lru_open = time(NULL) + 1;
-  time_t lru_closed = time(NULL) + 1;
-  int64_t framediff = -1;
-  int found = 0, avail = 0;
 
-  for (cptr = jvo; cptr; cptr = cptr->next) {
-    if (!(cptr->flags&VOF_VALID) || cptr->id != id) {
-      continue;
+/* first slot with a frame-number larger than the given one */
+static int idx_upper(DCFile *f, int64_t frame) {
+  int lo = 0, hi = f->n_open;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (f->dec[mid]->frame <= frame) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
-    if (fmt != AV_PIX_FMT_NONE && cptr->fmt != fmt
-        && cptr->fmt != AV_PIX_FMT_NONE
-        ) {
-      continue;
+  }
+  return lo;
+}
+
+static void idx_insert(DCFile *f, JVOBJECT *jvo) {
+  int i;
+  if (f->n_open == f->size) {
+    f->size = f->size ? f->size * 2 : 4;
+    f->dec = realloc(f->dec, f->size * sizeof(JVOBJECT*));
+  }
+  i = idx_upper(f, jvo->frame);
+  memmove(&f->dec[i + 1], &f->dec[i], (f->n_open - i) * sizeof(JVOBJECT*));
+  f->dec[i] = jvo;
+  f->n_open++;
+}
+
+static void idx_unlink(DCFile *f, JVOBJECT *jvo) {
+  int i;
+  for (i = idx_upper(f, jvo->frame) - 1; i >= 0 && f->dec[i] != jvo; --i) ;
+  assert(i >= 0);
+  memmove(&f->dec[i], &f->dec[i + 1], (f->n_open - i - 1) * sizeof(JVOBJECT*));
+  f->n_open--;
+}
+
+static void lru_unlink(JVD *jvd, JVOBJECT *jvo) {
+  if (jvo->lru_prev) jvo->lru_prev->lru_next = jvo->lru_next;
+  else jvd->lru_head = jvo->lru_next;
+  if (jvo->lru_next) jvo->lru_next->lru_prev = jvo->lru_prev;
+  else jvd->lru_tail = jvo->lru_prev;
+  jvo->lru_prev = jvo->lru_next = NULL;
+}
+
+static void lru_push(JVD *jvd, JVOBJECT *jvo) {
+  jvo->lru_prev = NULL;
+  jvo->lru_next = jvd->lru_head;
+  if (jvd->lru_head) jvd->lru_head->lru_prev = jvo;
+  else jvd->lru_tail = jvo;
+  jvd->lru_head = jvo;
+}
+
+/* per file idle lists */
+static void fl_unlink(JVOBJECT **head, JVOBJECT **tail, JVOBJECT *jvo) {
+  if (jvo->fl_prev) jvo->fl_prev->fl_next = jvo->fl_next;
+  else *head = jvo->fl_next;
+  if (jvo->fl_next) jvo->fl_next->fl_prev = jvo->fl_prev;
+  else *tail = jvo->fl_prev;
+  jvo->fl_prev = jvo->fl_next = NULL;
+}
+
+static void fl_push(JVOBJECT **head, JVOBJECT **tail, JVOBJECT *jvo) {
+  jvo->fl_prev = NULL;
+  jvo->fl_next = *head;
+  if (*head) (*head)->fl_prev = jvo;
+  else *tail = jvo;
+  *head = jvo;
+}
+
+static DCFile *idx_file(JVD *jvd, JVOBJECT *jvo) {
+  DCFile *f;
+  HASH_FIND(hh, jvd->files, &jvo->id, sizeof(unsigned short), f);
+  assert(f);
+  return f;
+}
+
+/* take an object off the idle lists */
+static void idle_unlink(JVD *jvd, DCFile *f, JVOBJECT *jvo) {
+  if (jvo->idle == 1) {
+    fl_unlink(&f->open_head, &f->open_tail, jvo);
+  } else if (jvo->idle == 2) {
+    fl_unlink(&f->closed_head, &f->closed_tail, jvo);
+  } else if (jvo->idle == 3) {
+    f->ready = NULL;
+  }
+  if (jvo->idle) {
+    lru_unlink(jvd, jvo);
+  }
+  jvo->idle = 0;
+}
+
+/* add an object that was just assigned to a file,
+ * it is claimed by the caller to be opened */
+static void idx_add(JVD *jvd, JVOBJECT *jvo) {
+  DCFile *f;
+  pthread_mutex_lock(&jvd->lock_idx);
+  assert(!jvo->indexed);
+  HASH_FIND(hh, jvd->files, &jvo->id, sizeof(unsigned short), f);
+  if (!f) {
+    f = calloc(1, sizeof(DCFile));
+    f->id = jvo->id;
+    HASH_ADD(hh, jvd->files, id, sizeof(unsigned short), f);
+  }
+  f->n++;
+  jvo->idle = 0;
+  jvo->sorted = 0;
+  jvo->indexed = 1;
+  pthread_mutex_unlock(&jvd->lock_idx);
+}
+
+/* remove an object from the index, before its file-ID is cleared.
+ * @param spare add it to the spare list, otherwise the caller keeps it
+ */
+static void idx_remove(JVD *jvd, JVOBJECT *jvo, int spare) {
+  void *keymap = NULL;
+  pthread_mutex_lock(&jvd->lock_idx);
+  if (jvo->indexed == 1) {
+    DCFile *f = idx_file(jvd, jvo);
+    idle_unlink(jvd, f, jvo);
+    if (jvo->sorted) {
+      idx_unlink(f, jvo);
+      jvo->sorted = 0;
     }
-    found++;
+    if (--f->n == 0) {
+      assert(f->n_open == 0);
+      HASH_DEL(jvd->files, f);
+      keymap = f->keymap;
+      free(f->dec);
+      free(f);
+    }
+  } else if (jvo->indexed == 2 && !spare) {
+    JVOBJECT **pp = &jvd->spare;
+    while (*pp != jvo) pp = &(*pp)->lru_next;
+    *pp = jvo->lru_next;
+    jvo->lru_next = NULL;
+  }
+  if (spare && jvo->indexed != 2) {
+    jvo->lru_next = jvd->spare;
+    jvd->spare = jvo;
+    jvo->indexed = 2;
+  } else if (!spare) {
+    jvo->indexed = 0;
+  }
+  pthread_mutex_unlock(&jvd->lock_idx);
+  ff_keymap_free(keymap);
+}
 
-    if (cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO)) {
-      continue;
+/* an object is about to be freed */
+static void idx_free(JVD *jvd, JVOBJECT *jvo) {
+  idx_remove(jvd, jvo, 0);
+  pthread_mutex_lock(&jvd->lock_idx);
+  jvd->n_objects--;
+  pthread_mutex_unlock(&jvd->lock_idx);
+}
+
+/* the object is going to be used (or opened) by a request */
+static void idx_claim(JVD *jvd, JVOBJECT *jvo) {
+  pthread_mutex_lock(&jvd->lock_idx);
+  if (jvo->indexed == 1) {
+    idle_unlink(jvd, idx_file(jvd, jvo), jvo);
+  }
+  pthread_mutex_unlock(&jvd->lock_idx);
+}
+
+/* the object is no longer used, call with the object locked */
+static void idx_release(JVD *jvd, JVOBJECT *jvo) {
+  pthread_mutex_lock(&jvd->lock_idx);
+  if (jvo->indexed == 1 && !jvo->idle) {
+    DCFile *f = idx_file(jvd, jvo);
+    if ((jvo->flags&VOF_OPEN) && jvo->warm && !f->ready) {
+      f->ready = jvo;
+      jvo->idle = 3;
+    } else if (jvo->flags&VOF_OPEN) {
+      fl_push(&f->open_head, &f->open_tail, jvo);
+      jvo->idle = 1;
+    } else {
+      fl_push(&f->closed_head, &f->closed_tail, jvo);
+      jvo->idle = 2;
     }
-    avail++;
+    lru_push(jvd, jvo);
+  }
+  pthread_mutex_unlock(&jvd->lock_idx);
+}
 
-    if (!(cptr->flags&VOF_OPEN)) {
-      if (cptr->lru < lru_closed) {
-        lru_closed = cptr->lru;
-        dec_closed = cptr;
+/* the decoder was opened (claimed) or closed (claimed or idle) */
+static void idx_open(JVD *jvd, JVOBJECT *jvo, int open) {
+  pthread_mutex_lock(&jvd->lock_idx);
+  if (jvo->indexed == 1 && jvo->sorted != open) {
+    DCFile *f = idx_file(jvd, jvo);
+    if (open) {
+      idx_insert(f, jvo);
+    } else {
+      idx_unlink(f, jvo);
+      if (jvo->idle == 1) {
+        fl_unlink(&f->open_head, &f->open_tail, jvo);
+      } else if (jvo->idle == 3) {
+        f->ready = NULL;
+      }
+      if (jvo->idle == 1 || jvo->idle == 3) {
+        fl_push(&f->closed_head, &f->closed_tail, jvo);
+        jvo->idle = 2;
       }
-      continue;
     }
+    jvo->sorted = open;
+  }
+  pthread_mutex_unlock(&jvd->lock_idx);
+}
 
-    if (frame < 0) { // LRU only
-      if (cptr->lru < lru_open) {
-        lru_open = cptr->lru;
-        dec_open = cptr;
-      }
-    } else { // check frame proximity
-      int64_t fd = frame - cptr->frame;
-      if (framediff < 0 || (fd >= 0 && fd == framediff)) {
-        if (cptr->lru < lru_open) {
-          lru_open = cptr->lru;
-          dec_open = cptr;
-          if (fd > 0)
-            framediff = fd;
-        }
-      } else if (fd >= 0 && fd < framediff) {
-          lru_open = cptr->lru;
-          dec_open = cptr;
-          framediff = fd;
+/* update the position of a decoder after decoding */
+static void idx_move(JVD *jvd, JVOBJECT *jvo, int64_t frame) {
+  pthread_mutex_lock(&jvd->lock_idx);
+  if (jvo->sorted && jvo->frame != frame) {
+    DCFile *f = idx_file(jvd, jvo);
+    idx_unlink(f, jvo);
+    jvo->frame = frame;
+    idx_insert(f, jvo);
+  } else {
+    jvo->frame = frame;
+  }
+  pthread_mutex_unlock(&jvd->lock_idx);
+}
+
+/* remember the keyframe lookup of the file once a decoder has the index.
+ * Call with the object VOF_USED by the caller: the decoder is not
+ * modified meanwhile. lock_idx must not be held.
+ */
+static void file_keymap(JVD *jvd, JVOBJECT *jvo) {
+  DCFile *f;
+  void *km;
+  int known;
+  if (!jvo->decoder) return;
+  pthread_mutex_lock(&jvd->lock_idx);
+  HASH_FIND(hh, jvd->files, &jvo->id, sizeof(unsigned short), f);
+  known = !f || f->keymap;
+  pthread_mutex_unlock(&jvd->lock_idx);
+  if (known || !(km = ff_keymap_create(jvo->decoder))) {
+    return;
+  }
+  pthread_mutex_lock(&jvd->lock_idx);
+  HASH_FIND(hh, jvd->files, &jvo->id, sizeof(unsigned short), f);
+  if (f && !f->keymap) {
+    f->keymap = km;
+    km = NULL;
+  }
+  pthread_mutex_unlock(&jvd->lock_idx);
+  ff_keymap_free(km);
+}
+
+/* keyframe at or before the given frame, -1 if not known.
+ * NB. lock_idx needs to be held when calling this
+ */
+static int64_t file_keyframe(DCFile *f, int64_t frame) {
+  return f->keymap ? ff_keymap_lookup(f->keymap, frame) : -1;
+}
+
+static int usablejvo(JVOBJECT *cptr, int fmt, int lowres) {
+  if (fmt != AV_PIX_FMT_NONE && cptr->fmt != fmt
+      && cptr->fmt != AV_PIX_FMT_NONE
+      ) {
+    return 0;
+  }
+  if (lowres >= 0 && cptr->lowres >= 0 && cptr->lowres != lowres) {
+    return 0;
+  }
+  return !(cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO));
+}
+
+/* return idle decoder-object for given file-id
+ *
+ * Decoding the frame costs the distance from the frame a decoder is at,
+ * if it can decode forward without seeking: from a position between the
+ * keyframe (or DCTL_SEQ_FRAMES if that is not known) and the frame.
+ * The nearest such decoder is found by binary search.
+ * Any other open decoder has to seek to the keyframe and decode from
+ * there, at the same cost: the least recently used idle one is picked,
+ * so that those positioned for other requests are kept. The pre-opened
+ * decoder is left to a new request, unless no other one is idle.
+ * Otherwise a closed object of the file is returned, that needs to be
+ * opened first.
+ *
+ * this function does not lock decoder objects:
+ * there is no guarantee that the returned object's state
+ * was not changed meanwhile.
+ */
+static JVOBJECT *testjvd(JVD *jvd, unsigned short id, int fmt, int lowres, int64_t frame) {
+  JVOBJECT *dec_closed = NULL;
+  JVOBJECT *dec_open = NULL;
+  DCFile *f;
+  int i;
+
+  pthread_mutex_lock(&jvd->lock_idx);
+  HASH_FIND(hh, jvd->files, &id, sizeof(unsigned short), f);
+  if (!f) {
+    pthread_mutex_unlock(&jvd->lock_idx);
+    return NULL;
+  }
+
+  if (frame >= 0) {
+    const int64_t key = file_keyframe(f, frame);
+    const int64_t seq = key >= 0 ? key : frame - DCTL_SEQ_FRAMES;
+    for (i = idx_upper(f, frame) - 1; i >= 0 && f->dec[i]->frame >= seq; --i) {
+      if (usablejvo(f->dec[i], fmt, lowres)) {
+        dec_open = f->dec[i];
+        break;
       }
     }
-  } /* end loop over all decoder objects */
+  }
+
+  /* if the LRU one has a different format, a closed one is opened instead */
+  if (!dec_open && f->open_tail && usablejvo(f->open_tail, fmt, lowres)) {
+    dec_open = f->open_tail;
+  }
+
+  if (!dec_open && f->ready && usablejvo(f->ready, fmt, lowres)) {
+    dec_open = f->ready;
+  }
+
+  if (!dec_open && f->closed_tail && usablejvo(f->closed_tail, fmt, lowres)) {
+    dec_closed = f->closed_tail;
+  }
 
-  debugmsg(DEBUG_DCTL, "DCTL: found %d avail. from %d total decoder(s) for file-id:%d. [%s]\n",
-      avail, found, id, dec_open?"open":dec_closed?"closed":"N/A");
+  debugmsg(DEBUG_DCTL, "DCTL: %d decoder(s) for file-id:%d. [%s]\n",
+      f->n, id, dec_open?"open":dec_closed?"closed":"N/A");
+  pthread_mutex_unlock(&jvd->lock_idx);
 
   if (dec_open) {
     return(dec_open);
   }
-  if (dec_closed) {
-    return(dec_closed);
-  }
-  return(NULL);
+  return(dec_closed);
 }
 
 static void hashref_delete_jvo(JVD *jvd, JVOBJECT *jvo) {
@@ -245,9 +851,49 @@ static void hashref_delete_jvo(JVD *jvd, JVOBJECT *jvo) {
   pthread_rwlock_unlock(&jvd->lock_jdh);
 }
 
+/* close the decoder, call with the object locked */
+static void closejvo(JVOBJECT *cptr) {
+  if (cptr->flags&VOF_OPEN) {
+    my_destroy(&cptr->decoder);
+    cptr->decoder = NULL;
+    cptr->flags &= ~VOF_OPEN;
+    cptr->fmt = AV_PIX_FMT_NONE;
+    cptr->lowres = -1;
+    cptr->warm = 0;
+    idx_open(cptr->jvd, cptr, 0);
+  }
+}
+
+/* detach the object from its file, call with the object locked */
+static void resetjvo(JVD *jvd, JVOBJECT *cptr) {
+  /* objects without file are spare already, or just being claimed */
+  if (cptr->flags&VOF_VALID) {
+    idx_remove(jvd, cptr, 1);
+  }
+  cptr->id = 0;
+  cptr->lru = 0;
+  cptr->hitcount_info = 0;
+  cptr->hitcount_decoder = 0;
+  cptr->frame = -1;
+  cptr->cancel = 0;
+  cptr->flags &= ~VOF_VALID;
+}
+
+/* a purge gave up waiting for the object, invalidate it once it is released.
+ * call with the object locked, after clearing VOF_USED or VOF_INFO */
+static void canceljvo(JVD *jvd, JVOBJECT *cptr) {
+  if (!cptr->cancel || (cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO))) {
+    return;
+  }
+  closejvo(cptr);
+  hashref_delete_jvo(jvd, cptr);
+  resetjvo(jvd, cptr);
+}
+
 /* clear object information
  if f==4 force also to flush data (even if it's in USE -- may segfault)
- if f==3 force also to flush data (wait fo it to become unused)
+ if f==3 force also to flush data (wait fo it to become unused, at most DCTL_UNPIN_TIMEOUT,
+        decoders that are still in use after that are invalidated when released)
  if f==2 all /unused objects/ are invalidated and freed.
  if f==1 all /unused objects/ are invalidated.
  if f==0 all /unused and open objects/ are closed.
@@ -260,6 +906,7 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
   JVOBJECT *cptr = jvd->jvo;
   JVOBJECT *prev = jvd->jvo;
   int total = 0, busy = 0, cleared = 0, freed = 0, count = 0, skipped = 0;
+  struct timespec deadline;
   time_t now;
 
   if (f > 1) {
@@ -272,14 +919,13 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
 #endif
     jvd->purge_in_progress++;
     while (jvd->busycnt > 0) {
-      pthread_mutex_unlock(&jvd->lock_busy);
-      mymsleep(5);
-      pthread_mutex_lock(&jvd->lock_busy);
+      pthread_cond_wait(&jvd->cond_busy, &jvd->lock_busy);
     }
   }
 
   pthread_mutex_lock(l);
   now = time(NULL);
+  mydeadline(&deadline, DCTL_UNPIN_TIMEOUT);
 
   while (cptr) {
     JVOBJECT *mem = cptr;
@@ -306,12 +952,25 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
 	continue;
       }
       if (f < 4) {
+	int timeout = 0;
 	dlog(DLOG_WARNING, "DTCL: waiting for decoder to be unlocked.\n");
+	/* streams keep their decoder until they end, ask them to stop */
+	cptr->cancel = cptr->pinned;
         do {
+          /* the object is released only after the flags were cleared */
+          const unsigned int seq = avail_seq(jvd);
           pthread_mutex_unlock(&cptr->lock);
-          mymsleep(5);
+          timeout = wait_avail(jvd, seq, &deadline);
           pthread_mutex_lock(&cptr->lock);
-        } while (cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO));
+        } while ((cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO)) && !timeout);
+	if (cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO)) {
+	  dlog(DLOG_WARNING, "DTCL: decoder is still in use, invalidating it when released.\n");
+	  cptr->cancel = 1;
+	  pthread_mutex_unlock(&cptr->lock);
+	  busy++;
+	  prev = cptr; cptr = cptr->next;
+	  continue;
+	}
       } else {
         /* we really should not do this */
         dlog(DLOG_ERR, "DCTL: request to free an active decoder.\n");
@@ -320,22 +979,11 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
       }
     }
 
-    if (cptr->flags&VOF_OPEN) {
-      my_destroy(&cptr->decoder);
-      cptr->decoder = NULL;
-      cptr->flags &= ~VOF_OPEN;
-      cptr->fmt = AV_PIX_FMT_NONE;
-    }
-
+    closejvo(cptr);
     hashref_delete_jvo(jvd, cptr);
 
     if (f > 0) {
-      cptr->id = 0;
-      cptr->lru = 0;
-      cptr->hitcount_info = 0;
-      cptr->hitcount_decoder = 0;
-      cptr->frame = -1;
-      cptr->flags &= ~VOF_VALID;
+      resetjvo(jvd, cptr);
     }
 
     pthread_mutex_unlock(&cptr->lock);
@@ -344,6 +992,7 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
     if (f > 1 && mem != jvd->jvo) {
       assert (prev != mem);
       prev->next = cptr;
+      idx_free(jvd, mem);
       pthread_mutex_destroy(&mem->lock);
       free(mem);
       freed++;
@@ -356,6 +1005,7 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
 
   if (f > 1) {
     jvd->purge_in_progress--;
+    pthread_cond_broadcast(&jvd->cond_busy);
     pthread_mutex_unlock(&jvd->lock_busy);
   }
 
@@ -363,57 +1013,52 @@ static int clearjvo(JVD *jvd, int f, int id, int age, pthread_mutex_t *l) {
   return (cleared);
 }
 
-
-//get some unused allocated jvo or create one.
-static JVOBJECT *getjvo(JVD *jvd) {
-  int cnt_total = 0;
-  JVOBJECT *dec_closed = NULL;
-  JVOBJECT *dec_open = NULL;
-  time_t lru = time(NULL) + 1;
-  JVOBJECT *cptr = jvd->jvo;
-#if 1 // garbage collect, close decoders not used since > 10 mins
-  clearjvo(jvd, 1, -1, 600, &jvd->lock_jvo);
-#endif
-  while (cptr) {
-    if ((cptr->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_PENDING|VOF_INFO)) == 0) {
-      return (cptr);
-    }
-
-    if (!(cptr->flags&(VOF_USED|VOF_OPEN|VOF_PENDING|VOF_INFO)) && (cptr->lru < lru)) {
-      lru = cptr->lru;
-      dec_closed = cptr;
-    } else if (!(cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO)) && (cptr->lru < lru)) {
-      lru = cptr->lru;
-      dec_open = cptr;
-    }
-    cptr = cptr->next;
-    cnt_total++;
+/* get some unused allocated jvo or create one.
+ * @param recycle if no spare object is left, close the least recently used idle decoder
+ */
+static JVOBJECT *getjvo(JVD *jvd, int recycle) {
+  JVOBJECT *cptr;
+  int create = 0;
+
+  pthread_mutex_lock(&jvd->lock_idx);
+  if ((cptr = jvd->spare)) {
+    jvd->spare = cptr->lru_next;
+    cptr->lru_next = NULL;
+    cptr->indexed = 0;
+    pthread_mutex_unlock(&jvd->lock_idx);
+    return (cptr);
   }
 
-  if (dec_closed) {
-    cptr = dec_closed;
-  } else if (dec_open) {
-    cptr = dec_open;
-  }
-  debugmsg(DEBUG_DCTL, "DCTL: %d/%d decoders; avail: closed: %s open: %s\n",
-      cnt_total, jvd->max_objects, dec_closed?"Y":"N", dec_open?"Y":"N");
+  /* least recently used idle object */
+  cptr = jvd->lru_tail;
 
   // TODO prefer to allocate a new decoder object IFF
   // decoder for same file exists but with different format.
-  if (cnt_total < 4
-      && cnt_total < jvd->max_objects)
-    return(newjvo(jvd->jvo, &jvd->lock_jvo));
+  if (jvd->n_objects < jvd->max_objects && (jvd->n_objects < 4 || !cptr || !recycle)) {
+    jvd->n_objects++;
+    create = 1;
+  }
+  debugmsg(DEBUG_DCTL, "DCTL: %d/%d decoders; avail: %s\n",
+      jvd->n_objects, jvd->max_objects, create ? "new" : cptr ? "LRU" : "none");
+  pthread_mutex_unlock(&jvd->lock_idx);
+
+  if (create) {
+    return(newjvo(jvd));
+  }
 
-  if (cptr && !pthread_mutex_trylock(&cptr->lock)) {
-      if (!(cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO))) {
+  if (cptr && recycle && !pthread_mutex_trylock(&cptr->lock)) {
+      if (!(cptr->flags&(VOF_USED|VOF_PENDING|VOF_INFO)) && (cptr->flags&VOF_VALID)) {
 
         if (cptr->flags&(VOF_OPEN)) {
           my_destroy(&cptr->decoder); // close it.
           cptr->decoder = NULL; // not really need..
           cptr->fmt = AV_PIX_FMT_NONE;
+          cptr->lowres = -1;
+          cptr->warm = 0;
         }
 
         hashref_delete_jvo(jvd, cptr);
+        idx_remove(jvd, cptr, 0);
 
         cptr->id = 0;
         cptr->lru = 0;
@@ -427,9 +1072,6 @@ static JVOBJECT *getjvo(JVD *jvd) {
     }
     pthread_mutex_unlock(&cptr->lock);
   }
-
-  if (cnt_total < jvd->max_objects)
-    return(newjvo(jvd->jvo, &jvd->lock_jvo));
   return (NULL);
 }
 
@@ -515,6 +1157,47 @@ static unsigned short get_id(JVD *jvd, const char *fn, void *vc) {
   return rv;
 }
 
+/* remember the geometry of a file, once a decoder opened it */
+static void set_vidinfo(JVD *jvd, unsigned short id, void *decoder) {
+  VidMap *vm;
+  VInfo ji;
+  my_get_info(decoder, &ji);
+  pthread_rwlock_wrlock(&jvd->lock_vml);
+  HASH_FIND(hr, jvd->vmr, &id, sizeof(unsigned short), vm);
+  if (vm) {
+    vm->width = ji.movie_width;
+    vm->height = ji.movie_height;
+    vm->max_lowres = ff_get_max_lowres(decoder);
+  }
+  pthread_rwlock_unlock(&jvd->lock_vml);
+}
+
+/* reduced quality decode level for the given output size.
+ * Decoding at 1/2^level must not be smaller than the output.
+ */
+static int lowres_level(JVD *jvd, unsigned short id, int w, int h) {
+  VidMap *vm;
+  int level = 0;
+  if (jvd->lowres_max < 1 || w <= 0 || h <= 0) {
+    return 0;
+  }
+  pthread_rwlock_rdlock(&jvd->lock_vml);
+  HASH_FIND(hr, jvd->vmr, &id, sizeof(unsigned short), vm);
+  if (vm && vm->width > 0) {
+    while (level < jvd->lowres_max
+        && (vm->width >> (level + 1)) >= w
+        && (vm->height >> (level + 1)) >= h) {
+      ++level;
+    }
+    /* levels the codec does not support would only differ in the key */
+    if (level > vm->max_lowres) {
+      level = vm->max_lowres > 0 ? vm->max_lowres : (jvd->lowres_skip > 0 ? 1 : 0);
+    }
+  }
+  pthread_rwlock_unlock(&jvd->lock_vml);
+  return level;
+}
+
 static char *get_fn(JVD *jvd, unsigned short id) {
   VidMap *vm;
   pthread_rwlock_rdlock(&jvd->lock_vml);
@@ -542,30 +1225,28 @@ static void release_id(JVD *jvd, unsigned short id) {
 }
 
 
-static JVOBJECT *new_video_object(JVD *jvd, unsigned short id, int fmt) {
+/* claim an unused decoder object for the given file,
+ * returns NULL if all are busy
+ * @param recycle see \ref getjvo
+ */
+static JVOBJECT *new_video_object(JVD *jvd, unsigned short id, int fmt, int lowres, int recycle) {
   JVOBJECT *jvo, *jvx;
   debugmsg(DEBUG_DCTL, "new_video_object()\n");
-  do {
-    jvo = getjvo(jvd);
-    if (!jvo) {
-      mymsleep(5);
-      sched_yield();
-      return NULL;
-    }
-    if (pthread_mutex_trylock(&jvo->lock)) {
-      continue;
-    }
-    if ((jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_PENDING|VOF_INFO))) {
-      pthread_mutex_unlock(&jvo->lock);
-      continue;
-    }
-  } while (!jvo);
+  /* objects returned by getjvo() are not known to other threads */
+  jvo = getjvo(jvd, recycle);
+  if (!jvo) {
+    return NULL;
+  }
+  pthread_mutex_lock(&jvo->lock);
+  assert(!(jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_PENDING|VOF_INFO)));
 
 
   jvo->id = id;
   jvo->fmt = fmt == AV_PIX_FMT_NONE ? DEFAULT_PIX_FMT : fmt;
+  jvo->lowres = lowres < 0 ? 0 : lowres;
   jvo->frame = -1;
   jvo->flags |= VOF_VALID;
+  idx_add(jvd, jvo);
 
   pthread_rwlock_wrlock(&jvd->lock_jdh);
   HASH_FIND(hhi, jvd->jvi, &id, sizeof(unsigned short), jvx);
@@ -598,20 +1279,181 @@ static int release_video_object(JVD *jvd, char *fn) {
 
 #define BUSYDEC(jvd) \
   pthread_mutex_lock(&jvd->lock_busy); \
-  jvd->busycnt--; \
+  if (--jvd->busycnt == 0 && jvd->purge_in_progress) \
+    pthread_cond_broadcast(&jvd->cond_busy); \
   pthread_mutex_unlock(&jvd->lock_busy); \
 
 #define BUSYADD(jvd) \
-  while (jvd->purge_in_progress) mymsleep(5); \
   pthread_mutex_lock(&jvd->lock_busy); \
+  while (jvd->purge_in_progress) \
+    pthread_cond_wait(&jvd->cond_busy, &jvd->lock_busy); \
   jvd->busycnt++; \
   pthread_mutex_unlock(&jvd->lock_busy); \
 
 
+/* Pre-opening decoders
+ * A file is in demand when concurrent requests need more than one decoder
+ * for it. Opening a file is slow, so another decoder is opened in the
+ * background while there is room for it, instead of when the next
+ * request arrives. Idle decoders of other files are never closed for this.
+ */
+
+/* number of decoder objects assigned to the given file */
+static int file_decoders(JVD *jvd, unsigned short id) {
+  DCFile *f;
+  int n;
+  pthread_mutex_lock(&jvd->lock_idx);
+  HASH_FIND(hh, jvd->files, &id, sizeof(unsigned short), f);
+  n = f ? f->n : 0;
+  pthread_mutex_unlock(&jvd->lock_idx);
+  return n;
+}
+
+/* queue a file to pre-open a decoder for */
+static void warm_request(JVD *jvd, unsigned short id, int fmt, int lowres) {
+  int i;
+  pthread_mutex_lock(&jvd->lock_warm);
+  if (!jvd->warm_run || jvd->warm_n >= DCTL_WARM_QUEUE) {
+    pthread_mutex_unlock(&jvd->lock_warm);
+    return;
+  }
+  for (i = 0; i < jvd->warm_n; ++i) {
+    if (jvd->warm[i].id == id && jvd->warm[i].fmt == fmt && jvd->warm[i].lowres == lowres) {
+      pthread_mutex_unlock(&jvd->lock_warm);
+      return;
+    }
+  }
+  jvd->warm[jvd->warm_n].id = id;
+  jvd->warm[jvd->warm_n].fmt = fmt;
+  jvd->warm[jvd->warm_n].lowres = lowres;
+  ++jvd->warm_n;
+  pthread_cond_signal(&jvd->cond_warm);
+  pthread_mutex_unlock(&jvd->lock_warm);
+}
+
+/* open a spare decoder for the given file, unless one is ready already */
+static void warm_open(JVD *jvd, const DCWarm *r) {
+  JVOBJECT *jvo = NULL;
+  DCFile *f;
+  int ready = 0;
+  int pending = 0;
+  BUSYADD(jvd)
+
+  pthread_mutex_lock(&jvd->lock_idx);
+  HASH_FIND(hh, jvd->files, &r->id, sizeof(unsigned short), f);
+  if (f) {
+    ready = f->ready && usablejvo(f->ready, r->fmt, r->lowres);
+    jvo = f->closed_tail;
+  }
+  pthread_mutex_unlock(&jvd->lock_idx);
+
+  if (ready) {
+    BUSYDEC(jvd)
+    return;
+  }
+  if (!jvo) {
+    jvo = new_video_object(jvd, r->id, r->fmt, r->lowres, 0);
+  }
+  if (!jvo) {
+    debugmsg(DEBUG_DCTL, "DCTL: no room to pre-open a decoder for file-id:%d\n", r->id);
+    BUSYDEC(jvd)
+    return;
+  }
+
+  pthread_mutex_lock(&jvo->lock);
+  if ((jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_INFO|VOF_PENDING)) == (VOF_VALID) && jvo->id == r->id) {
+    jvo->flags |= VOF_PENDING;
+    jvo->lru = time(NULL);
+    idx_claim(jvd, jvo);
+    pending = 1;
+  }
+  pthread_mutex_unlock(&jvo->lock);
+
+  if (!pending) {
+    BUSYDEC(jvd)
+    return;
+  }
+
+  if (!my_open_movie(&jvo->decoder, get_fn(jvd, r->id), r->fmt, r->lowres, r->lowres > 0 ? jvd->lowres_skip : 0)) {
+    set_vidinfo(jvd, r->id, jvo->decoder);
+    pthread_mutex_lock(&jvo->lock);
+    jvo->fmt = r->fmt;
+    jvo->lowres = r->lowres;
+    jvo->flags |= VOF_OPEN;
+    jvo->flags &= ~VOF_PENDING;
+    jvo->warm = 1;
+    idx_open(jvd, jvo, 1);
+    idx_release(jvd, jvo);
+    pthread_mutex_unlock(&jvo->lock);
+    __sync_add_and_fetch(&jvd->warmed, 1);
+    debugmsg(DEBUG_DCTL, "DCTL: pre-opened a decoder for file-id:%d\n", r->id);
+    signal_avail(jvd, 0, 0);
+  } else {
+    /* leave it to the next request to report the error */
+    pthread_mutex_lock(&jvo->lock);
+    jvo->flags &= ~VOF_PENDING;
+    assert(!jvo->decoder);
+    idx_release(jvd, jvo);
+    pthread_mutex_unlock(&jvo->lock);
+    signal_avail(jvd, 0, 0);
+  }
+  BUSYDEC(jvd)
+}
+
+/* close decoders that were not used for a while */
+static void gcjvo(JVD *jvd) {
+  BUSYADD(jvd)
+  clearjvo(jvd, 1, -1, DCTL_GC_AGE, &jvd->lock_jvo);
+  BUSYDEC(jvd)
+}
+
+/* background thread: pre-opens decoders and
+ * runs the garbage collection every DCTL_GC_INTERVAL */
+static void *warm_thread(void *arg) {
+  JVD *jvd = (JVD*)arg;
+  struct timespec gc;
+  DCWarm r;
+  gc.tv_sec = time(NULL) + DCTL_GC_INTERVAL;
+  gc.tv_nsec = 0;
+  pthread_mutex_lock(&jvd->lock_warm);
+  while (1) {
+    while (jvd->warm_run && jvd->warm_n == 0) {
+      if (pthread_cond_timedwait(&jvd->cond_warm, &jvd->lock_warm, &gc) == ETIMEDOUT) {
+        break;
+      }
+    }
+    if (!jvd->warm_run) {
+      break;
+    }
+    if (time(NULL) >= gc.tv_sec) {
+      pthread_mutex_unlock(&jvd->lock_warm);
+      gcjvo(jvd);
+      gc.tv_sec = time(NULL) + DCTL_GC_INTERVAL;
+      pthread_mutex_lock(&jvd->lock_warm);
+      continue;
+    }
+    r = jvd->warm[0];
+    --jvd->warm_n;
+    memmove(jvd->warm, jvd->warm + 1, jvd->warm_n * sizeof(DCWarm));
+    pthread_mutex_unlock(&jvd->lock_warm);
+    warm_open(jvd, &r);
+    pthread_mutex_lock(&jvd->lock_warm);
+  }
+  pthread_mutex_unlock(&jvd->lock_warm);
+  return (NULL);
+}
+
 // lookup or create new decoder for file ID
-static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t frame, int *err) {
+static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int lowres, int64_t frame, int prio, int *err) {
   JVD *jvd = (JVD*)p;
   JVOBJECT *jvo = NULL;
+  struct timespec deadline;
+  DCWaiter w;
+  int queued = 0;
+  int busy;
+  /* info lookups do not occupy a decoder */
+  const int bulk = frame >= 0 && prio == DCTL_PRIO_BULK;
+  int slot = 0; // bulk: a decoder slot is reserved
   *err = 0;
   BUSYADD(jvd)
 
@@ -640,19 +1482,37 @@ static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t fra
     }
   }
 
+  w.since = dctrl_now();
+  w.prio = bulk ? DCTL_PRIO_BULK : DCTL_PRIO_INTERACTIVE;
+  mydeadline(&deadline, jvd->queue_timeout);
+
+  /* no overtaking, line up behind requests that are waiting already */
+  pthread_mutex_lock(&jvd->lock_avail);
+  busy = queue_busy(jvd, w.prio);
+  pthread_mutex_unlock(&jvd->lock_avail);
+
   while (1) {
     debugmsg(DEBUG_DCTL, "DCTL: get_decoder fileid=%i\n", id);
 
-    if (!jvo) {
-      int timeout = 40; // new_video_object() delays 5ms at a time.
-      do {
-        jvo = testjvd(jvd->jvo, id, fmt, frame);
-        if (!jvo) jvo = new_video_object(jvd, id, fmt);
-      } while (--timeout > 0 && !jvo);
+    if (!jvo && !busy && bulk && !slot) {
+      slot = !bulk_reserve(jvd);
+    }
+
+    if (!jvo && !busy && (!bulk || slot)) {
+      jvo = testjvd(jvd, id, fmt, lowres, frame);
+      if (!jvo) jvo = new_video_object(jvd, id, fmt, lowres, 1);
     }
 
     if (!jvo) {
-      dlog(DLOG_ERR, "DCTL: no decoder object available.\n");
+      busy = 0;
+      if (slot) {
+        bulk_unreserve(jvd);
+        slot = 0;
+      }
+      if (!admission_wait(jvd, &w, &queued, &deadline)) {
+        continue;
+      }
+      dlog(DLOG_WARNING, "DCTL: no decoder object available in time.\n");
       BUSYDEC(jvd)
       *err = 503; // try again
       return(NULL);
@@ -664,24 +1524,42 @@ static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t fra
       jvo = NULL;
       continue;
     }
+    if (jvo->id != id) {
+      /* re-assigned meanwhile */
+      pthread_mutex_unlock(&jvo->lock);
+      jvo = NULL;
+      continue;
+    }
 
     if ((jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_INFO|VOF_PENDING)) == (VOF_VALID)) {
       jvo->flags |= VOF_PENDING;
       jvo->lru = time(NULL);
+      idx_claim(jvd, jvo);
       pthread_mutex_unlock(&jvo->lock);
 
       if (fmt == AV_PIX_FMT_NONE) fmt = DEFAULT_PIX_FMT;
+      if (lowres < 0) lowres = 0;
 
-      if (!my_open_movie(&jvo->decoder, get_fn(jvd, jvo->id), fmt)) {
+      if (!my_open_movie(&jvo->decoder, get_fn(jvd, jvo->id), fmt, lowres, lowres > 0 ? jvd->lowres_skip : 0)) {
+        set_vidinfo(jvd, jvo->id, jvo->decoder);
+        if (frame >= 0 && file_decoders(jvd, id) > 1) {
+          /* the file is in demand, have another decoder ready */
+          warm_request(jvd, id, fmt, lowres);
+        }
         pthread_mutex_lock(&jvo->lock);
         jvo->fmt = fmt;
+        jvo->lowres = lowres;
         jvo->flags |= VOF_OPEN;
         jvo->flags &= ~VOF_PENDING;
+        idx_open(jvd, jvo, 1);
       } else {
         pthread_mutex_lock(&jvo->lock);
         jvo->flags &= ~VOF_PENDING;
         assert(!jvo->decoder);
+        idx_release(jvd, jvo);
         pthread_mutex_unlock(&jvo->lock);
+        admission_done(jvd, &w, &queued);
+        signal_avail(jvd, 0, slot);
         release_id(jvd, jvo->id); // mark ID as invalid
         dlog(DLOG_ERR, "DCTL: opening of movie file failed.\n");
         BUSYDEC(jvd)
@@ -696,13 +1574,24 @@ static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t fra
         jvo->infolock_refcnt++;
         jvo->flags |= VOF_INFO;
         pthread_mutex_unlock(&jvo->lock);
+        admission_done(jvd, &w, &queued);
         BUSYDEC(jvd)
         return(jvo);
       }
     } else {
       if ((jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID)) == (VOF_VALID|VOF_OPEN)) {
+        const int warm = jvo->warm;
         jvo->flags |= VOF_USED;
+        jvo->used_since = dctrl_now();
+        jvo->bulk = slot;
+        jvo->warm = 0;
+        idx_claim(jvd, jvo);
         pthread_mutex_unlock(&jvo->lock);
+        if (warm) {
+          /* the pre-opened decoder was needed, have the next one ready */
+          warm_request(jvd, id, jvo->fmt, jvo->lowres);
+        }
+        admission_done(jvd, &w, &queued);
         BUSYDEC(jvd)
         return(jvo);
       }
@@ -710,32 +1599,63 @@ static void * dctrl_get_decoder(void *p, unsigned short id, int fmt, int64_t fra
 
     pthread_mutex_unlock(&jvo->lock);
     debugmsg(DEBUG_DCTL, "DCTL: decoder object was busy.\n");
+    jvo = NULL;
   }
 }
 
 static void dctrl_release_decoder(void *dec) {
   JVOBJECT *jvo = (JVOBJECT *) dec;
+  double held;
+  int bulk;
+  file_keymap(jvo->jvd, jvo);
   pthread_mutex_lock(&jvo->lock);
   jvo->flags &= ~VOF_USED;
+  held = dctrl_now() - jvo->used_since;
+  bulk = jvo->bulk;
+  jvo->bulk = 0;
+  jvo->pinned = 0;
+  canceljvo(jvo->jvd, jvo);
+  if (!(jvo->flags&(VOF_PENDING|VOF_INFO))) {
+    idx_release(jvo->jvd, jvo);
+  }
   pthread_mutex_unlock(&jvo->lock);
+  signal_avail(jvo->jvd, held, bulk);
 }
 
 static void dctrl_release_infolock(void *dec) {
   JVOBJECT *jvo = (JVOBJECT *) dec;
+  int released = 0;
   pthread_mutex_lock(&jvo->lock);
   if (--jvo->infolock_refcnt < 1) {
     assert(jvo->infolock_refcnt >= 0);
     jvo->flags &= ~(VOF_INFO);
+    canceljvo(jvo->jvd, jvo);
+    if (!(jvo->flags&(VOF_USED|VOF_PENDING))) {
+      idx_release(jvo->jvd, jvo);
+    }
+    released = 1;
   }
   pthread_mutex_unlock(&jvo->lock);
+  if (released) {
+    signal_avail(jvo->jvd, 0, 0);
+  }
+}
+
+static inline int xdctrl_decode(void *dec, int64_t frame, uint8_t *b, int w, int h, int xoff, int ys, FrameSink *sink) {
+  JVOBJECT *jvo = (JVOBJECT *) dec;
+  jvo->lru = time(NULL);
+  jvo->hitcount_decoder++;
+  int rv = my_decode(jvo->decoder, frame, b, w, h, xoff, ys, sink);
+  idx_move(jvo->jvd, jvo, frame);
+  return rv;
 }
 
-static inline int xdctrl_decode(void *dec, int64_t frame, uint8_t *b, int w, int h) {
+static inline int xdctrl_decode_key(void *dec, int64_t frame, uint8_t *b, int w, int h, int64_t *actual) {
   JVOBJECT *jvo = (JVOBJECT *) dec;
   jvo->lru = time(NULL);
   jvo->hitcount_decoder++;
-  int rv = my_decode(jvo->decoder, frame, b, w, h);
-  jvo->frame = frame;
+  int rv = my_decode_key(jvo->decoder, frame, b, w, h, actual);
+  idx_move(jvo->jvd, jvo, *actual);
   return rv;
 }
 
@@ -749,30 +1669,58 @@ void dctrl_create(void **p, int max_decoders, int cache_size) {
   jvd->monotonic = 1;
   jvd->max_objects = max_decoders;
   jvd->cache_size = cache_size;
+  jvd->queue_timeout = DCTL_QUEUE_TIMEOUT;
 
   pthread_mutex_init(&jvd->lock_busy, NULL);
   pthread_mutex_init(&jvd->lock_jvo, NULL);
   pthread_rwlock_init(&jvd->lock_vml, NULL);
   pthread_rwlock_init(&jvd->lock_jdh, NULL);
+  pthread_cond_init(&jvd->cond_busy, NULL);
+  pthread_mutex_init(&jvd->lock_avail, NULL);
+  pthread_cond_init(&jvd->cond_avail, NULL);
+  pthread_mutex_init(&jvd->lock_idx, NULL);
+  pthread_mutex_init(&jvd->lock_warm, NULL);
+  pthread_cond_init(&jvd->cond_warm, NULL);
 
   jvd->vml = NULL;
   jvd->vmr = NULL;
   jvd->jvi = NULL;
   jvd->jvf = NULL;
-  jvd->jvo = newjvo(NULL, &jvd->lock_jvo);
-
-  HASH_ADD(hhi, jvd->jvi, id, sizeof(unsigned short), jvd->jvo);
-  HASH_ADD(hhf, jvd->jvf, id, CLKEYLEN, jvd->jvo);
+  jvd->jvo = NULL;
+  jvd->jvo = newjvo(jvd);
+  jvd->n_objects = 1;
+  idx_remove(jvd, jvd->jvo, 1);
+
+  jvd->warm_run = 1;
+  if (pthread_create(&jvd->warm_thread, NULL, warm_thread, (void*) jvd)) {
+    dlog(DLOG_WARNING, "DCTL: cannot start thread to pre-open decoders.\n");
+    jvd->warm_run = 0;
+  }
 }
 
 void dctrl_destroy(void **p) {
   JVD *jvd = (*((JVD**)p));
+  pthread_mutex_lock(&jvd->lock_warm);
+  const int warm_run = jvd->warm_run;
+  jvd->warm_run = 0;
+  pthread_cond_signal(&jvd->cond_warm);
+  pthread_mutex_unlock(&jvd->lock_warm);
+  if (warm_run) {
+    pthread_join(jvd->warm_thread, NULL);
+  }
   clearjvo(jvd, 3, -1, -1, &jvd->lock_jvo);
   clearvid(jvd, NULL);
   pthread_mutex_destroy(&jvd->lock_busy);
   pthread_mutex_destroy(&jvd->lock_jvo);
   pthread_rwlock_destroy(&jvd->lock_vml);
   pthread_rwlock_destroy(&jvd->lock_jdh);
+  pthread_cond_destroy(&jvd->cond_busy);
+  pthread_mutex_destroy(&jvd->lock_avail);
+  pthread_cond_destroy(&jvd->cond_avail);
+  pthread_mutex_destroy(&jvd->lock_idx);
+  pthread_mutex_destroy(&jvd->lock_warm);
+  pthread_cond_destroy(&jvd->cond_warm);
+  assert(!jvd->files);
   free(jvd->jvo);
   free(*((JVD**)p));
   *p = NULL;
@@ -784,21 +1732,139 @@ unsigned short dctrl_get_id(void *vc, void *p, const char *fn) {
 }
 
 
-int dctrl_decode(void *p, unsigned short id, int64_t frame, uint8_t *b, int w, int h, int fmt) {
+int dctrl_decode(void *p, unsigned short id, int64_t frame, uint8_t *b, int w, int h, int fmt, int prio, FrameSink *sink) {
+  int err = 0;
+  void *dec = dctrl_get_decoder(p, id, fmt, lowres_level((JVD*)p, id, w, h), frame, prio, &err);
+  if (!dec) {
+    dlog(DLOG_WARNING, "DCTL: no decoder available.\n");
+    return err;
+  }
+  int rv = xdctrl_decode(dec, frame, b, w, h, 0, w, sink);
+  dctrl_release_decoder(dec);
+  return (rv);
+}
+
+int dctrl_decode_tile(void *p, unsigned short id, int64_t frame, uint8_t *b, int w, int h, int fmt, int xoff, int ys, int prio) {
+  int err = 0;
+  switch (fmt) {
+    case AV_PIX_FMT_RGB24:
+    case AV_PIX_FMT_BGR24:
+    case AV_PIX_FMT_RGBA:
+    case AV_PIX_FMT_ARGB:
+    case AV_PIX_FMT_BGRA:
+      break;
+    default:
+      dlog(DLOG_ERR, "DCTL: tiles require a packed pixel format.\n");
+      return 500;
+  }
+  void *dec = dctrl_get_decoder(p, id, fmt, lowres_level((JVD*)p, id, w, h), frame, prio, &err);
+  if (!dec) {
+    dlog(DLOG_WARNING, "DCTL: no decoder available.\n");
+    return err;
+  }
+  int rv = xdctrl_decode(dec, frame, b, w, h, xoff, ys, NULL);
+  dctrl_release_decoder(dec);
+  return (rv);
+}
+
+int dctrl_decode_key(void *p, unsigned short id, int64_t frame, uint8_t *b, int w, int h, int fmt, int prio, int64_t *actual) {
   int err = 0;
-  void *dec = dctrl_get_decoder(p, id, fmt, frame, &err);
+  void *dec = dctrl_get_decoder(p, id, fmt, lowres_level((JVD*)p, id, w, h), frame, prio, &err);
   if (!dec) {
     dlog(DLOG_WARNING, "DCTL: no decoder available.\n");
     return err;
   }
-  int rv = xdctrl_decode(dec, frame, b, w, h);
+  int rv = xdctrl_decode_key(dec, frame, b, w, h, actual);
   dctrl_release_decoder(dec);
   return (rv);
 }
 
+int64_t dctrl_keyframe(void *p, unsigned short id, int64_t frame) {
+  JVD *jvd = (JVD*)p;
+  DCFile *f;
+  int64_t rv = -1;
+  pthread_mutex_lock(&jvd->lock_idx);
+  HASH_FIND(hh, jvd->files, &id, sizeof(unsigned short), f);
+  if (f) {
+    rv = file_keyframe(f, frame);
+  }
+  pthread_mutex_unlock(&jvd->lock_idx);
+  return rv;
+}
+
+int dctrl_decode_idle(void *p, unsigned short id, int64_t frame, uint8_t *b, int w, int h, int fmt) {
+  JVD *jvd = (JVD*)p;
+  JVOBJECT *jvo;
+  int rv;
+  const int lowres = lowres_level(jvd, id, w, h);
+  int busy;
+  /* leave decoders to requests that are waiting for one */
+  pthread_mutex_lock(&jvd->lock_avail);
+  busy = jvd->queue_head != NULL;
+  pthread_mutex_unlock(&jvd->lock_avail);
+  if (busy || bulk_reserve(jvd)) {
+    return 503;
+  }
+  BUSYADD(jvd)
+  /* only use a decoder that is open and idle, never wait or open a file */
+  jvo = testjvd(jvd, id, fmt, lowres, frame);
+  if (jvo) {
+    int avail;
+    pthread_mutex_lock(&jvo->lock);
+    avail = (jvo->flags&(VOF_USED|VOF_OPEN|VOF_VALID|VOF_INFO|VOF_PENDING)) == (VOF_VALID|VOF_OPEN)
+      && jvo->id == id && jvo->fmt == fmt && jvo->lowres == lowres;
+    if (avail) {
+      jvo->flags |= VOF_USED;
+      jvo->used_since = dctrl_now();
+      jvo->bulk = 1;
+      idx_claim(jvd, jvo);
+    }
+    pthread_mutex_unlock(&jvo->lock);
+    if (!avail) {
+      jvo = NULL;
+    }
+  }
+  BUSYDEC(jvd)
+  if (!jvo) {
+    bulk_unreserve(jvd);
+    return 503;
+  }
+  rv = xdctrl_decode(jvo, frame, b, w, h, 0, w, NULL);
+  dctrl_release_decoder(jvo);
+  return (rv);
+}
+
+void *dctrl_pin_decoder(void *p, unsigned short id, int64_t frame, int w, int h, int fmt, int *err) {
+  JVOBJECT *jvo = (JVOBJECT*) dctrl_get_decoder(p, id, fmt, lowres_level((JVD*)p, id, w, h), frame, DCTL_PRIO_INTERACTIVE, err);
+  if (!jvo) {
+    dlog(DLOG_WARNING, "DCTL: no decoder available.\n");
+    return NULL;
+  }
+  pthread_mutex_lock(&jvo->lock);
+  jvo->pinned = 1;
+  pthread_mutex_unlock(&jvo->lock);
+  return jvo;
+}
+
+int dctrl_decode_pinned(void *dec, int64_t frame, uint8_t *b, int w, int h) {
+  JVOBJECT *jvo = (JVOBJECT *) dec;
+  int cancel;
+  pthread_mutex_lock(&jvo->lock);
+  cancel = jvo->cancel;
+  pthread_mutex_unlock(&jvo->lock);
+  if (cancel) {
+    return 503;
+  }
+  return xdctrl_decode(dec, frame, b, w, h, 0, w, NULL);
+}
+
+void dctrl_unpin_decoder(void *dec) {
+  if (dec) dctrl_release_decoder(dec);
+}
+
 int dctrl_get_info(void *p, unsigned short id, VInfo *i) {
   int err = 0;
-  JVOBJECT *jvo = (JVOBJECT*) dctrl_get_decoder(p, id, AV_PIX_FMT_NONE, -1, &err);
+  JVOBJECT *jvo = (JVOBJECT*) dctrl_get_decoder(p, id, AV_PIX_FMT_NONE, -1, -1, DCTL_PRIO_INTERACTIVE, &err);
   if (!jvo) return err;
   my_get_info(jvo->decoder, i);
   jvo->hitcount_info++;
@@ -808,7 +1874,7 @@ int dctrl_get_info(void *p, unsigned short id, VInfo *i) {
 
 int dctrl_get_info_scale(void *p, unsigned short id, VInfo *i, int w, int h, int fmt) {
   int err = 0;
-  JVOBJECT *jvo = (JVOBJECT*) dctrl_get_decoder(p, id, fmt, -1, &err);
+  JVOBJECT *jvo = (JVOBJECT*) dctrl_get_decoder(p, id, fmt, -1, -1, DCTL_PRIO_INTERACTIVE, &err);
   if (!jvo) return err;
   my_get_info_canonical(jvo->decoder, i, w, h);
   jvo->hitcount_info++;
@@ -816,6 +1882,19 @@ int dctrl_get_info_scale(void *p, unsigned short id, VInfo *i, int w, int h, int
   return(0);
 }
 
+void dctrl_lowres(void *p, int max_level, int skip) {
+  JVD *jvd = (JVD*)p;
+  jvd->lowres_max = max_level > 0 ? max_level : 0;
+  jvd->lowres_skip = skip > 0 ? skip : 0;
+}
+
+void dctrl_queue_timeout(void *p, int ms) {
+  JVD *jvd = (JVD*)p;
+  pthread_mutex_lock(&jvd->lock_avail);
+  jvd->queue_timeout = ms > 0 ? ms : DCTL_QUEUE_TIMEOUT;
+  pthread_mutex_unlock(&jvd->lock_avail);
+}
+
 void dctrl_cache_clear(void *vc, void *p, int f, int id) {
   JVD *jvd = (JVD*)p;
   clearjvo(jvd, f, id, -1, &jvd->lock_jvo);
@@ -858,8 +1937,47 @@ static char *flags2txt(int f) {
   return rv;
 }
 
+static int cmp_float(const void *a, const void *b) {
+  const float x = *(const float*)a;
+  const float y = *(const float*)b;
+  return (x > y) - (x < y);
+}
+
+/* admission queue summary for the status page */
+static void queue_info(JVD *jvd, char *txt, size_t len) {
+  float samples[DCTL_WAIT_SAMPLES];
+  int n, depth, depth_max, bulk_queued = 0, bulk_used;
+  unsigned int queued, rejected, timedout;
+  DCWaiter *cptr;
+
+  pthread_mutex_lock(&jvd->lock_avail);
+  n = jvd->wait_n < DCTL_WAIT_SAMPLES ? jvd->wait_n : DCTL_WAIT_SAMPLES;
+  memcpy(samples, jvd->wait_ms, n * sizeof(float));
+  for (cptr = jvd->queue_head; cptr; cptr = cptr->next) {
+    if (cptr->prio == DCTL_PRIO_BULK) ++bulk_queued;
+  }
+  bulk_used = jvd->bulk_used;
+  depth = jvd->queue_len;
+  depth_max = jvd->queue_max;
+  queued = jvd->queued;
+  rejected = jvd->rejected;
+  timedout = jvd->timedout;
+  pthread_mutex_unlock(&jvd->lock_avail);
+
+  if (n > 0) {
+    qsort(samples, n, sizeof(float), cmp_float);
+    snprintf(txt, len, "queue: %d (bulk: %d, max %d), decoders used by bulk requests: %d, waited: %u, rejected: %u, timed out: %u, wait p50/p90/p99: %.1f/%.1f/%.1f ms",
+        depth, bulk_queued, depth_max, bulk_used, queued, rejected, timedout,
+        samples[n / 2], samples[n * 9 / 10], samples[n * 99 / 100]);
+  } else {
+    snprintf(txt, len, "queue: %d (bulk: %d, max %d), decoders used by bulk requests: %d, waited: %u, rejected: %u, timed out: %u",
+        depth, bulk_queued, depth_max, bulk_used, queued, rejected, timedout);
+  }
+}
+
 void dctrl_info_html (void *p, char **m, size_t *o, size_t *s, int tbl) {
   JVOBJECT *cptr = ((JVD*)p)->jvo;
+  char qtxt[256];
   int i = 1;
 
   VidMap *vm, *tmp;
@@ -890,31 +2008,40 @@ void dctrl_info_html (void *p, char **m, size_t *o, size_t *s, int tbl) {
   }
 
   i = 1;
+  queue_info((JVD*)p, qtxt, sizeof(qtxt));
   if(tbl&4) {
     rprintf("<h3>Decoder Objects:</h3>\n");
-    rprintf("<p>max available: %d, busy: %d%s</p>\n", ((JVD*)p)->max_objects, ((JVD*)p)->busycnt, ((JVD*)p)->purge_in_progress?" (purge queued)":"");
+    rprintf("<p>max available: %d, busy: %d%s, pre-opened: %u</p>\n", ((JVD*)p)->max_objects, ((JVD*)p)->busycnt, ((JVD*)p)->purge_in_progress?" (purge queued)":"", ((JVD*)p)->warmed);
+    rprintf("<p>%s</p>\n", qtxt);
     rprintf("<table style=\"text-align:center;width:100%%\">\n");
   } else {
     rprintf("<tr><td colspan=\"8\" class=\"left\"><h3>Decoder Objects:</h3></td></tr>\n");
-    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d, busy: %d%s</td></tr>\n",
-        ((JVD*)p)->max_objects, ((JVD*)p)->busycnt, ((JVD*)p)->purge_in_progress?" (purge queued)":"");
+    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d, busy: %d%s, pre-opened: %u</td></tr>\n",
+        ((JVD*)p)->max_objects, ((JVD*)p)->busycnt, ((JVD*)p)->purge_in_progress?" (purge queued)":"", ((JVD*)p)->warmed);
+    rprintf("<tr><td colspan=\"8\" class=\"left line\">%s</td></tr>\n", qtxt);
   }
   rprintf("<tr><th>#</th><th>file-id</th><th>Flags</th><th>Filename</th><th>Hitcount</th><th>PixFmt</th><th>Frame#</th><th>LRU</th></tr>\n");
   rprintf("\n");
   pthread_rwlock_rdlock(&((JVD*)p)->lock_jdh);
   while (cptr) {
     char *tmp, *fn;
+    char fmt[32];
     if (cptr->id == 0) {
       cptr = cptr->next;
       continue; // don't list unused root-node.
     }
     tmp = flags2txt(cptr->flags);
     fn = (cptr->flags&VOF_VALID) ? get_fn((JVD*)p, cptr->id) : NULL;
+    if (cptr->lowres > 0) {
+      snprintf(fmt, sizeof(fmt), "%s 1/%d", ff_fmt_to_text(cptr->fmt), 1 << cptr->lowres);
+    } else {
+      snprintf(fmt, sizeof(fmt), "%s", ff_fmt_to_text(cptr->fmt));
+    }
     rprintf(
         "<tr><td>%d.</td><td>%i</td><td>%s</td><td class=\"left\">%s</td><td>i:%d,d:%d</td><td>%s</td><td>%"PRIlld"</td><td>%"PRIlld"</td></tr>\n",
         i, cptr->id, tmp, fn?fn:"-", /* (cptr->decoder?LIBAVCODEC_IDENT:"null"), */
         cptr->hitcount_info, cptr->hitcount_decoder,
-        ff_fmt_to_text(cptr->fmt),
+        fmt,
         (long long) cptr->frame, (long long)cptr->lru);
     free(tmp);
     cptr = cptr->next;
@@ -27,6 +27,12 @@
 
 #include "vinfo.h"
 
+/** request priorities for decoding, see \ref dctrl_decode */
+enum {
+  DCTL_PRIO_INTERACTIVE = 0, ///< e.g. scrubbing, served first
+  DCTL_PRIO_BULK             ///< e.g. thumbnails, only uses idle decoders
+};
+
 /** create and allocate a decoder control object
  * @param p pointer to allocated object
  */
@@ -74,10 +80,98 @@ int dctrl_get_info_scale(void *p, unsigned short id, VInfo *i, int w, int h, int
 
 /**
  * used by the frame-cache to decode a frame
+ * @param prio DCTL_PRIO_INTERACTIVE requests wait ahead of bulk ones for a
+ * decoder. Bulk requests leave one decoder to interactive ones.
+ * @param sink optional, receives frames that are decoded on the way
+ * to the requested frame
  */
-int dctrl_decode(void *p, unsigned short vid, int64_t frame, uint8_t *b, int w, int h, int fmt);
+int dctrl_decode(void *p, unsigned short vid, int64_t frame, uint8_t *b, int w, int h, int fmt, int prio, FrameSink *sink);
+
+/**
+ * decode a frame into a tile of a larger image, bypassing the frame-cache.
+ * Only packed pixel formats (RGB24, BGR24, RGBA, ARGB, BGRA) are supported.
+ * @param b image buffer with \a ys pixels per row and \a h rows
+ * @param w width of the tile
+ * @param h height of the tile and the image
+ * @param xoff x-offset of the tile in pixels
+ * @param ys width of the image in pixels
+ * @param prio request priority, see \ref dctrl_decode
+ * @return 0 on success, -1 if decoding failed (an empty tile is rendered),
+ * 500 for unsupported formats, 503 if no decoder is available
+ */
+int dctrl_decode_tile(void *p, unsigned short vid, int64_t frame, uint8_t *b, int w, int h, int fmt, int xoff, int ys, int prio);
+
+/**
+ * used by the frame-cache to decode the keyframe at or before the given
+ * frame. Inter-frames are not decoded at all.
+ * @param prio request priority, see \ref dctrl_decode
+ * @param actual returns the frame-number of the keyframe that was decoded
+ */
+int dctrl_decode_key(void *p, unsigned short vid, int64_t frame, uint8_t *b, int w, int h, int fmt, int prio, int64_t *actual);
+
+/**
+ * look up the keyframe at or before the given frame using the keyframe index
+ * @return frame-number of the keyframe, or -1 if the index is not (yet) known.
+ * The index of a file becomes known once one of its decoders used it.
+ */
+int64_t dctrl_keyframe(void *p, unsigned short vid, int64_t frame);
+
+/**
+ * used by the frame-cache to read ahead: like \ref dctrl_decode but
+ * only use a decoder that is already open and idle. Read-ahead counts
+ * as DCTL_PRIO_BULK and yields to requests that are waiting for a decoder.
+ * @return 503 if no such decoder is available
+ */
+int dctrl_decode_idle(void *p, unsigned short vid, int64_t frame, uint8_t *b, int w, int h, int fmt);
+
+/**
+ * reserve a decoder for exclusive use, e.g. to play a stream.
+ * The decoder is not available to other requests until it is
+ * released with \ref dctrl_unpin_decoder.
+ * @param frame first frame that will be decoded
+ * @param err set to 503 if no decoder is available, 500 if the file cannot be decoded
+ * @return decoder handle, or NULL
+ */
+void *dctrl_pin_decoder(void *p, unsigned short vid, int64_t frame, int w, int h, int fmt, int *err);
+
+/**
+ * decode a frame using a decoder obtained by \ref dctrl_pin_decoder.
+ * \a w, \a h and the pixel-format must match the ones used to pin the decoder.
+ * @return 0 on success, -1 if decoding failed, 503 if the file was purged
+ * from the cache meanwhile: the decoder must be unpinned.
+ */
+int dctrl_decode_pinned(void *dec, int64_t frame, uint8_t *b, int w, int h);
+
+/**
+ * release a decoder obtained by \ref dctrl_pin_decoder
+ */
+void dctrl_unpin_decoder(void *dec);
+
+/**
+ * configure reduced quality decoding for frames that are requested at
+ * a fraction of the original size (thumbnails). These use separate decoders.
+ * @param p pointer to a decoder-control object
+ * @param max_level max. lowres level: decode at 1/2^level of the original size
+ * if the codec supports it. The decoded size is never smaller than the output. 0: disable
+ * @param skip 0: full quality, 1: skip the loop-filter of non-reference frames,
+ * 2: skip the loop-filter of all and the IDCT of non-reference frames
+ */
+void dctrl_lowres(void *p, int max_level, int skip);
+
+/**
+ * set how long a request may wait for a decoder
+ *
+ * When all decoders are busy, requests are queued in order of arrival.
+ * A request fails (503) if it is still waiting after \a ms milliseconds,
+ * or right away if the queue is too long to be served in time.
+ *
+ * @param p pointer to a decoder-control object
+ * @param ms max. wait time in milliseconds (default 2000)
+ */
+void dctrl_queue_timeout(void *p, int ms);
 
 /**
  */
 void dctrl_cache_clear(void *vc, void *p, int f, int id);
+
 #endif
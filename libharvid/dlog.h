@@ -40,6 +40,16 @@ int portable_snprintf(char *str, size_t str_m, const char *fmt, /*args*/ ...);
 #define SNPRINTF portable_snprintf
 #endif
 
+/* absolute time \a ms milliseconds from now, for pthread_cond_timedwait() */
+#define mydeadline(ts, ms) \
+{ \
+  struct timeval _tv; \
+  gettimeofday(&_tv, NULL); \
+  (ts)->tv_sec = _tv.tv_sec + (ms) / 1000; \
+  (ts)->tv_nsec = _tv.tv_usec * 1000 + ((ms) % 1000) * 1000000; \
+  if ((ts)->tv_nsec >= 1000000000) { (ts)->tv_sec++; (ts)->tv_nsec -= 1000000000; } \
+}
+
 /* syslog */
 #ifndef _WIN32
 #include <syslog.h>
@@ -117,6 +117,14 @@ static inline AVFrame *av_frame_alloc()
 }
 #endif
 
+#ifndef AV_CODEC_CAP_FRAME_THREADS
+#define AV_CODEC_CAP_FRAME_THREADS CODEC_CAP_FRAME_THREADS
+#endif
+
+#ifndef AV_CODEC_FLAG2_FAST
+#define AV_CODEC_FLAG2_FAST CODEC_FLAG2_FAST
+#endif
+
 static inline void
 register_codecs_compat ()
 {
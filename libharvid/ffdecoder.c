@@ -24,27 +24,39 @@
 #include <time.h>
 #include <math.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <pthread.h>
 #include <assert.h>
 
 #include "vinfo.h"
 #include "ffdecoder.h"
+#include "ffindex.h"
 
 #include "ffcompat.h"
 #include <libswscale/swscale.h>
 
+#define HASH_FUNCTION HASH_SFH
+#include "uthash.h"
+
 #ifndef MAX
 #define MAX(A,B) ( ( (A) > (B) ) ? (A) : (B) )
 #endif
+#ifndef MIN
+#define MIN(A,B) ( ( (A) < (B) ) ? (A) : (B) )
+#endif
 
 /* ffmpeg source */
 typedef struct {
   /* file specific decoder settings */
   int   want_ignstart; //< set before calling ff_open_movie()
   int   want_genpts;
+  int   want_lowres;   //< set before calling ff_open_movie()
+  int   want_skip;     //< set before calling ff_open_movie()
   /* Video File Info */
   int   movie_width;  ///< original file geometry
   int   movie_height; ///< original file geometry
+  double movie_aspect; ///< original display aspect ratio
   int   out_width;  ///< aspect scaled geometry
   int   out_height; ///< aspect scaled geometry
 
@@ -58,6 +70,14 @@ typedef struct {
   int64_t tpf;
   int64_t avprev;
   int64_t stream_pts_offset;
+  FFIndex *index;      ///< keyframe index, NULL until available
+  time_t   index_poll; ///< last attempt to acquire the index
+  FrameSink *sink;     ///< receives frames decoded while seeking
+  int   threads;       ///< codec threads allotted to this decoder
+  int   thread_type;   ///< FF_THREAD_* the codec was opened with
+  int   thread_fixed;  ///< the codec could not be re-opened, keep the thread type
+  int   seq_run;       ///< consecutive frames reached without seeking
+  int   seek_run;      ///< consecutive frames that required a seek
   /* */
   uint8_t *internal_buffer; //< if !NULL this buffer is free()d on destroy
   uint8_t *buffer;
@@ -79,8 +99,53 @@ extern int want_quiet;
 extern int want_verbose;
 
 static pthread_mutex_t avcodec_lock;
+
+/* codec threading -- see ff_threads_configure() */
+static int thread_budget = 1;  ///< max. number of codec threads of all decoders
+static int thread_frame = -1;  ///< frame-threading: 0: off, 1: on, -1: sequential access only
+static int threads_used = 0;   ///< threads allotted to open decoders, protected by avcodec_lock
+
+#define THREAD_MAX 16     ///< max. number of threads per decoder
+#define SEQ_FRAMETHREAD 8 ///< frames decoded in sequence before enabling frame-threading
+#define SEEK_SLICETHREAD 2 ///< consecutive seeks before falling back to slice-threading
+
+/* switching the thread type needs a new codec context, see ff_adapt_threads() */
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 33, 100)
+#define THREAD_ADAPT
+#endif
 static const AVRational c1_Q = { 1, 1 };
 
+/* stream information of recently opened files, see probe_restore() */
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 33, 100)
+#define PROBE_CACHE
+#endif
+#define PROBE_CACHE_SIZE 64 ///< max. number of files to remember
+
+#ifdef PROBE_CACHE
+typedef struct FFProbe {
+  char    *fn;
+  int64_t  fsize;
+  int64_t  mtime;
+  time_t   lru;
+  int      stream;       ///< index of the video stream
+  unsigned int nb_streams;
+  AVRational time_base;
+  AVRational r_frame_rate;
+  AVRational avg_frame_rate;
+  AVRational sample_aspect_ratio;
+  int64_t  nb_frames;
+  int64_t  start_time;   ///< of the stream
+  int64_t  duration;     ///< of the stream
+  int64_t  fmt_start_time;
+  int64_t  fmt_duration;
+  AVCodecParameters *par;
+  UT_hash_handle hh;
+} FFProbe;
+
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static FFProbe *probe_map = NULL;
+#endif
+
 //#define SCALE_UP  ///< positive pixel-aspect scales up X axis - else positive pixel-aspect scales down Y-Axis.
 
 //--------------------------------------------
@@ -137,7 +202,14 @@ static void render_empty_frame(ffst *ff, uint8_t* buf, int w, int h, int xoff, i
     case AV_PIX_FMT_RGBA:
     case AV_PIX_FMT_BGRA:
     case AV_PIX_FMT_ARGB:
-      memset(buf, 0, ff_getbuffersize(ff, NULL));
+      {
+	/* packed formats may be a tile of a larger image */
+	const int bpp = (ff->render_fmt == AV_PIX_FMT_RGB24 || ff->render_fmt == AV_PIX_FMT_BGR24) ? 3 : 4;
+	int y;
+	for (y = 0; y < h; ++y) {
+	  memset(buf + bpp * (xoff + ys * y), 0, bpp * w);
+	}
+      }
       break;
     default:
       if (!want_quiet)
@@ -168,9 +240,9 @@ static void render_empty_frame(ffst *ff, uint8_t* buf, int w, int h, int xoff, i
     case AV_PIX_FMT_RGB24:
     case AV_PIX_FMT_BGR24:
       for (x = 0, y = 0; x < w-1; x++, y = h * x / w) {
-	int off = 3 * (x + w * y);
+	int off = 3 * (xoff + x + ys * y);
 	buf[off]=255; buf[off+1]=255; buf[off+2]=255;
-	off = 3 * (x + w * (h - y - 1));
+	off = 3 * (xoff + x + ys * (h - y - 1));
 	buf[off]=255; buf[off+1]=255; buf[off+2]=255;
       }
       break;
@@ -180,9 +252,9 @@ static void render_empty_frame(ffst *ff, uint8_t* buf, int w, int h, int xoff, i
       {
       const int O = (ff->render_fmt == AV_PIX_FMT_ARGB) ? 1 : 0;
       for (x = 0, y = 0; x < w-1; x++, y = h * x / w) {
-	int off = 4 * (x + w * y) + O;
+	int off = 4 * (xoff + x + ys * y) + O;
 	buf[off]=255; buf[off+1]=255; buf[off+2]=255;
-	off = 4 * (x + w * (h - y - 1)) + O;
+	off = 4 * (xoff + x + ys * (h - y - 1)) + O;
 	buf[off]=255; buf[off+1]=255; buf[off+2]=255;
       }
       }
@@ -206,22 +278,19 @@ static double ff_get_aspectratio(void *ptr) {
   return (aspect_ratio);
 }
 
+/* NB. the codec context may have been opened with lowres, and
+ * report a reduced geometry: use the one saved before opening it */
 static void ff_caononicalize_size2(void *ptr, int *w, int *h) {
   ffst *ff = (ffst*)ptr;
-  double aspect_ratio = ff_get_aspectratio(ptr);
+  const double aspect_ratio = ff->movie_aspect;
   if (!w || !h) return;
 
   if ((*h) < 16 && (*w) > 15) (*h) = (int) floorf((float)(*w)/aspect_ratio);
   else if ((*h) > 15  && (*w) < 16) (*w) = (int) floorf((float)(*h)*aspect_ratio);
 
   if ((*w) < 16 || (*h) < 16) {
-#ifdef SCALE_UP
-    (*w) = (int) floor((double)ff->pCodecCtx->height * aspect_ratio);
-    (*h) = ff->pCodecCtx->height;
-#else
-    (*w) = ff->pCodecCtx->width ;
-    (*h) = (int) floor((double)ff->pCodecCtx->width / aspect_ratio);
-#endif
+    (*w) = ff->movie_width;
+    (*h) = ff->movie_height;
   }
 }
 
@@ -261,18 +330,161 @@ static void ff_init_moviebuffer(void *ptr) {
   avpicture_fill((AVPicture *)ff->pFrameFMT, ff->buffer, ff->render_fmt, ff->out_width, ff->out_height);
 }
 
+//--------------------------------------------
+// probe cache
+//--------------------------------------------
+
+#ifdef PROBE_CACHE
+static void probe_free(FFProbe *pc) {
+  avcodec_parameters_free(&pc->par);
+  free(pc->fn);
+  free(pc);
+}
+
+/* remember the stream information of the video stream, after
+ * avformat_find_stream_info() succeeded */
+static void probe_store(AVFormatContext *fc, int stream, const char *fn) {
+  FFProbe *pc, *tmp, *lru = NULL;
+  AVStream *avs = fc->streams[stream];
+  struct stat sb;
+
+  if (stat(fn, &sb)) return;
+
+  pthread_mutex_lock(&probe_lock);
+  HASH_FIND_STR(probe_map, fn, pc);
+  if (pc) {
+    HASH_DEL(probe_map, pc);
+    probe_free(pc);
+  } else if (HASH_COUNT(probe_map) >= PROBE_CACHE_SIZE) {
+    HASH_ITER(hh, probe_map, pc, tmp) {
+      if (!lru || pc->lru < lru->lru) lru = pc;
+    }
+    HASH_DEL(probe_map, lru);
+    probe_free(lru);
+  }
+
+  pc = (FFProbe*) calloc(1, sizeof(FFProbe));
+  if (!(pc->par = avcodec_parameters_alloc())
+      || avcodec_parameters_copy(pc->par, avs->codecpar) < 0) {
+    pthread_mutex_unlock(&probe_lock);
+    avcodec_parameters_free(&pc->par);
+    free(pc);
+    return;
+  }
+  pc->fn = strdup(fn);
+  pc->fsize = sb.st_size;
+  pc->mtime = sb.st_mtime;
+  pc->lru = time(NULL);
+  pc->stream = stream;
+  pc->nb_streams = fc->nb_streams;
+  pc->time_base = avs->time_base;
+  pc->r_frame_rate = av_stream_get_r_frame_rate(avs);
+  pc->avg_frame_rate = avs->avg_frame_rate;
+  pc->sample_aspect_ratio = avs->sample_aspect_ratio;
+  pc->nb_frames = avs->nb_frames;
+  pc->start_time = avs->start_time;
+  pc->duration = avs->duration;
+  pc->fmt_start_time = fc->start_time;
+  pc->fmt_duration = fc->duration;
+  HASH_ADD_KEYPTR(hh, probe_map, pc->fn, strlen(pc->fn), pc);
+  pthread_mutex_unlock(&probe_lock);
+}
+
+/* apply cached stream information to a file that was just opened,
+ * instead of calling avformat_find_stream_info().
+ *
+ * This is only done if the file was not modified and the container
+ * header agrees with what was found before.
+ * @return 0 on success, -1 if the file needs to be probed
+ */
+static int probe_restore(AVFormatContext *fc, const char *fn) {
+  FFProbe *pc;
+  AVStream *avs;
+  struct stat sb;
+  int rv = -1;
+
+  if (stat(fn, &sb)) return -1;
+
+  pthread_mutex_lock(&probe_lock);
+  HASH_FIND_STR(probe_map, fn, pc);
+  if (!pc) {
+    pthread_mutex_unlock(&probe_lock);
+    return -1;
+  }
+  if (pc->fsize != sb.st_size || pc->mtime != sb.st_mtime) {
+    HASH_DEL(probe_map, pc);
+    probe_free(pc);
+    pthread_mutex_unlock(&probe_lock);
+    return -1;
+  }
+
+  if (pc->nb_streams == fc->nb_streams) {
+    avs = fc->streams[pc->stream];
+    if (avs->codecpar->codec_type == AVMEDIA_TYPE_VIDEO
+        && avs->codecpar->codec_id == pc->par->codec_id
+        && !av_cmp_q(avs->time_base, pc->time_base)
+        && avcodec_parameters_copy(avs->codecpar, pc->par) >= 0
+        && avcodec_parameters_to_context(avs->codec, pc->par) >= 0) {
+      av_stream_set_r_frame_rate(avs, pc->r_frame_rate);
+      avs->avg_frame_rate = pc->avg_frame_rate;
+      avs->sample_aspect_ratio = pc->sample_aspect_ratio;
+      avs->nb_frames = pc->nb_frames;
+      avs->start_time = pc->start_time;
+      avs->duration = pc->duration;
+      fc->start_time = pc->fmt_start_time;
+      fc->duration = pc->fmt_duration;
+      pc->lru = time(NULL);
+      rv = 0;
+    }
+  }
+  pthread_mutex_unlock(&probe_lock);
+  return rv;
+}
+
+static void probe_clear(void) {
+  FFProbe *pc, *tmp;
+  pthread_mutex_lock(&probe_lock);
+  HASH_ITER(hh, probe_map, pc, tmp) {
+    HASH_DEL(probe_map, pc);
+    probe_free(pc);
+  }
+  pthread_mutex_unlock(&probe_lock);
+}
+#endif
+
 void ff_initialize (void) {
   if (want_verbose) fprintf(stdout, "FFMPEG: registering codecs.\n");
   register_codecs_compat ();
 
   pthread_mutex_init(&avcodec_lock, NULL);
+  ffidx_initialize();
 
   if(want_quiet) av_log_set_level(AV_LOG_QUIET);
   else if (want_verbose) av_log_set_level(AV_LOG_VERBOSE);
   else av_log_set_level(AV_LOG_ERROR);
 }
 
+/**
+ * configure codec threading
+ * @param budget max. total number of codec threads of all decoders.
+ * Every decoder that is opened is given half of the remaining budget
+ * (at least one thread). 1 disables threading.
+ * @param frame 0: slice-threading only, 1: also use frame-threading,
+ * -1: use frame-threading only for decoders that are accessed sequentially.
+ * Frame-threading adds a delay of one frame per thread after every seek.
+ */
+void ff_threads_configure (int budget, int frame) {
+  pthread_mutex_lock(&avcodec_lock);
+  thread_budget = budget > 0 ? budget : 1;
+  thread_frame = frame;
+  pthread_mutex_unlock(&avcodec_lock);
+}
+
 void ff_cleanup (void) {
+  ffidx_cleanup();
+#ifdef PROBE_CACHE
+  probe_clear();
+#endif
   pthread_mutex_destroy(&avcodec_lock);
 }
 
@@ -280,6 +492,8 @@ int ff_close_movie(void *ptr) {
   ffst *ff = (ffst*)ptr;
   if(ff->current_file) free(ff->current_file);
   ff->current_file = NULL;
+  ffidx_release(ff->index);
+  ff->index = NULL;
 
   if (!ff->pFrameFMT) return(-1);
   if (ff->out_width < 0 || ff->out_height < 0) {
@@ -292,8 +506,10 @@ int ff_close_movie(void *ptr) {
   if (ff->pFrame) av_free(ff->pFrame);
   ff->buffer = NULL;ff->pFrameFMT = ff->pFrame = NULL;
   pthread_mutex_lock(&avcodec_lock);
-  avcodec_close(ff->pCodecCtx);
+  ff_close_codec(ff);
   avformat_close_input(&ff->pFormatCtx);
+  threads_used -= ff->threads;
+  ff->threads = 0;
   pthread_mutex_unlock(&avcodec_lock);
   if (ff->pSWSCtx) sws_freeContext(ff->pSWSCtx);
   return (0);
@@ -355,8 +571,66 @@ static void ff_set_framerate(ffst *ff) {
     ff->tc.drop = 1;
 }
 
+/* look up the keyframe index, this triggers a background scan if needed */
+static void ff_attach_index(ffst *ff) {
+  const time_t now = time(NULL);
+  AVRational tb;
+  if (ff->index || ff->videoStream < 0 || ff->index_poll == now) return;
+  ff->index_poll = now;
+  tb = ff->pFormatCtx->streams[ff->videoStream]->time_base;
+  ff->index = ffidx_acquire(ff->current_file, ff->videoStream, tb.num, tb.den);
+}
+
+/* call with avcodec_lock held */
+static int ff_allot_threads (void) {
+  int n = (thread_budget - threads_used) / 2;
+  if (n > THREAD_MAX) n = THREAD_MAX;
+  if (n < 1) n = 1;
+  threads_used += n;
+  return n;
+}
+
+/* reduced quality decoding, for thumbnails */
+static void ff_codec_quality (ffst *ff, AVCodecContext *ctx, const AVCodec *pCodec) {
+  if (ff->want_lowres > 0) {
+    ctx->lowres = MIN(ff->want_lowres, pCodec->max_lowres);
+  }
+  if (ff->want_skip > 0) {
+    ctx->skip_loop_filter = ff->want_skip > 1 ? AVDISCARD_ALL : AVDISCARD_NONREF;
+  }
+  if (ff->want_skip > 1) {
+    ctx->skip_idct = AVDISCARD_NONREF;
+    ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+  }
+}
+
+/* call with avcodec_lock held */
+static int ff_open_codec (ffst *ff, AVCodecContext *ctx, const AVCodec *pCodec, int thread_type) {
+  ctx->thread_count = ff->threads;
+  ctx->thread_type = thread_type;
+  if (avcodec_open2(ctx, pCodec, NULL) < 0) {
+    return -1;
+  }
+  ff->thread_type = thread_type;
+  return 0;
+}
+
+/* close the codec, and free the context unless it is the stream's.
+ * call with avcodec_lock held */
+static void ff_close_codec (ffst *ff) {
+#ifdef THREAD_ADAPT
+  if (ff->pFormatCtx && ff->videoStream >= 0
+      && ff->pCodecCtx != ff->pFormatCtx->streams[ff->videoStream]->codec) {
+    avcodec_free_context(&ff->pCodecCtx);
+    return;
+  }
+#endif
+  avcodec_close(ff->pCodecCtx);
+}
+
 int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
   int i;
+  int probed = 0;
   AVCodec *pCodec;
   ffst *ff = (ffst*) ptr;
 
@@ -373,6 +647,7 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
   ff->pFrameFMT = NULL;
   ff->movie_width  = 320;
   ff->movie_height = 180;
+  ff->movie_aspect = 16.0 / 9.0;
   ff->buf_width = ff->buf_height = 0;
   ff->movie_height = 180;
   ff->framerate = ff->duration = ff->frames = 1;
@@ -382,6 +657,8 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
   ff->avprev = -1;
   ff->stream_pts_offset = AV_NOPTS_VALUE;
   ff->render_fmt = render_fmt;
+  ff->index = NULL;
+  ff->index_poll = 0;
 
   /* Open video file */
   if(avformat_open_input(&ff->pFormatCtx, file_name, NULL, NULL) <0)
@@ -391,16 +668,25 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
     return (-1);
   }
 
-  pthread_mutex_lock(&avcodec_lock);
-  /* Retrieve stream information */
-  if(avformat_find_stream_info(ff->pFormatCtx, NULL) < 0) {
-    if (!want_quiet)
-      fprintf(stderr, "Cannot find stream information in file %s\n", file_name);
-    avformat_close_input(&ff->pFormatCtx);
+#ifdef PROBE_CACHE
+  /* other decoders of this file already probed it */
+  probed = !probe_restore(ff->pFormatCtx, file_name);
+#endif
+
+  if (!probed) {
+    pthread_mutex_lock(&avcodec_lock);
+    /* Retrieve stream information */
+    if(avformat_find_stream_info(ff->pFormatCtx, NULL) < 0) {
+      if (!want_quiet)
+	fprintf(stderr, "Cannot find stream information in file %s\n", file_name);
+      avformat_close_input(&ff->pFormatCtx);
+      pthread_mutex_unlock(&avcodec_lock);
+      return (-1);
+    }
     pthread_mutex_unlock(&avcodec_lock);
-    return (-1);
+  } else if (want_verbose) {
+    fprintf(stdout, "using cached stream information for %s\n", file_name);
   }
-  pthread_mutex_unlock(&avcodec_lock);
 
   if (want_verbose) av_dump_format(ff->pFormatCtx, 0, file_name, 0);
 
@@ -429,6 +715,10 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
     return (-1);
   }
 
+#ifdef PROBE_CACHE
+  if (!probed) probe_store(ff->pFormatCtx, ff->videoStream, file_name);
+#endif
+
   ff_set_framerate(ff);
 
   {
@@ -469,12 +759,13 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
 
 // FIXME: don't scale here - announce aspect ratio
 // out_width/height remains in aspect 1:1
+  ff->movie_aspect = ff_get_aspectratio(ff);
 #ifdef SCALE_UP
-  ff->movie_width = (int) floor((double)ff->pCodecCtx->height * ff_get_aspectratio(ff));
+  ff->movie_width = (int) floor((double)ff->pCodecCtx->height * ff->movie_aspect);
   ff->movie_height = ff->pCodecCtx->height;
 #else
   ff->movie_width = ff->pCodecCtx->width;
-  ff->movie_height = (int) floor((double)ff->pCodecCtx->width / ff_get_aspectratio(ff));
+  ff->movie_height = (int) floor((double)ff->pCodecCtx->width / ff->movie_aspect);
 #endif
 
   // somewhere around LIBAVFORMAT_BUILD  4630
@@ -497,11 +788,18 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
     return(-1);
   }
 
+  ff_codec_quality(ff, ff->pCodecCtx, pCodec);
+
   // Open codec
   pthread_mutex_lock(&avcodec_lock);
-  if(avcodec_open2(ff->pCodecCtx, pCodec, NULL) < 0) {
+  ff->threads = ff_allot_threads();
+  ff->seq_run = ff->seek_run = 0;
+  ff->thread_fixed = 0;
+  if(ff_open_codec(ff, ff->pCodecCtx, pCodec, thread_frame > 0 ? FF_THREAD_FRAME | FF_THREAD_SLICE : FF_THREAD_SLICE) < 0) {
     if (!want_quiet)
       fprintf(stderr, "Cannot open the codec for file %s\n", file_name);
+    threads_used -= ff->threads;
+    ff->threads = 0;
     pthread_mutex_unlock(&avcodec_lock);
     avformat_close_input(&ff->pFormatCtx);
     return(-1);
@@ -513,6 +811,10 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
       fprintf(stderr, "Cannot allocate video frame buffer\n");
     avcodec_close(ff->pCodecCtx);
     avformat_close_input(&ff->pFormatCtx);
+    pthread_mutex_lock(&avcodec_lock);
+    threads_used -= ff->threads;
+    ff->threads = 0;
+    pthread_mutex_unlock(&avcodec_lock);
     return(-1);
   }
 
@@ -522,12 +824,17 @@ int ff_open_movie(void *ptr, char *file_name, int render_fmt) {
     av_free(ff->pFrame);
     avcodec_close(ff->pCodecCtx);
     avformat_close_input(&ff->pFormatCtx);
+    pthread_mutex_lock(&avcodec_lock);
+    threads_used -= ff->threads;
+    ff->threads = 0;
+    pthread_mutex_unlock(&avcodec_lock);
     return(-1);
   }
 
   ff->out_width = ff->out_height = -1;
 
   ff->current_file = strdup(file_name);
+  ff_attach_index(ff);
   return(0);
 }
 
@@ -584,16 +891,63 @@ static uint64_t parse_pts_from_frame (AVFrame *f) {
   return pts;
 }
 
+static int ff_seek_keyframe (ffst *ff, int64_t timestamp) {
+  int rv = av_seek_frame(ff->pFormatCtx, ff->videoStream, timestamp, AVSEEK_FLAG_BACKWARD);
+  if (ff->pCodecCtx->codec->flush) {
+    avcodec_flush_buffers(ff->pCodecCtx);
+  }
+  return rv;
+}
+
+/* offset of frame-numbers to the stream's frame-count */
+static int64_t ff_frame_offset (ffst *ff) {
+  if (!ff->want_ignstart) return 0;
+  return (int64_t) rint(ff->framerate * ((double)ff->pFormatCtx->start_time / (double)AV_TIME_BASE));
+}
+
+static void ff_scale (ffst *ff, uint8_t *const dst[], const int dst_stride[]) {
+  ff->pSWSCtx = sws_getCachedContext(ff->pSWSCtx, ff->pCodecCtx->width, ff->pCodecCtx->height, ff->pCodecCtx->pix_fmt, ff->out_width, ff->out_height, ff->render_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+  sws_scale(ff->pSWSCtx, (const uint8_t * const*) ff->pFrame->data, ff->pFrame->linesize, 0, ff->pCodecCtx->height, dst, dst_stride);
+}
+
+/* pass a frame that was decoded while seeking on to the sink.
+ * The frame-number is only known reliably if the index is available. */
+static void ff_sink_frame (ffst *ff, int64_t pts, int64_t prefuzz, int64_t offset) {
+  const AVRational fr_Q = { ff->tc.den, ff->tc.num };
+  const AVRational tb = ff->pFormatCtx->streams[ff->videoStream]->time_base;
+  int64_t framenumber;
+  AVPicture pic;
+  uint8_t *buf;
+
+  if (!ff->index) return;
+  framenumber = av_rescale_q(pts, tb, fr_Q);
+  if (ffidx_frame_pts(ff->index, av_rescale_q(framenumber, fr_Q, tb), prefuzz, ff->tpf) != pts) {
+    return;
+  }
+  framenumber -= offset;
+  if (framenumber < 0 || framenumber >= ff->frames) return;
+
+  if (!(buf = ff->sink->get(ff->sink->arg, framenumber))) {
+    return;
+  }
+  avpicture_fill(&pic, buf, ff->render_fmt, ff->out_width, ff->out_height);
+  ff_scale(ff, pic.data, pic.linesize);
+  ff->sink->put(ff->sink->arg, framenumber, buf, 1);
+}
+
 static int my_seek_frame (ffst *ff, AVPacket *packet, int64_t framenumber) {
   AVStream *v_stream;
   int rv = 0;
   int64_t timestamp;
 
+  int64_t offset;
+  int sink_budget = ff->sink ? ff->sink->budget : 0;
+
   if (ff->videoStream < 0) return (0);
   v_stream = ff->pFormatCtx->streams[ff->videoStream];
 
-  if (ff->want_ignstart)
-    framenumber += (int64_t) rint(ff->framerate * ((double)ff->pFormatCtx->start_time / (double)AV_TIME_BASE));
+  offset = ff_frame_offset(ff);
+  framenumber += offset;
 
   if (framenumber < 0 || framenumber >= ff->frames) {
     return -1;
@@ -602,15 +956,45 @@ static int my_seek_frame (ffst *ff, AVPacket *packet, int64_t framenumber) {
   const AVRational fr_Q = { ff->tc.den, ff->tc.num };
   timestamp = av_rescale_q(framenumber, fr_Q, v_stream->time_base);
 
+  const int64_t prefuzz = ff->tpf > 10 ? 1 : 0;
+  int64_t keyframe = INT64_MIN;
+  int stepback = 0;
+  int bailout = 600;
+  int seeked = 0;
+
+  ff_attach_index(ff);
+  if (ff->index) {
+    // use the exact PTS of the frame and the keyframe preceding it
+    timestamp = ffidx_frame_pts(ff->index, timestamp, prefuzz, ff->tpf);
+    keyframe = ffidx_keyframe(ff->index, timestamp, 0);
+  }
+
   if (ff->avprev == timestamp) {
     return 0;
   }
 
-  if (ff->avprev < 0 || ff->avprev >= timestamp || ((ff->avprev + 32 * ff->tpf) < timestamp)) {
-    rv = av_seek_frame(ff->pFormatCtx, ff->videoStream, timestamp, AVSEEK_FLAG_BACKWARD) ;
-    if (ff->pCodecCtx->codec->flush) {
-      avcodec_flush_buffers(ff->pCodecCtx);
+  if (keyframe != INT64_MIN) {
+    // only seek if the target cannot be reached by decoding forward
+    if (ff->avprev < keyframe || ff->avprev >= timestamp) {
+      rv = ff_seek_keyframe(ff, keyframe);
+      seeked = 1;
+      bailout = ffidx_count(ff->index, keyframe, timestamp);
+    } else {
+      bailout = ffidx_count(ff->index, ff->avprev + 1, timestamp);
     }
+    bailout += 32; // codec delay
+  }
+  else if (ff->avprev < 0 || ff->avprev >= timestamp || ((ff->avprev + 32 * ff->tpf) < timestamp)) {
+    rv = ff_seek_keyframe(ff, timestamp);
+    seeked = 1;
+  }
+
+  if (seeked) {
+    ++ff->seek_run;
+    ff->seq_run = 0;
+  } else {
+    ++ff->seq_run;
+    ff->seek_run = 0;
   }
 
   ff->avprev = -1;
@@ -619,7 +1003,6 @@ static int my_seek_frame (ffst *ff, AVPacket *packet, int64_t framenumber) {
     return -1;
   }
 
-  int bailout = 600;
   int decoded = 0;
   while (bailout > 0) {
     int err;
@@ -659,21 +1042,28 @@ static int my_seek_frame (ffst *ff, AVPacket *packet, int64_t framenumber) {
       return -7;
     }
 
-    const int64_t prefuzz = ff->tpf > 10 ? 1 : 0;
     if (pts + prefuzz >= timestamp) {
       if (pts - timestamp < ff->tpf) {
 	ff->avprev = pts;
 	return 0; // OK
       }
       // Cannot reliably seek to target frame
-      if (decoded == 0) {
+      if (keyframe != INT64_MIN && decoded == 0 && stepback < 3) {
+	// the demuxer landed after the keyframe, retry from the previous one
+	const int64_t prev = ffidx_keyframe(ff->index, timestamp, ++stepback);
+	if (want_verbose)
+	  fprintf(stdout, " PTS mismatch want: %"PRId64" got: %"PRId64" -> re-seek to %"PRId64"\n", timestamp, pts, prev);
+	if (prev == INT64_MIN || ff_seek_keyframe(ff, prev) < 0) {
+	  return -3;
+	}
+	bailout = ffidx_count(ff->index, prev, timestamp) + 32;
+	continue;
+      }
+      if (keyframe == INT64_MIN && decoded == 0) {
 	if (want_verbose)
 	  fprintf(stdout, " PTS mismatch want: %"PRId64" got: %"PRId64" -> re-seek\n", timestamp, pts);
 	// re-seek - make a guess, since we don't know the keyframe interval
-	rv = av_seek_frame(ff->pFormatCtx, ff->videoStream, MAX(0, timestamp - ff->tpf * 25), AVSEEK_FLAG_BACKWARD) ;
-	if (ff->pCodecCtx->codec->flush) {
-	  avcodec_flush_buffers(ff->pCodecCtx);
-	}
+	rv = ff_seek_keyframe(ff, MAX(0, timestamp - ff->tpf * 25));
 	if (rv < 0) {
 	  return -3;
 	}
@@ -686,23 +1076,171 @@ static int my_seek_frame (ffst *ff, AVPacket *packet, int64_t framenumber) {
       return -2;
     }
 
+    if (sink_budget > 0) {
+      --sink_budget;
+      ff_sink_frame(ff, pts, prefuzz, offset);
+    }
+
     --bailout;
     ++decoded;
   }
   return -5;
 }
 
+/* seek to the keyframe at or before the given frame and decode only it.
+ * Without index the demuxer's idea of the preceding keyframe is used.
+ */
+static int my_seek_keyframe (ffst *ff, AVPacket *packet, int64_t framenumber, int64_t *actual) {
+  AVRational tb;
+  int64_t timestamp;
+  int64_t offset;
+  int64_t pts = AV_NOPTS_VALUE;
+  int bailout = 600;
+  int rv = -5;
+
+  if (ff->videoStream < 0) return (-1);
+  tb = ff->pFormatCtx->streams[ff->videoStream]->time_base;
+
+  offset = ff_frame_offset(ff);
+  framenumber += offset;
+
+  if (framenumber < 0 || framenumber >= ff->frames) {
+    return -1;
+  }
+
+  const AVRational fr_Q = { ff->tc.den, ff->tc.num };
+  timestamp = av_rescale_q(framenumber, fr_Q, tb);
+
+  ff_attach_index(ff);
+  if (ff->index) {
+    const int64_t prefuzz = ff->tpf > 10 ? 1 : 0;
+    const int64_t keyframe = ffidx_keyframe(ff->index, ffidx_frame_pts(ff->index, timestamp, prefuzz, ff->tpf), 0);
+    if (keyframe != INT64_MIN) {
+      timestamp = keyframe;
+    }
+  }
+
+  /* the decoder is not left at a position to continue from */
+  ff->avprev = -1;
+
+  if (ff_seek_keyframe(ff, timestamp) < 0) {
+    return -1;
+  }
+
+  ff->pCodecCtx->skip_frame = AVDISCARD_NONKEY;
+  while (bailout > 0) {
+    int err;
+    if ((err = av_read_frame (ff->pFormatCtx, packet)) < 0) {
+      if (err != AVERROR_EOF) {
+	av_free_packet (packet);
+	rv = -1;
+	break;
+      } else {
+	--bailout;
+      }
+    }
+    if(packet->stream_index != ff->videoStream) {
+      av_free_packet (packet);
+      continue;
+    }
+
+    int frameFinished = 0;
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(52, 21, 0)
+    err = avcodec_decode_video (ff->pCodecCtx, ff->pFrame, &frameFinished, packet->data, packet->size);
+#else
+    err = avcodec_decode_video2 (ff->pCodecCtx, ff->pFrame, &frameFinished, packet);
+#endif
+    av_free_packet (packet);
+
+    if (err < 0) {
+      rv = -10;
+      break;
+    }
+
+    if (!frameFinished) {
+      --bailout;
+      continue;
+    }
+
+    pts = parse_pts_from_frame (ff->pFrame);
+    rv = (pts == AV_NOPTS_VALUE) ? -7 : 0;
+    break;
+  }
+  ff->pCodecCtx->skip_frame = AVDISCARD_DEFAULT;
+
+  if (rv == 0) {
+    *actual = MAX(0, av_rescale_q(pts, tb, fr_Q) - offset);
+  }
+  return rv;
+}
+
+/* frame-threading decodes several frames in parallel, which improves
+ * throughput for sequential access but delays the first frame after a seek
+ * by one frame per thread. Open a new codec context when the access pattern
+ * changes, the current one is kept if that fails.
+ */
+static void ff_adapt_threads (ffst *ff) {
+#ifdef THREAD_ADAPT
+  const AVCodec *codec = ff->pCodecCtx->codec;
+  AVCodecContext *ctx;
+  int thread_type;
+
+  if (thread_frame >= 0 || ff->threads < 2 || ff->thread_fixed || !codec) return;
+  if (!(codec->capabilities & AV_CODEC_CAP_FRAME_THREADS)) return;
+
+  if (ff->seq_run >= SEQ_FRAMETHREAD) {
+    thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  } else if (ff->seek_run >= SEEK_SLICETHREAD) {
+    thread_type = FF_THREAD_SLICE;
+  } else {
+    return;
+  }
+  if (thread_type == ff->thread_type) return;
+
+  if (want_verbose)
+    fprintf(stdout, "FFMPEG: %s frame-threading\n", (thread_type & FF_THREAD_FRAME) ? "enable" : "disable");
+
+  ctx = avcodec_alloc_context3(codec);
+  if (!ctx || avcodec_parameters_to_context(ctx, ff->pFormatCtx->streams[ff->videoStream]->codecpar) < 0) {
+    avcodec_free_context(&ctx);
+    ff->thread_fixed = 1;
+    return;
+  }
+  ctx->time_base = ff->pCodecCtx->time_base;
+  ctx->pkt_timebase = ff->pCodecCtx->pkt_timebase;
+  ff_codec_quality(ff, ctx, codec);
+
+  pthread_mutex_lock(&avcodec_lock);
+  if (ff_open_codec(ff, ctx, codec, thread_type) < 0) {
+    pthread_mutex_unlock(&avcodec_lock);
+    if (!want_quiet)
+      fprintf(stderr, "Cannot re-open the codec for file %s\n", ff->current_file);
+    avcodec_free_context(&ctx);
+    ff->thread_fixed = 1;
+    return;
+  }
+  ff_close_codec(ff);
+  ff->pCodecCtx = ctx;
+  pthread_mutex_unlock(&avcodec_lock);
+  /* decoder state was reset */
+  ff->avprev = -1;
+  ff->seq_run = ff->seek_run = 0;
+#endif
+}
+
 /**
  * seeks to frame and decodes and scales video frame
  *
  * @arg ptr handle / ff-data structure
  * @arg frame video frame to seek to
- * @arg buf  unused - see ff_get_bufferptr() - soon: optional buffer-pointer to copy data into
- * @arg w  unused - target width -> out_height parameter when opening file
- * @arg h  unused - target height -> out_height parameter when opening file
- * @arg xoff unused - soon: x-offset of this frame to target buffer
+ * @arg buf  target buffer, see ff_get_bufferptr(); only used for tiles (see \a xoff)
+ * @arg w  target width -> out_width set with ff_resize()
+ * @arg h  target height -> out_height set with ff_resize()
+ * @arg xoff x-offset of this frame in \a buf, in pixels
  * @arg xw unused -  really unused
- * @arg ys unused -  soon: y-stride (aka width of container)
+ * @arg ys y-stride (aka width of container) in pixels.
+ * If \a xoff is not zero or \a ys is larger than \a w the frame is scaled into a
+ * w x h tile of \a buf. This is only supported for packed pixel formats (RGB).
  */
 int ff_render(void *ptr, unsigned long frame,
     uint8_t* buf, int w, int h, int xoff, int xw, int ys) {
@@ -713,8 +1251,15 @@ int ff_render(void *ptr, unsigned long frame,
   }
 
   if (ff->pFrameFMT && ff->pFormatCtx && !my_seek_frame(ff, &ff->packet, frame)) {
-    ff->pSWSCtx = sws_getCachedContext(ff->pSWSCtx, ff->pCodecCtx->width, ff->pCodecCtx->height, ff->pCodecCtx->pix_fmt, ff->out_width, ff->out_height, ff->render_fmt, SWS_BICUBIC, NULL, NULL, NULL);
-    sws_scale(ff->pSWSCtx, (const uint8_t * const*) ff->pFrame->data, ff->pFrame->linesize, 0, ff->pCodecCtx->height, ff->pFrameFMT->data, ff->pFrameFMT->linesize);
+    if (xoff > 0 || ys > w) {
+      AVPicture pic;
+      avpicture_fill(&pic, buf, ff->render_fmt, ys, h);
+      pic.data[0] += xoff * (pic.linesize[0] / ys);
+      ff_scale(ff, pic.data, pic.linesize);
+    } else {
+      ff_scale(ff, ff->pFrameFMT->data, ff->pFrameFMT->linesize);
+    }
+    ff_adapt_threads(ff);
     return 0;
   }
 
@@ -726,13 +1271,141 @@ int ff_render(void *ptr, unsigned long frame,
   return -1;
 }
 
+/**
+ * decode and scale the keyframe at or before the given frame.
+ * Only keyframes are decoded (skip_frame = AVDISCARD_NONKEY).
+ *
+ * @arg ptr handle / ff-data structure
+ * @arg frame video frame to snap to
+ * @arg actual returns the frame-number of the decoded keyframe
+ * @see ff_render() for the remaining parameters
+ */
+int ff_render_key(void *ptr, unsigned long frame,
+    uint8_t* buf, int w, int h, int xoff, int xw, int ys, int64_t *actual) {
+  ffst *ff = (ffst*) ptr;
+
+  if (ff->buffer == ff->internal_buffer && (ff->buf_width <= 0 || ff->buf_height <= 0)) {
+    ff_init_moviebuffer(ff);
+  }
+
+  if (ff->pFrameFMT && ff->pFormatCtx && !my_seek_keyframe(ff, &ff->packet, frame, actual)) {
+    ff_scale(ff, ff->pFrameFMT->data, ff->pFrameFMT->linesize);
+    return 0;
+  }
+
+  if (ff->pFrameFMT && !want_quiet) {
+    fprintf( stderr, "keyframe seek unsucessful (frame: %lu).\n", frame);
+  }
+
+  *actual = frame;
+  render_empty_frame(ff, buf, w, h, xoff, ys);
+  return -1;
+}
+
+/* keyframe lookup of a file, see ff_keymap_create() */
+typedef struct {
+  FFIndex *index;
+  AVRational tb;
+  AVRational fr_Q;
+  int64_t offset;
+  int64_t frames;
+  int64_t tpf;
+} ffkeymap;
+
+/**
+ * capture what is needed to look up keyframes of the open file,
+ * so that lookups neither need the decoder nor the index registry.
+ * Call while the decoder is not in use by another thread.
+ *
+ * @arg ptr handle / ff-data structure
+ * @return keymap to free with \ref ff_keymap_free, NULL if the index is not (yet) available
+ */
+void *ff_keymap_create(void *ptr) {
+  ffst *ff = (ffst*) ptr;
+  ffkeymap *km;
+  if (!ff->index || !ff->pFormatCtx || ff->videoStream < 0) return NULL;
+  km = (ffkeymap*) calloc(1, sizeof(ffkeymap));
+  km->index = ffidx_retain(ff->index);
+  km->tb = ff->pFormatCtx->streams[ff->videoStream]->time_base;
+  km->fr_Q.num = ff->tc.den;
+  km->fr_Q.den = ff->tc.num;
+  km->offset = ff_frame_offset(ff);
+  km->frames = ff->frames;
+  km->tpf = ff->tpf;
+  return km;
+}
+
+void ff_keymap_free(void *km) {
+  if (!km) return;
+  ffidx_release(((ffkeymap*)km)->index);
+  free(km);
+}
+
+/**
+ * look up the keyframe at or before the given frame.
+ * This does not lock and may be called concurrently.
+ *
+ * @arg km keymap, see \ref ff_keymap_create
+ * @arg frame video frame
+ * @return frame-number of the keyframe, -1 if unknown
+ */
+int64_t ff_keymap_lookup(const void *km, int64_t frame) {
+  const ffkeymap *k = (const ffkeymap*) km;
+  const int64_t prefuzz = k->tpf > 10 ? 1 : 0;
+  int64_t ts;
+
+  frame += k->offset;
+  if (frame < 0 || frame >= k->frames) return -1;
+
+  ts = ffidx_frame_pts(k->index, av_rescale_q(frame, k->fr_Q, k->tb), prefuzz, k->tpf);
+  ts = ffidx_keyframe(k->index, ts, 0);
+  if (ts == INT64_MIN) {
+    return -1;
+  }
+  return MAX(0, av_rescale_q(ts, k->tb, k->fr_Q) - k->offset);
+}
+
+/**
+ * set a sink for frames that are decoded while seeking to the frame
+ * requested with \ref ff_render (before the target frame in decode order).
+ * They are scaled like the requested frame.
+ *
+ * @arg ptr handle / ff-data structure
+ * @arg sink frame sink, NULL to disable
+ */
+void ff_set_sink(void *ptr, FrameSink *sink) {
+  ffst *ff = (ffst*) ptr;
+  ff->sink = sink;
+}
+
+/**
+ * configure reduced quality decoding, call before \ref ff_open_movie
+ *
+ * @arg ptr handle / ff-data structure
+ * @arg lowres decode at 1/2^lowres of the original size, if the codec supports it
+ * @arg skip 1: skip the loop-filter for non-reference frames,
+ *  2: skip the loop-filter for all and the IDCT for non-reference frames
+ */
+void ff_set_quality(void *ptr, int lowres, int skip) {
+  ffst *ff = (ffst*) ptr;
+  ff->want_lowres = lowres;
+  ff->want_skip = skip;
+}
+
+/** max. lowres level supported by the codec of the open file */
+int ff_get_max_lowres(void *ptr) {
+  ffst *ff = (ffst*) ptr;
+  if (!ff->pCodecCtx || !ff->pCodecCtx->codec) return 0;
+  return ff->pCodecCtx->codec->max_lowres;
+}
+
 void ff_get_info(void *ptr, VInfo *i) {
   ffst *ff = (ffst*) ptr;
   if (!i) return;
   // TODO check if move is open.. (not needed, dctrl prevents that)
   i->movie_width = ff->movie_width;
   i->movie_height = ff->movie_height;
-  i->movie_aspect = ff_get_aspectratio(ptr);
+  i->movie_aspect = ff->movie_aspect;
   i->out_width = ff->out_width;
   i->out_height = ff->out_height;
   i->file_frame_offset = ff->file_frame_offset;
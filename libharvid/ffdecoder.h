@@ -28,12 +28,21 @@ void ff_get_info_canonical(void *ptr, VInfo *i, int w, int h);
 
 int ff_render(void *ptr, unsigned long frame,
     uint8_t* buf, int w, int h, int xoff, int xw, int ys);
+int ff_render_key(void *ptr, unsigned long frame,
+    uint8_t* buf, int w, int h, int xoff, int xw, int ys, int64_t *actual);
+void *ff_keymap_create(void *ptr);
+void ff_keymap_free(void *km);
+int64_t ff_keymap_lookup(const void *km, int64_t frame);
+void ff_set_sink(void *ptr, FrameSink *sink);
+void ff_set_quality(void *ptr, int lowres, int skip);
+int ff_get_max_lowres(void *ptr);
 
 int ff_open_movie(void *ptr, char *file_name, int render_fmt);
 int ff_close_movie(void *ptr);
 
 void ff_initialize (void);
 void ff_cleanup (void);
+void ff_threads_configure (int budget, int frame);
 
 uint8_t *ff_get_bufferptr(void *ptr);
 uint8_t *ff_set_bufferptr(void *ptr, uint8_t *buf);
@@ -0,0 +1,531 @@
+/*
+   This file is part of harvid
+
+   Copyright (C) 2018 Robin Gareus <robin@gareus.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "ffcompat.h"
+#include "ffindex.h"
+
+#define HASH_FUNCTION HASH_SFH
+#include "uthash.h"
+
+#ifdef _WIN32
+#define DIRSEP '\\'
+#else
+#define DIRSEP '/'
+#endif
+
+/* index state */
+#define FXS_SCAN  1 ///< background scan in progress
+#define FXS_READY 2 ///< index is valid and can be used
+#define FXS_FAIL  4 ///< index cannot be created for this file
+
+#define FFIDX_KEEP 32 ///< max. number of indices kept in memory that no decoder uses
+
+#define FFIDX_MAGIC   "harvidx"
+#define FFIDX_VERSION 1
+
+struct FFIndex {
+  char    *fn;
+  int      stream;
+  int      tb_num;
+  int      tb_den;
+  int64_t  fsize;
+  int64_t  mtime;
+  int      state;
+  int      refcnt;
+  int      detached;  ///< no longer in the registry, free when unreferenced
+  unsigned int lru;   ///< last use, see prune_unused()
+  int64_t  n_frames;
+  int64_t *pts;       ///< sorted presentation timestamps of all video frames
+  int64_t  n_keys;
+  int64_t *keys;      ///< sorted presentation timestamps of all keyframes
+  UT_hash_handle hh;
+};
+
+/* on-disk file header, followed by
+ * n_frames * int64_t frame PTS and n_keys * int64_t keyframe PTS */
+typedef struct {
+  char     magic[8];
+  int32_t  version;
+  int32_t  stream;
+  int32_t  tb_num;
+  int32_t  tb_den;
+  int64_t  fsize;
+  int64_t  mtime;
+  int64_t  n_frames;
+  int64_t  n_keys;
+} FFIndexHeader;
+
+/* Option flags and global variables */
+extern int want_quiet;
+extern int want_verbose;
+
+static pthread_mutex_t idx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  idx_cond = PTHREAD_COND_INITIALIZER;
+static FFIndex *idx_map = NULL;
+static int   idx_scans = 0;
+static int   idx_abort = 0;
+static int   idx_enable = 1;
+static char *idx_dir = NULL;
+static unsigned int idx_tick = 0;
+
+//--------------------------------------------
+// index management
+//--------------------------------------------
+
+static void free_index(FFIndex *idx) {
+  free(idx->pts);
+  free(idx->keys);
+  free(idx->fn);
+  free(idx);
+}
+
+/* drop the least recently used indices that no decoder references,
+ * keeping at most FFIDX_KEEP. They are loaded again from the
+ * index file when needed. Call with idx_lock held. */
+static void prune_unused(void) {
+  FFIndex *idx, *tmp, *lru;
+  int n;
+  while (1) {
+    n = 0;
+    lru = NULL;
+    HASH_ITER(hh, idx_map, idx, tmp) {
+      if (idx->refcnt > 0 || idx->state == FXS_SCAN) continue;
+      ++n;
+      if (!lru || idx->lru < lru->lru) lru = idx;
+    }
+    if (n <= FFIDX_KEEP) break;
+    HASH_DEL(idx_map, lru);
+    free_index(lru);
+  }
+}
+
+static int cmp_i64(const void *a, const void *b) {
+  const int64_t x = *(const int64_t*)a;
+  const int64_t y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static int append_ts(int64_t **arr, int64_t *n, size_t *alloc, int64_t ts) {
+  if ((size_t)(*n) >= *alloc) {
+    size_t na = (*alloc) ? (*alloc) * 2 : 4096;
+    int64_t *tmp = realloc(*arr, na * sizeof(int64_t));
+    if (!tmp) return -1;
+    *arr = tmp;
+    *alloc = na;
+  }
+  (*arr)[(*n)++] = ts;
+  return 0;
+}
+
+/** 64bit FNV-1a, used to name index files in the cache-dir */
+static uint64_t fnv1a(const char *s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (*s) {
+    h ^= (uint8_t)*s++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static char *index_path(const char *fn) {
+  char *path;
+  if (idx_dir) {
+    const size_t len = strlen(idx_dir) + 24;
+    path = malloc(len);
+    snprintf(path, len, "%s%c%016llx.hvidx", idx_dir, DIRSEP, (unsigned long long) fnv1a(fn));
+  } else {
+    // hidden sidecar file next to the video: "dir/.name.hvidx"
+    const char *base = strrchr(fn, DIRSEP);
+    const size_t dl = base ? base - fn + 1 : 0;
+    const size_t len = strlen(fn) + 8;
+    base = base ? base + 1 : fn;
+    path = malloc(len);
+    snprintf(path, len, "%.*s.%s.hvidx", (int) dl, fn, base);
+  }
+  return path;
+}
+
+//--------------------------------------------
+// persistence
+//--------------------------------------------
+
+static int load_index(FFIndex *idx) {
+  FFIndexHeader hdr;
+  int64_t i;
+  char *path = index_path(idx->fn);
+  FILE *fp = fopen(path, "rb");
+  free(path);
+  if (!fp) return -1;
+
+  if (fread(&hdr, sizeof(FFIndexHeader), 1, fp) != 1
+      || memcmp(hdr.magic, FFIDX_MAGIC, sizeof(FFIDX_MAGIC))
+      || hdr.version != FFIDX_VERSION
+      || hdr.stream != idx->stream
+      || hdr.tb_num != idx->tb_num
+      || hdr.tb_den != idx->tb_den
+      || hdr.fsize != idx->fsize
+      || hdr.mtime != idx->mtime
+      || hdr.n_frames < 1 || hdr.n_frames > idx->fsize
+      || hdr.n_keys < 1 || hdr.n_keys > hdr.n_frames
+     ) {
+    fclose(fp);
+    return -1;
+  }
+
+  idx->pts = malloc(hdr.n_frames * sizeof(int64_t));
+  idx->keys = malloc(hdr.n_keys * sizeof(int64_t));
+  if (!idx->pts || !idx->keys
+      || fread(idx->pts, sizeof(int64_t), hdr.n_frames, fp) != (size_t) hdr.n_frames
+      || fread(idx->keys, sizeof(int64_t), hdr.n_keys, fp) != (size_t) hdr.n_keys
+     ) {
+    goto fail;
+  }
+  fclose(fp);
+
+  for (i = 1; i < hdr.n_frames; ++i) {
+    if (idx->pts[i] < idx->pts[i - 1]) goto fail2;
+  }
+  for (i = 1; i < hdr.n_keys; ++i) {
+    if (idx->keys[i] < idx->keys[i - 1]) goto fail2;
+  }
+  idx->n_frames = hdr.n_frames;
+  idx->n_keys = hdr.n_keys;
+  return 0;
+
+fail:
+  fclose(fp);
+fail2:
+  free(idx->pts); idx->pts = NULL;
+  free(idx->keys); idx->keys = NULL;
+  return -1;
+}
+
+static void save_index(FFIndex *idx) {
+  FFIndexHeader hdr;
+  char *path = index_path(idx->fn);
+  const size_t len = strlen(path) + 8;
+  char *tmp = malloc(len);
+  FILE *fp;
+  int ok;
+
+  snprintf(tmp, len, "%s.tmp", path);
+  if (!(fp = fopen(tmp, "wb"))) {
+    if (want_verbose)
+      fprintf(stderr, "Cannot write keyframe index %s\n", tmp);
+    free(tmp); free(path);
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(FFIndexHeader));
+  memcpy(hdr.magic, FFIDX_MAGIC, sizeof(FFIDX_MAGIC));
+  hdr.version  = FFIDX_VERSION;
+  hdr.stream   = idx->stream;
+  hdr.tb_num   = idx->tb_num;
+  hdr.tb_den   = idx->tb_den;
+  hdr.fsize    = idx->fsize;
+  hdr.mtime    = idx->mtime;
+  hdr.n_frames = idx->n_frames;
+  hdr.n_keys   = idx->n_keys;
+
+  ok = fwrite(&hdr, sizeof(FFIndexHeader), 1, fp) == 1
+    && fwrite(idx->pts, sizeof(int64_t), idx->n_frames, fp) == (size_t) idx->n_frames
+    && fwrite(idx->keys, sizeof(int64_t), idx->n_keys, fp) == (size_t) idx->n_keys;
+  ok &= fclose(fp) == 0;
+
+#ifdef _WIN32
+  if (ok) unlink(path);
+#endif
+  if (!ok || rename(tmp, path)) {
+    unlink(tmp);
+  }
+  free(tmp);
+  free(path);
+}
+
+//--------------------------------------------
+// background scan
+//--------------------------------------------
+
+/** packet-only demux pass over the video stream, no decoding */
+static int scan_file(FFIndex *idx) {
+  AVFormatContext *fc = NULL;
+  AVPacket pkt;
+  size_t alloc_pts = 0, alloc_keys = 0;
+  int64_t no_pts = 0;
+  int i;
+  int rv = -1;
+
+  if (avformat_open_input(&fc, idx->fn, NULL, NULL) < 0) {
+    return -1;
+  }
+
+  if (idx->stream >= fc->nb_streams
+      || fc->streams[idx->stream]->time_base.num != idx->tb_num
+      || fc->streams[idx->stream]->time_base.den != idx->tb_den) {
+    goto out;
+  }
+
+  for (i = 0; i < fc->nb_streams; ++i) {
+    fc->streams[i]->discard = (i == idx->stream) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+  }
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  while (!idx_abort && av_read_frame(fc, &pkt) >= 0) {
+    if (pkt.stream_index == idx->stream) {
+      int64_t ts = pkt.pts;
+      if (ts == AV_NOPTS_VALUE) {
+	ts = pkt.dts;
+	++no_pts;
+      }
+      if (ts == AV_NOPTS_VALUE
+	  || append_ts(&idx->pts, &idx->n_frames, &alloc_pts, ts)
+	  || ((pkt.flags & AV_PKT_FLAG_KEY) && append_ts(&idx->keys, &idx->n_keys, &alloc_keys, ts))
+	 ) {
+	av_free_packet(&pkt);
+	goto out;
+      }
+    }
+    av_free_packet(&pkt);
+  }
+
+  /* decode-timestamps can only substitute PTS if all packets lack them,
+   * otherwise frame reordering makes the index unreliable */
+  if (idx_abort || idx->n_frames == 0 || idx->n_keys == 0 || (no_pts > 0 && no_pts != idx->n_frames)) {
+    goto out;
+  }
+
+  qsort(idx->pts, idx->n_frames, sizeof(int64_t), cmp_i64);
+  qsort(idx->keys, idx->n_keys, sizeof(int64_t), cmp_i64);
+  rv = 0;
+
+out:
+  avformat_close_input(&fc);
+  if (rv) {
+    free(idx->pts); idx->pts = NULL; idx->n_frames = 0;
+    free(idx->keys); idx->keys = NULL; idx->n_keys = 0;
+  }
+  return rv;
+}
+
+static void *scan_thread(void *arg) {
+  FFIndex *idx = (FFIndex*) arg;
+  int ok = 0;
+
+  if (!load_index(idx)) {
+    ok = 1;
+  } else if (!scan_file(idx)) {
+    save_index(idx);
+    ok = 1;
+  }
+
+  if (want_verbose) {
+    if (ok)
+      fprintf(stdout, "keyframe index: %s -- %"PRId64" frames, %"PRId64" keyframes\n",
+	  idx->fn, idx->n_frames, idx->n_keys);
+    else
+      fprintf(stdout, "keyframe index: %s -- not available\n", idx->fn);
+  }
+
+  pthread_mutex_lock(&idx_lock);
+  idx->state = ok ? FXS_READY : FXS_FAIL;
+  idx->lru = ++idx_tick;
+  if (idx->detached && idx->refcnt == 0) {
+    free_index(idx);
+  }
+  --idx_scans;
+  pthread_cond_broadcast(&idx_cond);
+  pthread_mutex_unlock(&idx_lock);
+  pthread_exit(NULL);
+  return (NULL);
+}
+
+//--------------------------------------------
+// public API
+//--------------------------------------------
+
+void ff_index_configure(int enable, const char *cachedir) {
+  pthread_mutex_lock(&idx_lock);
+  idx_enable = enable;
+  free(idx_dir);
+  idx_dir = cachedir ? strdup(cachedir) : NULL;
+  pthread_mutex_unlock(&idx_lock);
+}
+
+void ffidx_initialize(void) {
+  pthread_mutex_lock(&idx_lock);
+  idx_abort = 0;
+  pthread_mutex_unlock(&idx_lock);
+}
+
+void ffidx_cleanup(void) {
+  FFIndex *idx, *tmp;
+  pthread_mutex_lock(&idx_lock);
+  idx_abort = 1;
+  while (idx_scans > 0) {
+    pthread_cond_wait(&idx_cond, &idx_lock);
+  }
+  HASH_ITER(hh, idx_map, idx, tmp) {
+    HASH_DEL(idx_map, idx);
+    if (idx->refcnt == 0) {
+      free_index(idx);
+    } else {
+      idx->detached = 1;
+    }
+  }
+  free(idx_dir);
+  idx_dir = NULL;
+  pthread_mutex_unlock(&idx_lock);
+}
+
+FFIndex *ffidx_acquire(const char *fn, int stream, int tb_num, int tb_den) {
+  FFIndex *idx = NULL;
+  struct stat sb;
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  if (!fn || stat(fn, &sb)) return NULL;
+
+  pthread_mutex_lock(&idx_lock);
+  if (!idx_enable || idx_abort) {
+    pthread_mutex_unlock(&idx_lock);
+    return NULL;
+  }
+
+  HASH_FIND_STR(idx_map, fn, idx);
+
+  if (idx && (idx->fsize != sb.st_size || idx->mtime != sb.st_mtime)) {
+    // file was modified, discard the stale index
+    HASH_DEL(idx_map, idx);
+    idx->detached = 1;
+    if (idx->refcnt == 0 && idx->state != FXS_SCAN) {
+      free_index(idx);
+    }
+    idx = NULL;
+  }
+
+  if (idx) {
+    if (idx->state != FXS_READY || idx->stream != stream
+	|| idx->tb_num != tb_num || idx->tb_den != tb_den) {
+      idx = NULL;
+    } else {
+      ++idx->refcnt;
+      idx->lru = ++idx_tick;
+    }
+    pthread_mutex_unlock(&idx_lock);
+    return idx;
+  }
+
+  idx = (FFIndex*) calloc(1, sizeof(FFIndex));
+  idx->fn = strdup(fn);
+  idx->stream = stream;
+  idx->tb_num = tb_num;
+  idx->tb_den = tb_den;
+  idx->fsize = sb.st_size;
+  idx->mtime = sb.st_mtime;
+  idx->state = FXS_SCAN;
+  idx->lru = ++idx_tick;
+  HASH_ADD_KEYPTR(hh, idx_map, idx->fn, strlen(idx->fn), idx);
+  prune_unused();
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, scan_thread, (void*) idx)) {
+    if (!want_quiet)
+      fprintf(stderr, "Cannot start keyframe index thread\n");
+    idx->state = FXS_FAIL;
+  } else {
+    ++idx_scans;
+  }
+  pthread_attr_destroy(&attr);
+  pthread_mutex_unlock(&idx_lock);
+  return NULL;
+}
+
+FFIndex *ffidx_retain(FFIndex *idx) {
+  if (!idx) return NULL;
+  pthread_mutex_lock(&idx_lock);
+  ++idx->refcnt;
+  pthread_mutex_unlock(&idx_lock);
+  return idx;
+}
+
+void ffidx_release(FFIndex *idx) {
+  if (!idx) return;
+  pthread_mutex_lock(&idx_lock);
+  if (--idx->refcnt == 0) {
+    if (idx->detached) {
+      free_index(idx);
+    } else {
+      idx->lru = ++idx_tick;
+      prune_unused();
+    }
+  }
+  pthread_mutex_unlock(&idx_lock);
+}
+
+/* index of the first element >= ts */
+static int64_t lower_bound(const int64_t *arr, int64_t n, int64_t ts) {
+  int64_t lo = 0, hi = n;
+  while (lo < hi) {
+    const int64_t mid = lo + (hi - lo) / 2;
+    if (arr[mid] < ts) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int64_t ffidx_keyframe(const FFIndex *idx, int64_t ts, int n) {
+  int64_t k = lower_bound(idx->keys, idx->n_keys, ts + 1) - 1;
+  // frames before the first keyframe can only be reached from there
+  if (k < 0) k = 0;
+  k -= n;
+  if (k < 0) return INT64_MIN;
+  return idx->keys[k];
+}
+
+int64_t ffidx_frame_pts(const FFIndex *idx, int64_t ts, int64_t fuzz, int64_t tpf) {
+  const int64_t i = lower_bound(idx->pts, idx->n_frames, ts - fuzz);
+  if (i < idx->n_frames && idx->pts[i] < ts + tpf) {
+    return idx->pts[i];
+  }
+  if (i == 0) {
+    // before the first frame (start-offset)
+    return idx->pts[0];
+  }
+  // no frame starts in [ts, ts + tpf): use the one displayed at ts
+  return idx->pts[i - 1];
+}
+
+int64_t ffidx_count(const FFIndex *idx, int64_t from, int64_t to) {
+  if (to < from) return 0;
+  return lower_bound(idx->pts, idx->n_frames, to + 1) - lower_bound(idx->pts, idx->n_frames, from);
+}
+
+// vim:sw=2 sts=2 ts=8 et:
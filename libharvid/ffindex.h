@@ -0,0 +1,85 @@
+/*
+   This file is part of harvid
+
+   Copyright (C) 2018 Robin Gareus <robin@gareus.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FFINDEX_H
+#define _FFINDEX_H
+
+#include <stdint.h>
+
+/** keyframe and PTS index of a video stream, shared by all decoders of a file */
+typedef struct FFIndex FFIndex;
+
+/** set up the index registry -- called by ff_initialize() */
+void ffidx_initialize (void);
+
+/** abort pending index scans and free all indices -- called by ff_cleanup() */
+void ffidx_cleanup (void);
+
+/**
+ * configure the keyframe index
+ * @param enable 0: disable the index, seek by guessing.
+ * @param cachedir directory to store index files in. If NULL the index
+ * is saved next to the video-file (or kept in memory if that fails).
+ */
+void ff_index_configure (int enable, const char *cachedir);
+
+/**
+ * look up the index for the given file.
+ *
+ * This function does not block: if no index is available yet, a packet-only
+ * demux pass is started in the background and NULL is returned.
+ *
+ * @param fn video file name
+ * @param stream index of the video stream in the file
+ * @param tb_num stream time-base numerator
+ * @param tb_den stream time-base denominator
+ * @return referenced index, release with \ref ffidx_release(), or NULL
+ */
+FFIndex *ffidx_acquire (const char *fn, int stream, int tb_num, int tb_den);
+
+/** take another reference of an index obtained by \ref ffidx_acquire() */
+FFIndex *ffidx_retain (FFIndex *idx);
+
+/** drop a reference obtained by \ref ffidx_acquire() */
+void ffidx_release (FFIndex *idx);
+
+/**
+ * find the last keyframe with a presentation timestamp at or before \a ts
+ * @param idx index to search
+ * @param ts target timestamp (stream time-base)
+ * @param n number of keyframes to step back from the result (usually 0)
+ * @return PTS of the keyframe or INT64_MIN if there is none.
+ */
+int64_t ffidx_keyframe (const FFIndex *idx, int64_t ts, int n);
+
+/**
+ * map a requested timestamp to the PTS of the frame displayed at that time
+ * @param idx index to search
+ * @param ts target timestamp (stream time-base)
+ * @param fuzz tolerance for early PTS (rounding of the frame-rate)
+ * @param tpf duration of one frame (stream time-base)
+ * @return PTS of the frame, clamped to the first and last frame of the stream.
+ */
+int64_t ffidx_frame_pts (const FFIndex *idx, int64_t ts, int64_t fuzz, int64_t tpf);
+
+/**
+ * count frames with a PTS in the range [\a from, \a to]
+ */
+int64_t ffidx_count (const FFIndex *idx, int64_t from, int64_t to);
+
+#endif
@@ -30,6 +30,7 @@
 #include "ffdecoder.h"
 
 #include <time.h>
+#include <sys/time.h>
 #include <assert.h>
 #include <pthread.h>
 
@@ -39,10 +40,17 @@
 
 /* FLAGS */
 #define CLF_DECODING 1 //< decoder is active
-#define CLF_INUSE 2    //< currently being served
+#define CLF_INUSE 2    //< currently being served (status info, see .refcnt)
 #define CLF_VALID 4    //< cacheline is valid (has decoded frame)
 #define CLF_RELEASE 8  //<invalidate this cacheline once it's no longer in use
 
+/* max. time to wait for a cacheline to become available */
+#define FC_WAIT_MS (1000)
+
+/* number of independently locked cache partitions */
+#define FC_SHARD_BITS 4
+#define FC_SHARDS (1 << FC_SHARD_BITS)
+
 typedef struct videocacheline {
   int id;         // file ID from VidMap
   short w;
@@ -50,178 +58,676 @@ typedef struct videocacheline {
   int fmt;        // pixel format
   int64_t frame;
   int flags;
-  int refcnt;     // CLF_INUSE reference count
-  time_t lru;     // east recently used time
-  //int hitcount  //  -- unused; least-frequently used idea
+  int refcnt;     // reference count, atomic
+  int used;       // accessed since last eviction scan, atomic
+  time_t decoded; // time when the frame was decoded
   uint8_t *b;     //< data buffer pointer
-  int alloc_size; //< allocated buffer size (status info)
+  int alloc_size; //< allocated buffer size
+  int pending;           //< decoding in progress, protected by .lock
+  pthread_mutex_t lock;
+  pthread_cond_t  ready; //< signalled when decoding is complete
+  struct videocacheline *lru_prev; //< more recently used cacheline
+  struct videocacheline *lru_next; //< less recently used cacheline
   UT_hash_handle hh;
 } videocacheline;
 
 /* id +w +h + fmt + frame */
 #define CLKEYLEN (offsetof(videocacheline, flags) - offsetof(videocacheline, id))
 
-/* get a new cacheline or replace and existing one
- * NB. the cache needs to be write-locked when calling this
- * and realloccl_buf() must be called after this
+typedef struct {
+  pthread_rwlock_t lock;
+  videocacheline *vcache;
+  videocacheline *lru_head; //< most recently added cacheline
+  videocacheline *lru_tail; //< next candidate for eviction
+} fcshard;
+
+/* max. distance of frames that wait for a keyframe decode in progress */
+#define SNAP_GOP 300
+
+/* keyframe decode whose frame-number is not known in advance, see fc_snapcl() */
+typedef struct snapflight {
+  unsigned short id;
+  short w;
+  short h;
+  int fmt;
+  int64_t frame;   //< requested frame
+  int64_t key;     //< keyframe that was decoded, -1 if decoding failed
+  int done;
+  int waiters;     //< threads waiting for the result
+  struct snapflight *next;
+} snapflight;
+
+/* number of concurrently tracked sequential read-ahead streams */
+#define RA_STREAMS 16
+
+typedef struct {
+  unsigned short id;
+  short w;
+  short h;
+  int fmt;
+  void *dc;        //< decoder control to use
+  int64_t last;    //< last requested frame
+  int64_t next;    //< next frame to read ahead
+  int64_t end;     //< read ahead up to (excluding) this frame
+  int run;         //< number of consecutive sequential requests
+  double t_last;   //< time of last request
+  double interval; //< average time between sequential requests
+  double decode;   //< average time to decode a frame
+} rastream;
+
+typedef struct {
+  int cfg_cachesize;   //< max number of cachelines (if cfg_cachemem is zero)
+  size_t cfg_cachemem; //< memory limit in bytes, 0: use cfg_cachesize
+  size_t cache_bytes;  //< sum of all cacheline allocations, atomic
+  int cache_lines;     //< number of cachelines, atomic
+  unsigned int evict_hand; //< shard to start the next eviction at, atomic
+  fcshard shard[FC_SHARDS];
+  int cache_hits;
+  int cache_miss;
+  int cache_prefetch;
+  int cache_gop;
+  int rel_waiters;       //< threads waiting for a cacheline, atomic
+  unsigned int rel_seq;  //< incremented whenever a cacheline is released, protected by rel_lock
+  pthread_mutex_t rel_lock;
+  pthread_cond_t rel_cond;
+  int cfg_readahead;   //< max number of frames to read ahead, 0: disable
+  int cfg_gopcache;    //< max number of frames decoded while seeking to keep
+  rastream ra[RA_STREAMS];
+  pthread_mutex_t ra_lock;
+  pthread_cond_t ra_cond;
+  pthread_t ra_thread;
+  int ra_run;          //< 1: thread is running, -1: request to terminate
+  snapflight *snaps;   //< keyframe decodes in progress, protected by snap_lock
+  pthread_mutex_t snap_lock;
+  pthread_cond_t snap_cond;
+} xjcd;
+
+static fcshard *shard_of(xjcd *cc, unsigned short id, int64_t frame) {
+  const uint64_t h = (((uint64_t)frame << 16) | id) * 0x9e3779b97f4a7c15ULL;
+  return &cc->shard[h >> (64 - FC_SHARD_BITS)];
+}
+
+static int refcount(videocacheline *cl) {
+  return __sync_add_and_fetch(&cl->refcnt, 0);
+}
+
+/* Waiting for cachelines
+ * A thread registers with wait_begin() *before* checking whether a cacheline
+ * is available. Threads that release a cacheline only signal if someone
+ * is registered, so the common case does not touch the mutex.
  */
-static videocacheline *getcl(videocacheline **cache, int cfg_cachesize,
-    unsigned short id, short w, short h, int fmt, int64_t frame) {
-  videocacheline *cl = NULL;
+static unsigned int wait_begin(xjcd *cc) {
+  unsigned int seq;
+  __sync_fetch_and_add(&cc->rel_waiters, 1);
+  pthread_mutex_lock(&cc->rel_lock);
+  seq = cc->rel_seq;
+  pthread_mutex_unlock(&cc->rel_lock);
+  return seq;
+}
 
-  if (HASH_COUNT(*cache) >= cfg_cachesize) {
-    time_t lru = time(NULL) + 1;
-    videocacheline *tmp, *clru = NULL;
-    HASH_ITER(hh, *cache, cl, tmp) {
-      if (cl->flags == 0) return cl;
-      if (!(cl->flags&(CLF_DECODING|CLF_INUSE)) && (cl->lru < lru))  {
-        lru = cl->lru;
-        clru = cl;
-      }
+static void wait_end(xjcd *cc) {
+  __sync_fetch_and_sub(&cc->rel_waiters, 1);
+}
+
+/* wait until a cacheline was released after \a seq was read
+ * @param deadline absolute time to give up, NULL: wait forever
+ * @return 0 if a cacheline was released, non-zero on timeout
+ */
+static int wait_release(xjcd *cc, unsigned int *seq, const struct timespec *deadline) {
+  int rv;
+  pthread_mutex_lock(&cc->rel_lock);
+  while (cc->rel_seq == *seq) {
+    if (!deadline) {
+      pthread_cond_wait(&cc->rel_cond, &cc->rel_lock);
+    } else if (pthread_cond_timedwait(&cc->rel_cond, &cc->rel_lock, deadline)) {
+      break;
     }
-    if (clru) {
-      HASH_DEL(*cache, clru);
-      assert(clru->refcnt == 0);
-      cl = clru;
-      if (cl->b && cl->w == w && cl->h == h && cl->fmt == fmt) {
-        cl->flags = 0;
-        memset(&cl->hh, 0, sizeof(UT_hash_handle));
-      } else {
-        free(cl->b);
-        memset(cl, 0, sizeof(videocacheline));
+  }
+  rv = cc->rel_seq == *seq;
+  *seq = cc->rel_seq;
+  pthread_mutex_unlock(&cc->rel_lock);
+  return rv;
+}
+
+/* a cacheline became unused, or space was freed */
+static void signal_release(xjcd *cc) {
+  if (__sync_add_and_fetch(&cc->rel_waiters, 0) == 0) {
+    return;
+  }
+  pthread_mutex_lock(&cc->rel_lock);
+  cc->rel_seq++;
+  pthread_cond_broadcast(&cc->rel_cond);
+  pthread_mutex_unlock(&cc->rel_lock);
+}
+
+/* LRU list
+ * all cachelines of a shard are kept in a doubly-linked list, new ones are
+ * added at the head. Eviction scans from the tail and gives cachelines that
+ * were used since the last scan a second chance (CLOCK).
+ * NB. the shard needs to be write-locked when calling these
+ */
+static void lru_unlink(fcshard *sh, videocacheline *cl) {
+  if (cl->lru_prev) cl->lru_prev->lru_next = cl->lru_next;
+  else sh->lru_head = cl->lru_next;
+  if (cl->lru_next) cl->lru_next->lru_prev = cl->lru_prev;
+  else sh->lru_tail = cl->lru_prev;
+  cl->lru_prev = cl->lru_next = NULL;
+}
+
+static void lru_push(fcshard *sh, videocacheline *cl) {
+  cl->lru_prev = NULL;
+  cl->lru_next = sh->lru_head;
+  if (sh->lru_head) sh->lru_head->lru_prev = cl;
+  else sh->lru_tail = cl;
+  sh->lru_head = cl;
+}
+
+static videocacheline *lru_victim(fcshard *sh) {
+  unsigned int n = HASH_COUNT(sh->vcache);
+  videocacheline *cl;
+  while (n-- > 0 && (cl = sh->lru_tail)) {
+    if (!cl->used && !(cl->flags & CLF_DECODING) && refcount(cl) == 0) {
+      return cl;
+    }
+    cl->used = 0;
+    lru_unlink(sh, cl);
+    lru_push(sh, cl);
+  }
+  return NULL;
+}
+
+static void freecl(videocacheline *cl) {
+  pthread_mutex_destroy(&cl->lock);
+  pthread_cond_destroy(&cl->ready);
+  free(cl->b);
+  free(cl);
+}
+
+/* remove a cacheline from the cache
+ * NB. the shard needs to be write-locked when calling this
+ */
+static void delcl(xjcd *cc, fcshard *sh, videocacheline *cl) {
+  lru_unlink(sh, cl);
+  HASH_DEL(sh->vcache, cl);
+  __sync_fetch_and_sub(&cc->cache_bytes, cl->alloc_size);
+  __sync_fetch_and_sub(&cc->cache_lines, 1);
+  signal_release(cc);
+}
+
+/* evict the least recently used cacheline of any shard
+ * The evicted cacheline is returned in \a spare for re-use.
+ * Shards are visited twice: the first round may only have cleared the
+ * used-flag of otherwise idle cachelines.
+ */
+static int evictcl(xjcd *cc, unsigned int hand, videocacheline **spare) {
+  int i;
+  for (i = 0; i < 2 * FC_SHARDS; ++i) {
+    fcshard *sh = &cc->shard[(hand + i) % FC_SHARDS];
+    videocacheline *cl;
+    pthread_rwlock_wrlock(&sh->lock);
+    if ((cl = lru_victim(sh))) {
+      delcl(cc, sh, cl);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    if (cl) {
+      if (*spare) freecl(*spare);
+      *spare = cl;
+      return 0;
+    }
+  }
+  dlog(DLOG_WARNING, "CACHE: cache full - all cache-lines in use.\n");
+  return -1;
+}
+
+/* account for a new cacheline of the given size,
+ * evict cachelines until it fits.
+ * NB. no shard must be locked when calling this
+ */
+static int reservecl(xjcd *cc, size_t bytes, videocacheline **spare) {
+  const unsigned int hand = __sync_fetch_and_add(&cc->evict_hand, 1);
+  for (;;) {
+    if (cc->cfg_cachemem > 0) {
+      const size_t used = __sync_add_and_fetch(&cc->cache_bytes, 0);
+      if (used + bytes <= cc->cfg_cachemem || __sync_add_and_fetch(&cc->cache_lines, 0) == 0) {
+        if (__sync_bool_compare_and_swap(&cc->cache_bytes, used, used + bytes)) {
+          __sync_fetch_and_add(&cc->cache_lines, 1);
+          return 0;
+        }
+        continue;
       }
     } else {
-      dlog(DLOG_WARNING, "CACHE: cache full - all cache-lines in use.\n");
-      return NULL;
+      const int used = __sync_add_and_fetch(&cc->cache_lines, 0);
+      if (used < cc->cfg_cachesize) {
+        if (__sync_bool_compare_and_swap(&cc->cache_lines, used, used + 1)) {
+          __sync_fetch_and_add(&cc->cache_bytes, bytes);
+          return 0;
+        }
+        continue;
+      }
+    }
+    if (evictcl(cc, hand, spare)) {
+      return -1;
     }
   }
+}
+
+static void unreservecl(xjcd *cc, size_t bytes, videocacheline *spare) {
+  __sync_fetch_and_sub(&cc->cache_bytes, bytes);
+  __sync_fetch_and_sub(&cc->cache_lines, 1);
+  if (spare) freecl(spare);
+}
+
+/* set up a cacheline, re-using an evicted one if possible */
+static videocacheline *initcl(videocacheline *cl, size_t bytes,
+    unsigned short id, short w, short h, int fmt, int64_t frame) {
 
-  if (!cl)
+  if (cl) {
+    if (!(cl->b && cl->w == w && cl->h == h && cl->fmt == fmt)) {
+      free(cl->b);
+      cl->b = NULL;
+    }
+    assert(cl->refcnt == 0);
+    cl->flags = 0;
+    cl->used = 0;
+    memset(&cl->hh, 0, sizeof(UT_hash_handle));
+  } else {
     cl = calloc(1, sizeof(videocacheline));
+    pthread_mutex_init(&cl->lock, NULL);
+    pthread_cond_init(&cl->ready, NULL);
+  }
 
   cl->id = id;
   cl->w = w;
   cl->h = h;
   cl->fmt = fmt;
   cl->frame = frame;
-  cl->lru = 0;
-  HASH_ADD(hh, *cache, id, CLKEYLEN, cl);
+  cl->decoded = 0;
+  cl->alloc_size = bytes;
+  return cl;
+}
+
+/* add a new cacheline, re-using an evicted one if possible
+ * NB. the shard needs to be write-locked when calling this,
+ * space must have been reserved with reservecl()
+ * and realloccl_buf() must be called after this
+ */
+static videocacheline *newcl(fcshard *sh, videocacheline *cl, size_t bytes,
+    unsigned short id, short w, short h, int fmt, int64_t frame) {
+  cl = initcl(cl, bytes, id, w, h, fmt, frame);
+  HASH_ADD(hh, sh->vcache, id, CLKEYLEN, cl);
+  lru_push(sh, cl);
   return cl;
 }
 
-/* check if requested data exists in cache */
-static videocacheline *testclwh(videocacheline *cache,
-    pthread_rwlock_t *lock,
+/* check if requested data exists in cache
+ * NB. the shard needs to be locked when calling this
+ */
+static videocacheline *findcl(videocacheline *cache,
     int64_t frame, short w, short h, int fmt, unsigned short id) {
   videocacheline *rv;
-  const videocacheline cmp = {id, w, h, fmt, frame, 0, 0, 0, NULL };
-  pthread_rwlock_rdlock(lock);
+  videocacheline cmp;
+  memset(&cmp, 0, sizeof(videocacheline));
+  cmp.id = id; cmp.w = w; cmp.h = h; cmp.fmt = fmt; cmp.frame = frame;
   HASH_FIND(hh, cache, &cmp, CLKEYLEN, rv);
-  pthread_rwlock_unlock(lock);
   return rv;
 }
 
+/* take a reference
+ * NB. the shard needs to be locked (read-lock suffices) when calling this
+ */
+static void retaincl(videocacheline *cl) {
+  __sync_fetch_and_add(&cl->refcnt, 1);
+  __sync_fetch_and_or(&cl->used, 1);
+}
+
+/* drop a reference, free the cacheline if it was invalidated.
+ * The read-lock prevents eviction of the cacheline once the count
+ * drops to zero. Invalidated cachelines are no longer in the cache
+ * and can not gain new references.
+ */
+static void releasecl(xjcd *cc, videocacheline *cl) {
+  fcshard *sh = shard_of(cc, cl->id, cl->frame);
+  int release;
+  pthread_rwlock_rdlock(&sh->lock);
+  release = __sync_sub_and_fetch(&cl->refcnt, 1);
+  assert(release >= 0);
+  if (release == 0) {
+    signal_release(cc);
+  }
+  release = (release == 0 && (cl->flags & CLF_RELEASE));
+  pthread_rwlock_unlock(&sh->lock);
+  if (release) {
+    freecl(cl);
+  }
+}
+
+/* mark decoding as complete and wake up threads waiting for this frame
+ * NB. the shard needs to be write-locked when calling this
+ */
+static void decodedcl(xjcd *cc, videocacheline *cl, int flags) {
+  cl->flags &= ~CLF_DECODING;
+  cl->flags |= flags;
+  pthread_mutex_lock(&cl->lock);
+  cl->pending = 0;
+  pthread_cond_broadcast(&cl->ready);
+  pthread_mutex_unlock(&cl->lock);
+  signal_release(cc);
+}
+
 /* clear cache
  * if f==1 wait for used cachelines to become unused
  * if f==0 the cache is flushed objects in use are retained
  * time a cacheline is needed
  */
-static void clearcache(videocacheline **cache, pthread_rwlock_t *cachelock, int f, int id) {
-  videocacheline *tmp, *cl = NULL;
-  HASH_ITER(hh, *cache, cl, tmp) {
-    if (id >= 0 && cl->id != id) {
-      continue;
-    }
-    if (f) {
-      if (cl->flags & (CLF_DECODING|CLF_INUSE)) {
-        dlog(DLOG_WARNING, "CACHE: waiting for cacheline to be unlocked.\n");
+static void clearcache(xjcd *cc, int f, int id) {
+  int i;
+  for (i = 0; i < FC_SHARDS; ++i) {
+    fcshard *sh = &cc->shard[i];
+    videocacheline *tmp, *cl = NULL;
+    int busy, waited = 0;
+    pthread_rwlock_wrlock(&sh->lock);
+    do {
+      busy = 0;
+      HASH_ITER(hh, sh->vcache, cl, tmp) {
+        if (id >= 0 && cl->id != id) {
+          continue;
+        }
+        if ((cl->flags & CLF_DECODING) || refcount(cl) > 0) {
+          busy = 1;
+          continue;
+        }
+        delcl(cc, sh, cl);
+        freecl(cl);
       }
-      while (cl->flags & (CLF_DECODING|CLF_INUSE)) {
-        pthread_rwlock_unlock(cachelock);
-        mymsleep(5);
-        pthread_rwlock_wrlock(cachelock);
+      if (f && busy) {
+        /* cachelines may be evicted, re-used or added while the shard
+         * is unlocked: start over once one was released */
+        unsigned int seq = wait_begin(cc);
+        if (!waited++) {
+          dlog(DLOG_WARNING, "CACHE: waiting for cacheline to be unlocked.\n");
+        }
+        pthread_rwlock_unlock(&sh->lock);
+        wait_release(cc, &seq, NULL);
+        wait_end(cc);
+        pthread_rwlock_wrlock(&sh->lock);
       }
-    }
-    if (cl->flags & (CLF_DECODING|CLF_INUSE)) {
-      continue;
-    }
-    HASH_DEL(*cache, cl);
-    assert(cl->refcnt == 0);
-    free(cl->b);
-    free(cl);
+    } while (f && busy);
+    pthread_rwlock_unlock(&sh->lock);
   }
 }
 
-static void realloccl_buf(videocacheline *cptr, int w, int h, int fmt) {
-  if (cptr->b && cptr->w == w && cptr->h == h && cptr->fmt == fmt)
+/* allocate the buffer, size and geometry are set by newcl() */
+static void realloccl_buf(videocacheline *cptr) {
+  if (cptr->b)
     return; // already allocated
-
-  free(cptr->b);
-  cptr->alloc_size = ff_picture_bytesize(fmt, w, h);
   cptr->b = calloc(cptr->alloc_size, sizeof(uint8_t));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Cache Control
 
-typedef struct {
-  int cfg_cachesize;
-  videocacheline *vcache;
-  pthread_rwlock_t lock;
-  int cache_hits;
-  int cache_miss;
-} xjcd;
-
 static void fc_initialize_cache (xjcd *cc) {
-  assert(!cc->vcache);
-  cc->vcache = NULL;
+  int i;
+  for (i = 0; i < FC_SHARDS; ++i) {
+    cc->shard[i].vcache = NULL;
+    cc->shard[i].lru_head = cc->shard[i].lru_tail = NULL;
+    pthread_rwlock_init(&cc->shard[i].lock, NULL);
+  }
+  cc->cache_bytes = 0;
+  cc->cache_lines = 0;
+  cc->evict_hand = 0;
   cc->cache_hits = 0;
   cc->cache_miss = 0;
-  pthread_rwlock_init(&cc->lock, NULL);
+  cc->cache_prefetch = 0;
+  cc->cache_gop = 0;
+  cc->rel_waiters = 0;
+  cc->rel_seq = 0;
+  pthread_mutex_init(&cc->rel_lock, NULL);
+  pthread_cond_init(&cc->rel_cond, NULL);
+  memset(cc->ra, 0, sizeof(cc->ra));
+  pthread_mutex_init(&cc->ra_lock, NULL);
+  pthread_cond_init(&cc->ra_cond, NULL);
+  cc->ra_run = 0;
+  cc->snaps = NULL;
+  pthread_mutex_init(&cc->snap_lock, NULL);
+  pthread_cond_init(&cc->snap_cond, NULL);
 }
 
 static void fc_flush_cache (xjcd *cc) {
-  pthread_rwlock_wrlock(&cc->lock);
-  clearcache(&cc->vcache, &cc->lock, 1, -1);
-  cc->cache_hits = 0;
-  cc->cache_miss = 0;
-  pthread_rwlock_unlock(&cc->lock);
+  clearcache(cc, 1, -1);
+  __sync_fetch_and_and(&cc->cache_hits, 0);
+  __sync_fetch_and_and(&cc->cache_miss, 0);
+  __sync_fetch_and_and(&cc->cache_prefetch, 0);
+  __sync_fetch_and_and(&cc->cache_gop, 0);
 }
 
-static videocacheline *fc_readcl(xjcd *cc, void *dc, int64_t frame, short w, short h, int fmt, unsigned short vid, int *err) {
-  /* check if the requested frame is cached */
-  videocacheline *rv = testclwh(cc->vcache, &cc->lock, frame, w, h, fmt, vid);
+/* add a cacheline for a frame that is decoded in the background
+ * (read-ahead or side-product of seeking), unless it is cached already.
+ * @param err set to 1 if the frame is cached, 503 if there is no space
+ * @return cacheline with allocated buffer flagged as decoding or NULL
+ */
+static videocacheline *fc_claimcl(xjcd *cc, int64_t frame, short w, short h, int fmt, unsigned short vid, int *err) {
+  fcshard *sh = shard_of(cc, vid, frame);
+  const size_t bytes = ff_picture_bytesize(fmt, w, h);
+  videocacheline *rv, *spare = NULL;
+
+  pthread_rwlock_rdlock(&sh->lock);
+  rv = findcl(sh->vcache, frame, w, h, fmt, vid);
+  pthread_rwlock_unlock(&sh->lock);
+  if (rv) {
+    *err = 1;
+    return NULL;
+  }
+
+  if (reservecl(cc, bytes, &spare)) {
+    if (spare) freecl(spare);
+    *err = 503;
+    return NULL;
+  }
+
+  pthread_rwlock_wrlock(&sh->lock);
+  if (findcl(sh->vcache, frame, w, h, fmt, vid)) {
+    pthread_rwlock_unlock(&sh->lock);
+    unreservecl(cc, bytes, spare);
+    *err = 1;
+    return NULL;
+  }
+  rv = newcl(sh, spare, bytes, vid, w, h, fmt, frame);
+  rv->flags |= CLF_DECODING;
+  rv->pending = 1;
+  pthread_rwlock_unlock(&sh->lock);
+
+  realloccl_buf(rv);
+  *err = 0;
+  return rv;
+}
+
+/* complete a cacheline added by fc_claimcl(), drop it if decoding failed */
+static void fc_commitcl(xjcd *cc, videocacheline *rv, int ok) {
+  fcshard *sh = shard_of(cc, rv->id, rv->frame);
+  pthread_rwlock_wrlock(&sh->lock);
+  if (ok) {
+    rv->decoded = time(NULL);
+    decodedcl(cc, rv, CLF_VALID);
+  } else {
+    decodedcl(cc, rv, 0);
+    if (refcount(rv) == 0) {
+      delcl(cc, sh, rv);
+      freecl(rv);
+    }
+  }
+  pthread_rwlock_unlock(&sh->lock);
+}
+
+/* frames decoded while seeking to the requested frame */
+#define GOP_MAX 64
+
+typedef struct {
+  xjcd *cc;
+  unsigned short id;
+  short w;
+  short h;
+  int fmt;
+  int stored;
+  int n;
+  videocacheline *cl[GOP_MAX];
+} gopsink;
+
+static uint8_t *gop_get(void *arg, int64_t frame) {
+  gopsink *g = (gopsink*) arg;
+  videocacheline *cl;
+  int err;
+  if (g->n >= GOP_MAX) {
+    return NULL;
+  }
+  if (!(cl = fc_claimcl(g->cc, frame, g->w, g->h, g->fmt, g->id, &err))) {
+    return NULL;
+  }
+  g->cl[g->n++] = cl;
+  return cl->b;
+}
+
+static void gop_put(void *arg, int64_t frame, uint8_t *buf, int ok) {
+  gopsink *g = (gopsink*) arg;
+  int i;
+  for (i = 0; i < g->n; ++i) {
+    if (g->cl[i]->b == buf) {
+      fc_commitcl(g->cc, g->cl[i], ok);
+      g->cl[i] = g->cl[--g->n];
+      if (ok) g->stored++;
+      return;
+    }
+  }
+}
+
+/* number of frames that fit into a quarter of the cache */
+static int quarter_cache(xjcd *cc, short w, short h, int fmt) {
+  const size_t bytes = ff_picture_bytesize(fmt, w, h);
+  return cc->cfg_cachemem > 0 ? cc->cfg_cachemem / (bytes ? bytes : 1) / 4 : cc->cfg_cachesize / 4;
+}
+
+/* max. number of intermediate frames to cache per request */
+static int gop_budget(xjcd *cc, short w, short h, int fmt) {
+  int budget = quarter_cache(cc, w, h, fmt);
+  if (budget > cc->cfg_gopcache) budget = cc->cfg_gopcache;
+  if (budget > GOP_MAX) budget = GOP_MAX;
+  return budget;
+}
+
+/* no cacheline is available: the first call registers and returns
+ * to try again, subsequent calls wait for a cacheline to be released.
+ * @return non-zero once FC_WAIT_MS have passed since the first call
+ */
+static int wait_cacheline(xjcd *cc, int *waiting, unsigned int *seq, struct timespec *deadline) {
+  if (!*waiting) {
+    *seq = wait_begin(cc);
+    mydeadline(deadline, FC_WAIT_MS);
+    *waiting = 1;
+    return 0;
+  }
+  return wait_release(cc, seq, deadline);
+}
+
+/* look up a frame, or decode it into a new cacheline.
+ * Bulk requests do not wait for cachelines to be released.
+ */
+static videocacheline *fc_readcl(xjcd *cc, void *dc, int64_t frame, short w, short h, int fmt, unsigned short vid, int snap, int prio, int *err) {
+  fcshard *sh = shard_of(cc, vid, frame);
+  const size_t bytes = ff_picture_bytesize(fmt, w, h);
+  videocacheline *rv = NULL;
   int ds;
+  int waiting = 0;
+  unsigned int seq = 0;
+  struct timespec deadline;
   if (err) *err = 0;
-  if (rv) {
-    pthread_rwlock_wrlock(&cc->lock); // rdlock should suffice here
-    /* check if it has been recently invalidated by another thread */
-    if (rv->flags&CLF_VALID) {
-      rv->refcnt++;
-      rv->flags |= CLF_INUSE;
-      pthread_rwlock_unlock(&cc->lock);
-      rv->lru = time(NULL);
-      cc->cache_hits++;
+
+  while (!rv) {
+    videocacheline *spare = NULL;
+    int reserved = 0;
+    int busy = 0;
+
+    pthread_rwlock_rdlock(&sh->lock);
+    /* check if the requested frame is cached */
+    rv = findcl(sh->vcache, frame, w, h, fmt, vid);
+
+    if (rv && (rv->flags & CLF_VALID)) {
+      retaincl(rv);
+      pthread_rwlock_unlock(&sh->lock);
+      if (waiting) wait_end(cc);
+      __sync_fetch_and_add(&cc->cache_hits, 1);
       return(rv);
     }
-    pthread_rwlock_unlock(&cc->lock);
-    rv = NULL;
-  }
 
-  /* too bad, now we need to allocate a new or free an used
-   * cacheline and then decode the video... */
-  int timeout = 250; /* 1 second to get a buffer */
-  do {
-    pthread_rwlock_wrlock(&cc->lock);
-    rv = getcl(&cc->vcache, cc->cfg_cachesize, vid, w, h, fmt, frame);
+    if (rv && (rv->flags & CLF_DECODING)) {
+      int valid;
+      /* another thread is decoding this frame, wait for it. */
+      retaincl(rv);
+      pthread_mutex_lock(&rv->lock);
+      pthread_rwlock_unlock(&sh->lock);
+      while (rv->pending) {
+        pthread_cond_wait(&rv->ready, &rv->lock);
+      }
+      pthread_mutex_unlock(&rv->lock);
+      pthread_rwlock_rdlock(&sh->lock);
+      valid = rv->flags & CLF_VALID;
+      pthread_rwlock_unlock(&sh->lock);
+      if (valid) {
+        if (waiting) wait_end(cc);
+        __sync_fetch_and_add(&cc->cache_hits, 1);
+        return(rv);
+      }
+      /* decoding failed, try again */
+      releasecl(cc, rv);
+      rv = NULL;
+      continue;
+    }
+    pthread_rwlock_unlock(&sh->lock);
+
+    if (!rv) {
+      /* too bad, now we need to allocate a new or free an used
+       * cacheline and then decode the video... */
+      if (reservecl(cc, bytes, &spare)) {
+        if (spare) freecl(spare);
+        if (prio == DCTL_PRIO_BULK || wait_cacheline(cc, &waiting, &seq, &deadline)) {
+          break;
+        }
+        continue;
+      }
+      reserved = 1;
+    }
+
+    pthread_rwlock_wrlock(&sh->lock);
+    /* re-check, another thread may have added it meanwhile */
+    rv = findcl(sh->vcache, frame, w, h, fmt, vid);
+    if (!rv && reserved) {
+      rv = newcl(sh, spare, bytes, vid, w, h, fmt, frame);
+      reserved = 0;
+      spare = NULL;
+    } else if (rv && (rv->flags & (CLF_VALID|CLF_DECODING))) {
+      rv = NULL;
+    } else if (rv && refcount(rv) > 0) {
+      /* invalid (decode failed) but still in use */
+      rv = NULL;
+      busy = 1;
+    }
+    /* else: re-use invalid cacheline */
     if (rv) {
       rv->flags |= CLF_DECODING;
+      rv->pending = 1;
     }
-    pthread_rwlock_unlock(&cc->lock);
-    if (!rv) {
-      mymsleep(5);
+    pthread_rwlock_unlock(&sh->lock);
+
+    if (reserved) {
+      unreservecl(cc, bytes, spare);
+    }
+    if (busy && (prio == DCTL_PRIO_BULK || wait_cacheline(cc, &waiting, &seq, &deadline))) {
+      break;
     }
-  } while(--timeout > 0 && !rv);
+  }
+
+  if (waiting) {
+    wait_end(cc);
+  }
 
   if (!rv) {
     dlog(DLOG_WARNING, "CACHE: no buffer available.\n");
@@ -230,11 +736,26 @@ static videocacheline *fc_readcl(xjcd *cc, void *dc, int64_t frame, short w, sho
     return NULL;
   }
 
-  /* set w,h,fmt and re-alloc buffer if neccesary */
-  realloccl_buf(rv, w, h, fmt);
+  /* re-alloc buffer if neccesary */
+  realloccl_buf(rv);
 
   /* fill cacheline with data - decode video */
-  if ((ds=dctrl_decode(dc, vid, frame, rv->b, w, h, fmt))) {
+  if (snap) {
+    /* frame is a keyframe, don't bother with inter-frames */
+    int64_t actual;
+    ds = dctrl_decode_key(dc, vid, frame, rv->b, w, h, fmt, prio, &actual);
+  } else if (cc->cfg_gopcache > 0) {
+    gopsink g = {cc, vid, w, h, fmt, 0, 0};
+    FrameSink sink = {gop_get, gop_put, &g, gop_budget(cc, w, h, fmt)};
+    ds = dctrl_decode(dc, vid, frame, rv->b, w, h, fmt, prio, &sink);
+    while (g.n > 0) {
+      gop_put(&g, -1, g.cl[0]->b, 0);
+    }
+    __sync_fetch_and_add(&cc->cache_gop, g.stored);
+  } else {
+    ds = dctrl_decode(dc, vid, frame, rv->b, w, h, fmt, prio, NULL);
+  }
+  if (ds) {
     dlog(DLOG_WARNING, "CACHE: decode failed (%d).\n",ds);
     /* ds == -1 -> decode error; black frame will be rendered
      * ds == 503 -> no decoder avail.
@@ -242,42 +763,200 @@ static videocacheline *fc_readcl(xjcd *cc, void *dc, int64_t frame, short w, sho
      * (should not happen here - dctrl_get_info sorts that out)
      */
     if(err) *err = ds;
-    pthread_rwlock_wrlock(&cc->lock); // rdlock should suffice here
+    pthread_rwlock_wrlock(&sh->lock);
     /* we don't cache decode-errors */
     rv->flags &= ~CLF_VALID;
-    rv->flags &= ~CLF_DECODING;
+    decodedcl(cc, rv, 0);
     if (ds > 0) {
       /* no decoder available */
       rv = NULL;
     } else {
       /* decoder available but decoding failed (EOF, invalid geometry...)*/
-      rv->flags |= CLF_INUSE;
-      rv->refcnt++;
+      retaincl(rv);
     }
-    pthread_rwlock_unlock(&cc->lock);
+    pthread_rwlock_unlock(&sh->lock);
     return (rv);
   }
 
-  rv->lru = time(NULL);
-  pthread_rwlock_wrlock(&cc->lock); // rdlock should suffice here
-  rv->flags |= CLF_VALID|CLF_INUSE;
-  rv->flags &= ~CLF_DECODING;
-  rv->refcnt++;
-  pthread_rwlock_unlock(&cc->lock);
-  cc->cache_miss++;
+  pthread_rwlock_wrlock(&sh->lock);
+  rv->decoded = time(NULL);
+  decodedcl(cc, rv, CLF_VALID);
+  retaincl(rv);
+  pthread_rwlock_unlock(&sh->lock);
+  __sync_fetch_and_add(&cc->cache_miss, 1);
   return(rv);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Read-ahead
+
+static double ra_now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* decode a frame into the cache unless it is cached already
+ * @return 0 on success, 1 if the frame is cached, 503 if no space or idle
+ * decoder is available, otherwise the error of the decoder.
+ */
+static int fc_prefetchcl(xjcd *cc, void *dc, int64_t frame, short w, short h, int fmt, unsigned short vid) {
+  videocacheline *rv;
+  int ds;
+
+  if (!(rv = fc_claimcl(cc, frame, w, h, fmt, vid, &ds))) {
+    return ds;
+  }
+  ds = dctrl_decode_idle(dc, vid, frame, rv->b, w, h, fmt);
+  fc_commitcl(cc, rv, ds == 0);
+  if (ds == 0) {
+    __sync_fetch_and_add(&cc->cache_prefetch, 1);
+  }
+  return ds;
+}
+
+/* pick the next frame to read ahead
+ * NB. ra_lock needs to be held when calling this
+ */
+static rastream *ra_pending(xjcd *cc) {
+  int i;
+  for (i = 0; i < RA_STREAMS; ++i) {
+    if (cc->ra[i].next < cc->ra[i].end) {
+      return &cc->ra[i];
+    }
+  }
+  return NULL;
+}
+
+static void *ra_worker(void *arg) {
+  xjcd *cc = (xjcd*) arg;
+  pthread_mutex_lock(&cc->ra_lock);
+  while (cc->ra_run > 0) {
+    rastream *s = ra_pending(cc);
+    rastream job;
+    double t0;
+    int rv;
+
+    if (!s) {
+      pthread_cond_wait(&cc->ra_cond, &cc->ra_lock);
+      continue;
+    }
+    memcpy(&job, s, sizeof(rastream));
+    s->next++;
+    pthread_mutex_unlock(&cc->ra_lock);
+
+    t0 = ra_now();
+    rv = fc_prefetchcl(cc, job.dc, job.next, job.w, job.h, job.fmt, job.id);
+
+    pthread_mutex_lock(&cc->ra_lock);
+    if (s->id != job.id || s->w != job.w || s->h != job.h || s->fmt != job.fmt) {
+      continue; // stream was replaced meanwhile
+    }
+    if (rv == 0) {
+      const double dt = ra_now() - t0;
+      s->decode = s->decode > 0 ? .8 * s->decode + .2 * dt : dt;
+    } else if (rv == 503) {
+      /* all decoders are busy, or the cache is full.
+       * continue with the next request */
+      s->next = s->end = job.next;
+    } else if (rv != 1) {
+      /* decode failed, most likely EOF */
+      s->end = s->next;
+    }
+  }
+  pthread_mutex_unlock(&cc->ra_lock);
+  return NULL;
+}
+
+/* track sequential access and schedule read-ahead
+ * The number of frames to read ahead is chosen so that decoding
+ * keeps up with the request rate, and limited to a quarter of the cache.
+ */
+static void ra_notify(xjcd *cc, void *dc, unsigned short id, int64_t frame, short w, short h, int fmt) {
+  const double now = ra_now();
+  rastream *s = NULL;
+  int i;
+
+  pthread_mutex_lock(&cc->ra_lock);
+  for (i = 0; i < RA_STREAMS; ++i) {
+    rastream *c = &cc->ra[i];
+    if (c->id == id && c->w == w && c->h == h && c->fmt == fmt && c->dc == dc) {
+      s = c;
+      break;
+    }
+    if (!s || c->t_last < s->t_last) {
+      s = c; // least recently used slot
+    }
+  }
+
+  if (i == RA_STREAMS) {
+    memset(s, 0, sizeof(rastream));
+    s->id = id; s->w = w; s->h = h; s->fmt = fmt; s->dc = dc;
+    s->last = frame;
+    s->t_last = now;
+    pthread_mutex_unlock(&cc->ra_lock);
+    return;
+  }
+
+  if (frame == s->last + 1) {
+    const double dt = now - s->t_last;
+    s->interval = s->run > 0 ? .8 * s->interval + .2 * dt : dt;
+    s->run++;
+  } else if (frame != s->last) {
+    s->run = 0;
+    s->next = s->end = 0;
+  }
+  s->last = frame;
+  s->t_last = now;
+
+  if (s->run >= 2) {
+    int kmax = quarter_cache(cc, w, h, fmt);
+    int k = 2;
+    if (kmax > cc->cfg_readahead) kmax = cc->cfg_readahead;
+    if (s->interval > 0 && s->decode > 0) {
+      k = 2 + (int)(s->decode / s->interval);
+    }
+    if (k > kmax) k = kmax;
+    if (s->next <= frame) s->next = frame + 1;
+    s->end = frame + 1 + k;
+
+    if (k > 0 && cc->ra_run == 0) {
+      if (pthread_create(&cc->ra_thread, NULL, ra_worker, cc) == 0) {
+        cc->ra_run = 1;
+      } else {
+        dlog(DLOG_ERR, "CACHE: can not start read-ahead thread.\n");
+        cc->ra_run = -1;
+      }
+    }
+    pthread_cond_signal(&cc->ra_cond);
+  }
+  pthread_mutex_unlock(&cc->ra_lock);
+}
+
+static void ra_shutdown(xjcd *cc) {
+  int running;
+  pthread_mutex_lock(&cc->ra_lock);
+  running = cc->ra_run > 0;
+  cc->ra_run = -1;
+  pthread_cond_signal(&cc->ra_cond);
+  pthread_mutex_unlock(&cc->ra_lock);
+  if (running) {
+    pthread_join(cc->ra_thread, NULL);
+  }
+  pthread_mutex_destroy(&cc->ra_lock);
+  pthread_cond_destroy(&cc->ra_cond);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // public API
 
 void vcache_clear (void *p, int id) {
   xjcd *cc = (xjcd*) p;
-  pthread_rwlock_wrlock(&cc->lock);
-  clearcache(&cc->vcache, &cc->lock, 0, id);
-  cc->cache_hits = 0;
-  cc->cache_miss = 0;
-  pthread_rwlock_unlock(&cc->lock);
+  clearcache(cc, 0, id);
+  __sync_fetch_and_and(&cc->cache_hits, 0);
+  __sync_fetch_and_and(&cc->cache_miss, 0);
+  __sync_fetch_and_and(&cc->cache_prefetch, 0);
+  __sync_fetch_and_and(&cc->cache_gop, 0);
 }
 
 void vcache_create(void **p) {
@@ -293,17 +972,42 @@ void vcache_resize(void **p, int size) {
     (*((xjcd**)p))->cfg_cachesize = size;
 }
 
+void vcache_resize_mem(void **p, size_t bytes) {
+  if (bytes > 0 && (*((xjcd**)p))->cache_bytes > bytes)
+    fc_flush_cache((*((xjcd**)p)));
+  (*((xjcd**)p))->cfg_cachemem = bytes;
+}
+
+void vcache_readahead(void *p, int frames) {
+  ((xjcd*)p)->cfg_readahead = frames > 0 ? frames : 0;
+}
+
+void vcache_gopcache(void *p, int frames) {
+  ((xjcd*)p)->cfg_gopcache = frames > 0 ? frames : 0;
+}
+
 void vcache_destroy(void **p) {
   xjcd *cc = *(xjcd**) p;
+  int i;
+  ra_shutdown(cc);
   fc_flush_cache(cc);
-  pthread_rwlock_destroy(&cc->lock);
-  free(cc->vcache);
+  for (i = 0; i < FC_SHARDS; ++i) {
+    pthread_rwlock_destroy(&cc->shard[i].lock);
+  }
+  pthread_mutex_destroy(&cc->rel_lock);
+  pthread_cond_destroy(&cc->rel_cond);
+  pthread_mutex_destroy(&cc->snap_lock);
+  pthread_cond_destroy(&cc->snap_cond);
   free(cc);
   *p = NULL;
 }
 
-uint8_t *vcache_get_buffer(void *p, void *dc, unsigned short id, int64_t frame, short w, short h, int fmt, void **cptr, int *err) {
-  videocacheline *cl = fc_readcl((xjcd*)p, dc, frame, w, h, fmt, id, err);
+uint8_t *vcache_get_buffer(void *p, void *dc, unsigned short id, int64_t frame, short w, short h, int fmt, int prio, void **cptr, int *err) {
+  videocacheline *cl = fc_readcl((xjcd*)p, dc, frame, w, h, fmt, id, 0, prio, err);
+  /* read-ahead follows interactive playback, not bulk requests */
+  if (((xjcd*)p)->cfg_readahead > 0 && prio != DCTL_PRIO_BULK) {
+    ra_notify((xjcd*)p, dc, id, frame, w, h, fmt);
+  }
   if (!cl) {
     if (cptr) *cptr = NULL;
     return NULL;
@@ -312,38 +1016,168 @@ uint8_t *vcache_get_buffer(void *p, void *dc, unsigned short id, int64_t frame,
   return cl->b;
 }
 
+/* decode a keyframe without knowing its frame-number in advance
+ * directly into a new cacheline, and add it to the cache under the
+ * frame-number that it represents.
+ * If there is no room in the cache, or the keyframe was added by another
+ * thread meanwhile, the cacheline is handed out without being cached:
+ * it is freed when released.
+ */
+static videocacheline *fc_snapdecode(xjcd *cc, void *dc, int64_t frame, short w, short h, int fmt, unsigned short vid, int prio, int64_t *key, int *err) {
+  const size_t bytes = ff_picture_bytesize(fmt, w, h);
+  videocacheline *cl = NULL;
+  const int reserved = reservecl(cc, bytes, &cl) == 0;
+  int ds;
+
+  cl = initcl(cl, bytes, vid, w, h, fmt, -1);
+  realloccl_buf(cl);
+  if (!cl->b) {
+    ds = 503;
+  } else {
+    ds = dctrl_decode_key(dc, vid, frame, cl->b, w, h, fmt, prio, key);
+  }
+  if (ds) {
+    dlog(DLOG_WARNING, "CACHE: decode failed (%d).\n",ds);
+    if (reserved) {
+      unreservecl(cc, bytes, cl);
+    } else {
+      freecl(cl);
+    }
+    if (err) *err = ds > 0 ? ds : 500;
+    return NULL;
+  }
+
+  cl->frame = *key;
+  cl->decoded = time(NULL);
+  cl->flags = CLF_VALID;
+  retaincl(cl);
+  __sync_fetch_and_add(&cc->cache_miss, 1);
+
+  if (reserved) {
+    fcshard *sh = shard_of(cc, vid, *key);
+    pthread_rwlock_wrlock(&sh->lock);
+    if (!findcl(sh->vcache, *key, w, h, fmt, vid)) {
+      HASH_ADD(hh, sh->vcache, id, CLKEYLEN, cl);
+      lru_push(sh, cl);
+      pthread_rwlock_unlock(&sh->lock);
+      return cl;
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    unreservecl(cc, bytes, NULL);
+  }
+  cl->flags |= CLF_RELEASE;
+  return cl;
+}
+
+/* all frames from a keyframe up to the frame that was requested share
+ * that keyframe. A request for an earlier frame of the same file and
+ * geometry waits for a keyframe decode in progress, and is served from
+ * the cache if it turns out to be in that range.
+ */
+static videocacheline *fc_snapcl(xjcd *cc, void *dc, int64_t frame, short w, short h, int fmt, unsigned short vid, int prio, int64_t *key, int *err) {
+  snapflight self = {vid, w, h, fmt, frame, -1, 0, 0, NULL};
+  snapflight *s, **pp;
+  videocacheline *cl;
+
+  pthread_mutex_lock(&cc->snap_lock);
+  for (;;) {
+    for (s = cc->snaps; s; s = s->next) {
+      if (!s->done && s->id == vid && s->w == w && s->h == h && s->fmt == fmt
+          && frame <= s->frame && frame > s->frame - SNAP_GOP) break;
+    }
+    if (!s) break;
+    s->waiters++;
+    while (!s->done) {
+      pthread_cond_wait(&cc->snap_cond, &cc->snap_lock);
+    }
+    *key = s->key;
+    if (--s->waiters == 0) {
+      pthread_cond_broadcast(&cc->snap_cond);
+    }
+    if (*key >= 0 && *key <= frame && frame <= s->frame) {
+      pthread_mutex_unlock(&cc->snap_lock);
+      return fc_readcl(cc, dc, *key, w, h, fmt, vid, 1, prio, err);
+    }
+  }
+  self.next = cc->snaps;
+  cc->snaps = &self;
+  pthread_mutex_unlock(&cc->snap_lock);
+
+  cl = fc_snapdecode(cc, dc, frame, w, h, fmt, vid, prio, key, err);
+
+  pthread_mutex_lock(&cc->snap_lock);
+  self.key = cl ? *key : -1;
+  self.done = 1;
+  pthread_cond_broadcast(&cc->snap_cond);
+  while (self.waiters > 0) {
+    pthread_cond_wait(&cc->snap_cond, &cc->snap_lock);
+  }
+  for (pp = &cc->snaps; *pp != &self; pp = &(*pp)->next) ;
+  *pp = self.next;
+  pthread_mutex_unlock(&cc->snap_lock);
+  return cl;
+}
+
+/* get the keyframe at or before *frame, *frame is set to its frame-number.
+ * \a key is the keyframe if the caller knows it (see dctrl_keyframe), or -1.
+ */
+uint8_t *vcache_get_keyframe(void *p, void *dc, unsigned short id, int64_t *frame, int64_t key, short w, short h, int fmt, int prio, void **cptr, int *err) {
+  xjcd *cc = (xjcd*)p;
+  videocacheline *cl;
+  if (key >= 0) {
+    cl = fc_readcl(cc, dc, key, w, h, fmt, id, 1, prio, err);
+  } else {
+    cl = fc_snapcl(cc, dc, *frame, w, h, fmt, id, prio, &key, err);
+  }
+  if (!cl) {
+    if (cptr) *cptr = NULL;
+    return NULL;
+  }
+  *frame = key;
+  if (cptr) *cptr = cl;
+  return cl->b;
+}
+
 void vcache_release_buffer(void *p, void *cptr) {
-  xjcd *cc = (xjcd*) p;
   videocacheline *cl = (videocacheline *)cptr;
   if (!cptr) return;
-  pthread_rwlock_wrlock(&cc->lock);
-  if (--cl->refcnt < 1) {
-    assert(cl->refcnt >= 0);
-    cl->flags &= ~CLF_INUSE;
-
-    if (cl->flags & CLF_RELEASE) {
-      HASH_DEL(cc->vcache, cl);
-      assert(cl->refcnt == 0);
-      free(cl->b);
-      free(cl);
-    }
-  }
+  releasecl((xjcd*)p, cl);
   // TODO delete cacheline IFF !CLF_VALID (decode failed) ?!
-  pthread_rwlock_unlock(&cc->lock);
 }
 
 void vcache_invalidate_buffer(void *p, void *cptr) {
   xjcd *cc = (xjcd*) p;
   videocacheline *cl = (videocacheline *)cptr;
+  fcshard *sh;
   if (!cptr) return;
-  pthread_rwlock_wrlock(&cc->lock);
-  cl->flags |= CLF_RELEASE;
-  pthread_rwlock_unlock(&cc->lock);
+  sh = shard_of(cc, cl->id, cl->frame);
+  pthread_rwlock_wrlock(&sh->lock);
+  if (!(cl->flags & CLF_RELEASE)) {
+    /* remove it from the cache now,
+     * the last reference frees it */
+    cl->flags |= CLF_RELEASE;
+    delcl(cc, sh, cl);
+  }
+  pthread_rwlock_unlock(&sh->lock);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // statistics
 
+static void bytes2txt(char *bsize, uint64_t total_bytes) {
+  if (total_bytes < 1024) {
+    sprintf(bsize, "%.0f %s", total_bytes / 1.0, "");
+  } else if (total_bytes < 1024000 ) {
+    sprintf(bsize, "%.1f %s", total_bytes / 1024.0, "Ki");
+  } else if (total_bytes < 10485760) {
+    sprintf(bsize, "%.1f %s", total_bytes / 1048576.0, "Mi");
+  } else if (total_bytes < 1048576000) {
+    sprintf(bsize, "%.2f %s", total_bytes / 1048576.0, "Mi");
+  } else {
+    sprintf(bsize, "%.2f %s", total_bytes / 1073741824.0, "Gi");
+  }
+}
+
 static char *flags2txt(int f) {
   char *rv = NULL;
   size_t off = 0;
@@ -374,53 +1208,63 @@ static char *flags2txt(int f) {
 
 void vcache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl) {
   int i = 1;
+  int n;
   videocacheline *cptr, *tmp;
   uint64_t total_bytes = 0;
   char bsize[32];
+  char blimit[32];
+
+  if (((xjcd*)p)->cfg_cachemem > 0) {
+    bytes2txt(blimit, ((xjcd*)p)->cfg_cachemem);
+  }
 
   if (tbl&1) {
     rprintf("<h3>Raw Video Frame Cache:</h3>\n");
-    rprintf("<p>max available: %i\n", ((xjcd*)p)->cfg_cachesize);
-    rprintf("cache-hits: %d, cache-misses: %d</p>\n", ((xjcd*)p)->cache_hits, ((xjcd*)p)->cache_miss);
+    if (((xjcd*)p)->cfg_cachemem > 0) {
+      rprintf("<p>max available: %sB\n", blimit);
+    } else {
+      rprintf("<p>max available: %i\n", ((xjcd*)p)->cfg_cachesize);
+    }
+    rprintf("cache-hits: %d, cache-misses: %d, read-ahead: %d, seek-decoded: %d</p>\n", ((xjcd*)p)->cache_hits, ((xjcd*)p)->cache_miss, ((xjcd*)p)->cache_prefetch, ((xjcd*)p)->cache_gop);
     rprintf("<table style=\"text-align:center;width:100%%\">\n");
   } else {
     rprintf("<tr><td colspan=\"8\" class=\"left\"><h3>Raw Video Frame Cache:</h3></td></tr>\n");
-    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d\n", ((xjcd*)p)->cfg_cachesize);
-    rprintf(", cache-hits: %d, cache-misses: %d</td></tr>\n", ((xjcd*)p)->cache_hits, ((xjcd*)p)->cache_miss);
+    if (((xjcd*)p)->cfg_cachemem > 0) {
+      rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %sB\n", blimit);
+    } else {
+      rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d\n", ((xjcd*)p)->cfg_cachesize);
+    }
+    rprintf(", cache-hits: %d, cache-misses: %d, read-ahead: %d, seek-decoded: %d</td></tr>\n", ((xjcd*)p)->cache_hits, ((xjcd*)p)->cache_miss, ((xjcd*)p)->cache_prefetch, ((xjcd*)p)->cache_gop);
   }
-  rprintf("<tr><th>#</th><th>file-id</th><th>Flags</th><th>Allocated Bytes</th><th>Geometry</th><th>Buffer</th><th>Frame#</th><th>LRU</th></tr>\n");
+  rprintf("<tr><th>#</th><th>file-id</th><th>Flags</th><th>Allocated Bytes</th><th>Geometry</th><th>Buffer</th><th>Frame#</th><th>Decoded</th></tr>\n");
   /* walk comlete tree */
-  pthread_rwlock_rdlock(&((xjcd*)p)->lock);
-  HASH_ITER(hh, ((xjcd*)p)->vcache, cptr, tmp) {
-    char *tmp = flags2txt(cptr->flags);
-    rprintf(
-        "<tr><td>%d.</td><td>%d</td><td>%s</td><td>%d bytes</td><td>%dx%d</td><td>%s</td><td>%"PRIlld"</td><td>%"PRIlld"</td></tr>\n",
-        i, cptr->id, tmp, cptr->alloc_size, cptr->w, cptr->h,
-        (cptr->b ? ff_fmt_to_text(cptr->fmt) : "null"),
-        (long long) cptr->frame, (long long) cptr->lru);
-    free(tmp);
-    total_bytes += cptr->alloc_size;
-    i++;
+  for (n = 0; n < FC_SHARDS; ++n) {
+    fcshard *sh = &((xjcd*)p)->shard[n];
+    pthread_rwlock_rdlock(&sh->lock);
+    HASH_ITER(hh, sh->vcache, cptr, tmp) {
+      char *tmp = flags2txt(cptr->flags | (refcount(cptr) > 0 ? CLF_INUSE : 0));
+      rprintf(
+          "<tr><td>%d.</td><td>%d</td><td>%s</td><td>%d bytes</td><td>%dx%d</td><td>%s</td><td>%"PRIlld"</td><td>%"PRIlld"</td></tr>\n",
+          i, cptr->id, tmp, cptr->alloc_size, cptr->w, cptr->h,
+          (cptr->b ? ff_fmt_to_text(cptr->fmt) : "null"),
+          (long long) cptr->frame, (long long) cptr->decoded);
+      free(tmp);
+      total_bytes += cptr->alloc_size;
+      i++;
+    }
+    pthread_rwlock_unlock(&sh->lock);
   }
 
   if ((tbl&1) == 0) {
     rprintf("<tr><td colspan=\"8\" class=\"dline\"></td></tr>\n");
   }
 
-  if (total_bytes < 1024) {
-    sprintf(bsize, "%.0f %s", total_bytes / 1.0, "");
-  } else if (total_bytes < 1024000 ) {
-    sprintf(bsize, "%.1f %s", total_bytes / 1024.0, "Ki");
-  } else if (total_bytes < 10485760) {
-    sprintf(bsize, "%.1f %s", total_bytes / 1048576.0, "Mi");
-  } else if (total_bytes < 1048576000) {
-    sprintf(bsize, "%.2f %s", total_bytes / 1048576.0, "Mi");
+  bytes2txt(bsize, total_bytes);
+  if (((xjcd*)p)->cfg_cachemem > 0) {
+    rprintf("<tr><td colspan=\"8\" class=\"left\">cache size: %sB of %sB in memory</td></tr>\n", bsize, blimit);
   } else {
-    sprintf(bsize, "%.2f %s", total_bytes / 1073741824.0, "Gi");
+    rprintf("<tr><td colspan=\"8\" class=\"left\">cache size: %sB in memory</td></tr>\n", bsize);
   }
-
-  rprintf("<tr><td colspan=\"8\" class=\"left\">cache size: %sB in memory</td></tr>\n", bsize);
-  pthread_rwlock_unlock(&((xjcd*)p)->lock);
   if (tbl&2) {
     rprintf("</table>\n");
   }
@@ -25,9 +25,13 @@
 void vcache_create(void **p);
 void vcache_destroy(void **p);
 void vcache_resize(void **p, int size);
+void vcache_resize_mem(void **p, size_t bytes);
+void vcache_readahead(void *p, int frames);
+void vcache_gopcache(void *p, int frames);
 void vcache_clear (void *p, int id);
 
-uint8_t *vcache_get_buffer(void *p, void *dc, unsigned short id, int64_t frame, short w, short h, int fmt, void **cptr, int *err);
+uint8_t *vcache_get_buffer(void *p, void *dc, unsigned short id, int64_t frame, short w, short h, int fmt, int prio, void **cptr, int *err);
+uint8_t *vcache_get_keyframe(void *p, void *dc, unsigned short id, int64_t *frame, int64_t key, short w, short h, int fmt, int prio, void **cptr, int *err);
 void vcache_release_buffer(void *p, void *cptr);
 void vcache_invalidate_buffer(void *p, void *cptr);
 
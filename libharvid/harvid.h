@@ -40,6 +40,8 @@ extern "C" {
 /* public ffdecoder.h API */
 void ff_initialize (void);
 void ff_cleanup (void);
+void ff_index_configure (int enable, const char *cachedir);
+void ff_threads_configure (int budget, int frame);
 int  picture_bytesize(int render_fmt, int w, int h);
 
 #ifdef __cplusplus
@@ -38,7 +38,7 @@
 #define CLF_VALID 1    //< cacheline is valid (has decoded frame) -- not needed, is it?!
 #define CLF_INUSE 2    //< currently being served
 
-typedef struct {
+typedef struct ImageCacheLine {
   int id;         // file ID from VidMap
   short w;
   short h;
@@ -51,6 +51,9 @@ typedef struct {
   //int hitcount  //  -- unused; least-frequently used idea
   uint8_t *b;     //< data buffer pointer
   size_t   s;     //< data buffer size
+  size_t   a;     //< allocated size of the data buffer
+  struct ImageCacheLine *lru_prev; //< more recently used image
+  struct ImageCacheLine *lru_next; //< less recently used image
   UT_hash_handle hh;
 } ImageCacheLine;
 
@@ -59,12 +62,47 @@ typedef struct {
 /* image cache control */
 typedef struct {
   ImageCacheLine *icache;
-  int cfg_cachesize;
+  ImageCacheLine *lru_head; //< most recently used image
+  ImageCacheLine *lru_tail; //< next candidate for eviction
+  int cfg_cachesize;   //< max number of images (if cfg_cachemem is zero)
+  size_t cfg_cachemem; //< memory limit in bytes, 0: use cfg_cachesize
+  size_t cache_bytes;  //< sum of all image allocations
   pthread_rwlock_t lock;
   int cache_hits;
   int cache_miss;
 } ICC;
 
+/* LRU list
+ * images are moved to the head when they are added or served,
+ * eviction starts at the tail.
+ * NB. the cache needs to be write-locked when calling these
+ */
+static void lru_unlink(ICC *icc, ImageCacheLine *cl) {
+  if (cl->lru_prev) cl->lru_prev->lru_next = cl->lru_next;
+  else icc->lru_head = cl->lru_next;
+  if (cl->lru_next) cl->lru_next->lru_prev = cl->lru_prev;
+  else icc->lru_tail = cl->lru_prev;
+  cl->lru_prev = cl->lru_next = NULL;
+}
+
+static void lru_push(ICC *icc, ImageCacheLine *cl) {
+  cl->lru_prev = NULL;
+  cl->lru_next = icc->lru_head;
+  if (icc->lru_head) icc->lru_head->lru_prev = cl;
+  else icc->lru_tail = cl;
+  icc->lru_head = cl;
+}
+
+static ImageCacheLine *lru_victim(ICC *icc) {
+  ImageCacheLine *cl;
+  for (cl = icc->lru_tail; cl; cl = cl->lru_prev) {
+    if (!(cl->flags & CLF_INUSE)) {
+      return cl;
+    }
+  }
+  return NULL;
+}
+
 
 static void ic_flush_cache (ICC *icc) {
   ImageCacheLine *cl, *tmp;
@@ -76,6 +114,8 @@ static void ic_flush_cache (ICC *icc) {
     free(cl);
   }
 
+  icc->lru_head = icc->lru_tail = NULL;
+  icc->cache_bytes = 0;
   icc->cache_hits = 0;
   icc->cache_miss = 0;
   pthread_rwlock_unlock(&icc->lock);
@@ -89,6 +129,7 @@ void icache_create(void **p) {
   icc = (*((ICC**)p));
   icc->cfg_cachesize = 32;
   icc->icache = NULL;
+  icc->lru_head = icc->lru_tail = NULL;
   icc->cache_hits = icc->cache_miss = 0;
   pthread_rwlock_init(&icc->lock, NULL);
 }
@@ -108,6 +149,12 @@ void icache_resize(void *p, int size) {
     ((ICC*)p)->cfg_cachesize = size;
 }
 
+void icache_resize_mem(void *p, size_t bytes) {
+  if (bytes > 0 && ((ICC*)p)->cache_bytes > bytes)
+    ic_flush_cache((ICC*) p);
+  ((ICC*)p)->cfg_cachemem = bytes;
+}
+
 void icache_clear (void *p) {
   ic_flush_cache((ICC*) p);
 }
@@ -116,26 +163,26 @@ void icache_clear (void *p) {
 uint8_t *icache_get_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, size_t *size, void **cptr) {
   ICC *icc = (ICC*) p;
   ImageCacheLine *cl = NULL;
-  const ImageCacheLine cmp = {id, w, h, fmt, fmt_opt, frame, 0, 0, 0, NULL, 0};
+  const ImageCacheLine cmp = {id, w, h, fmt, fmt_opt, frame, 0, 0, 0, NULL, 0, 0, NULL, NULL};
 
-  pthread_rwlock_rdlock(&icc->lock);
+  /* the line may be evicted and freed as soon as the lock is dropped,
+   * so take the reference in the same critical section as the lookup */
+  pthread_rwlock_wrlock(&icc->lock);
   HASH_FIND(hh, icc->icache, &cmp, CLKEYLEN, cl);
-  pthread_rwlock_unlock(&icc->lock);
-
-  if (cl) {
-    pthread_rwlock_wrlock(&icc->lock);
-    if (cl->flags&CLF_VALID) {
-      cl->refcnt++;
-      cl->flags |= CLF_INUSE;
-      pthread_rwlock_unlock(&icc->lock);
-      if (size) *size = cl->s;
-      if (cptr) *cptr = cl;
-      cl->lru = time(NULL);
-      icc->cache_hits++;
-      return cl->b;
-    }
+  if (cl && (cl->flags&CLF_VALID)) {
+    uint8_t *b = cl->b;
+    cl->refcnt++;
+    cl->flags |= CLF_INUSE;
+    cl->lru = time(NULL);
+    lru_unlink(icc, cl);
+    lru_push(icc, cl);
+    if (size) *size = cl->s;
+    if (cptr) *cptr = cl;
+    icc->cache_hits++;
     pthread_rwlock_unlock(&icc->lock);
+    return b;
   }
+  pthread_rwlock_unlock(&icc->lock);
 
   /* not found in cache */
   icc->cache_miss++;
@@ -144,34 +191,26 @@ uint8_t *icache_get_buffer(void *p, unsigned short id, int64_t frame, int fmt, i
   return NULL;
 }
 
-int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, uint8_t *buf, size_t size) {
+/* check if adding an image of the given size exceeds the limits
+ * NB. the cache needs to be locked when calling this
+ */
+static int cache_full(ICC *icc, size_t size) {
+  if (icc->cfg_cachemem > 0) {
+    return icc->cache_bytes + size > icc->cfg_cachemem;
+  }
+  return HASH_COUNT(icc->icache) >= icc->cfg_cachesize;
+}
+
+int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, uint8_t *buf, size_t size, size_t alloc) {
   ICC *icc = (ICC*) p;
-  ImageCacheLine *cl = NULL, *tmp;
-
-  pthread_rwlock_rdlock(&icc->lock); // wrlock ?!
-  if (HASH_COUNT(icc->icache) >= icc->cfg_cachesize) {
-    ImageCacheLine *tmp, *ilru = NULL;
-    time_t lru = time(NULL) + 1;
-
-    HASH_ITER(hh, icc->icache, cl, tmp) {
-      if (cl->lru < lru && !(cl->flags & CLF_INUSE)) {
-        lru = cl->lru;
-        ilru = cl;
-      }
-    }
+  ImageCacheLine *cl, *tmp;
 
-    if (ilru) {
-      HASH_DEL(icc->icache, ilru);
-      free(ilru->b);
-      cl = ilru;
-      memset(cl, 0, sizeof(ImageCacheLine));
-    }
+  if (alloc < size) alloc = size;
+  if (icc->cfg_cachemem > 0 && alloc > icc->cfg_cachemem) {
+    return -1; // image does not fit, buffer is freed by parent
   }
-  pthread_rwlock_unlock(&icc->lock);
-
-  if (!cl)
-    cl = calloc(1, sizeof(ImageCacheLine));
 
+  cl = calloc(1, sizeof(ImageCacheLine));
   cl->id = id;
   cl->w = w;
   cl->h = h;
@@ -181,6 +220,7 @@ int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fm
   cl->lru = 0;
   cl->b = buf;
   cl->s = size;
+  cl->a = alloc;
   cl->flags = CLF_VALID;
 
   pthread_rwlock_wrlock(&icc->lock);
@@ -192,7 +232,25 @@ int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fm
     free(cl);
     return -1; // buffer is freed by parent
   }
+
+  /* evict least recently used images until the new one fits */
+  while (cache_full(icc, alloc)) {
+    ImageCacheLine *ilru = lru_victim(icc);
+    if (!ilru) {
+      pthread_rwlock_unlock(&icc->lock);
+      free(cl);
+      return -1; // all images are in use, buffer is freed by parent
+    }
+    lru_unlink(icc, ilru);
+    HASH_DEL(icc->icache, ilru);
+    icc->cache_bytes -= ilru->a;
+    free(ilru->b);
+    free(ilru);
+  }
+
   HASH_ADD(hh, icc->icache, id, CLKEYLEN, cl);
+  lru_push(icc, cl);
+  icc->cache_bytes += alloc;
   pthread_rwlock_unlock(&icc->lock);
   return 0;
 }
@@ -229,6 +287,20 @@ static char *flags2txt(int f) {
   return rv;
 }
 
+static void bytes2txt(char *bsize, uint64_t total_bytes) {
+  if (total_bytes < 1024) {
+    sprintf(bsize, "%.0f %s", total_bytes / 1.0, "");
+  } else if (total_bytes < 1024000 ) {
+    sprintf(bsize, "%.1f %s", total_bytes / 1024.0, "Ki");
+  } else if (total_bytes < 10485760) {
+    sprintf(bsize, "%.1f %s", total_bytes / 1048576.0, "Mi");
+  } else if (total_bytes < 1048576000) {
+    sprintf(bsize, "%.2f %s", total_bytes / 1048576.0, "Mi");
+  } else {
+    sprintf(bsize, "%.2f %s", total_bytes / 1073741824.0, "Gi");
+  }
+}
+
 static const char * fmt_to_text(int fmt) {
   switch (fmt) {
     case 1:
@@ -247,15 +319,28 @@ void icache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl) {
   ImageCacheLine *cptr, *tmp;
   uint64_t total_bytes = 0;
   char bsize[32];
+  char blimit[32];
+
+  if (((ICC*)p)->cfg_cachemem > 0) {
+    bytes2txt(blimit, ((ICC*)p)->cfg_cachemem);
+  }
 
   if (tbl&1) {
     rprintf("<h3>Encoded Image Cache:</h3>\n");
-    rprintf("<p>max available: %i\n", ((ICC*)p)->cfg_cachesize);
+    if (((ICC*)p)->cfg_cachemem > 0) {
+      rprintf("<p>max available: %sB\n", blimit);
+    } else {
+      rprintf("<p>max available: %i\n", ((ICC*)p)->cfg_cachesize);
+    }
     rprintf("cache-hits: %d, cache-misses: %d</p>\n", ((ICC*)p)->cache_hits, ((ICC*)p)->cache_miss);
     rprintf("<table style=\"text-align:center;width:100%%\">\n");
   } else {
     rprintf("<tr><td colspan=\"8\" class=\"left\"><h3>Encoded Image Cache :</h3></td></tr>\n");
-    rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d\n", ((ICC*)p)->cfg_cachesize);
+    if (((ICC*)p)->cfg_cachemem > 0) {
+      rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %sB\n", blimit);
+    } else {
+      rprintf("<tr><td colspan=\"8\" class=\"left line\">max available: %d\n", ((ICC*)p)->cfg_cachesize);
+    }
     rprintf(", cache-hits: %d, cache-misses: %d</td></tr>\n", ((ICC*)p)->cache_hits, ((ICC*)p)->cache_miss);
   }
   rprintf("<tr><th>#</th><th>file-id</th><th>Flags</th><th>Allocated Bytes</th><th>Geometry</th><th>Buffer</th><th>Frame#</th><th>Last Hit</th></tr>\n");
@@ -265,10 +350,10 @@ void icache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl) {
     char *tmp = flags2txt(cptr->flags);
 #ifdef _WIN32
     rprintf("<tr><td>%d.</td><td>%d</td><td>%s</td><td>%lu bytes</td><td>%dx%d</td>",
-        i, cptr->id, tmp, (long unsigned) cptr->s, cptr->w, cptr->h);
+        i, cptr->id, tmp, (long unsigned) cptr->a, cptr->w, cptr->h);
 #else
     rprintf("<tr><td>%d.</td><td>%d</td><td>%s</td><td>%zu bytes</td><td>%dx%d</td>",
-        i, cptr->id, tmp, cptr->s, cptr->w, cptr->h);
+        i, cptr->id, tmp, cptr->a, cptr->w, cptr->h);
 #endif
 
     if (cptr->fmt == 1) {
@@ -281,7 +366,7 @@ void icache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl) {
         (long long) cptr->frame, (long long) cptr->lru);
 
     free(tmp);
-    total_bytes += cptr->s;
+    total_bytes += cptr->a;
     i++;
   }
 
@@ -289,19 +374,12 @@ void icache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl) {
     rprintf("<tr><td colspan=\"8\" class=\"dline\"></td></tr>\n");
   }
 
-  if (total_bytes < 1024) {
-    sprintf(bsize, "%.0f %s", total_bytes / 1.0, "");
-  } else if (total_bytes < 1024000 ) {
-    sprintf(bsize, "%.1f %s", total_bytes / 1024.0, "Ki");
-  } else if (total_bytes < 10485760) {
-    sprintf(bsize, "%.1f %s", total_bytes / 1048576.0, "Mi");
-  } else if (total_bytes < 1048576000) {
-    sprintf(bsize, "%.2f %s", total_bytes / 1048576.0, "Mi");
+  bytes2txt(bsize, total_bytes);
+  if (((ICC*)p)->cfg_cachemem > 0) {
+    rprintf("<tr><td colspan=\"8\" class=\"left\">cache size: %sB of %sB in memory</td></tr>\n", bsize, blimit);
   } else {
-    sprintf(bsize, "%.2f %s", total_bytes / 1073741824.0, "Gi");
+    rprintf("<tr><td colspan=\"8\" class=\"left\">cache size: %sB in memory</td></tr>\n", bsize);
   }
-
-  rprintf("<tr><td colspan=\"8\" class=\"left\">cache size: %sB in memory</td></tr>\n", bsize);
   pthread_rwlock_unlock(&((ICC*)p)->lock);
   if (tbl&2) {
     rprintf("</table>\n");
@@ -25,10 +25,11 @@
 void icache_create(void **p);
 void icache_destroy(void **p);
 void icache_resize(void *p, int size);
+void icache_resize_mem(void *p, size_t bytes);
 void icache_clear (void *p);
 
 uint8_t *icache_get_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, size_t *size, void **cptr);
-int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, uint8_t *buf, size_t size);
+int icache_add_buffer(void *p, unsigned short id, int64_t frame, int fmt, int fmt_opt, short w, short h, uint8_t *buf, size_t size, size_t alloc);
 void icache_release_buffer(void *p, void *cptr);
 
 void icache_info_html(void *p, char **m, size_t *o, size_t *s, int tbl);
@@ -42,6 +42,16 @@ typedef struct {
   double file_frame_offset;
 } VInfo;
 
+/** receives frames that are decoded on the way to the requested frame */
+typedef struct {
+  /** return a buffer to render the given frame into, or NULL to skip it */
+  uint8_t *(*get)(void *arg, int64_t frame);
+  /** hand back a buffer, ok is 0 if the frame was not rendered */
+  void (*put)(void *arg, int64_t frame, uint8_t *buf, int ok);
+  void *arg;  ///< user data passed to callbacks
+  int budget; ///< max. number of frames to pass on
+} FrameSink;
+
 /** initialise a VInfo struct
  * @param i VInfo struct to initialize
  */
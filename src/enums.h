@@ -25,6 +25,24 @@ enum {
   OUT_HTML, OUT_JSON, OUT_PLAIN, OUT_CSV
 };
 
+/* ics_request_args->misc_int for FMT_JPG: quality | encoder flags */
+enum {
+  JPG_QUALITY_MASK=0xff, JPG_PROGRESSIVE=0x100, JPG_OPTIMIZE=0x200,
+  JPG_DCT_ISLOW=0x400, JPG_DCT_IFAST=0x800, JPG_DCT_FLOAT=0xc00, JPG_DCT_MASK=0xc00
+};
+
+/* ics_request_args->misc_int for FMT_PNG: zlib level+1 | (strategy+1)<<4 | filter<<8,
+ * 0 in a field: libpng's default */
+enum {
+  PNGENC_LEVEL_MASK=0x0f, PNGENC_STRATEGY_MASK=0xf0, PNGENC_FILTER_MASK=0xf00
+};
+enum {PNGENC_FILTER_NONE=1, PNGENC_FILTER_SUB, PNGENC_FILTER_UP, PNGENC_FILTER_AVG, PNGENC_FILTER_PAETH, PNGENC_FILTER_ALL};
+/* level=1 strategy=rle (Z_RLE) filter=up */
+enum {PNGENC_FAST = 0x02 | 0x40 | (PNGENC_FILTER_UP << 8)};
+
+/* ics_request_args->container -- batch of frames */
+enum {CNT_MULTIPART=0, CNT_BINARY};
+
 /* http index option(s) */
 enum {OPT_FLAT=1};
 
@@ -23,6 +23,7 @@
 #include <getopt.h>
 #include <math.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <libgen.h> // basename
 #include <locale.h>
 
@@ -58,13 +59,26 @@ int   cfg_syslog = 0;
 int   cfg_memlock = 0;
 int   cfg_timeout = 0;
 int   cfg_usermask = USR_INDEX;
+int   cfg_jpegmask = 0; /* baseline, dct=auto */
+int   cfg_pngmask = 0; /* libpng defaults */
 int   cfg_adminmask = ADM_FLUSHCACHE;
 char *cfg_logfile = NULL;
 char *cfg_chroot = NULL;
 char *cfg_username = NULL;
 char *cfg_groupname = NULL;
+char *cfg_indexdir = NULL;
+int   cfg_keyindex = 1;
 int   initial_cache_size = 128;
+int   cfg_cache_mem = 0;  /* MiB */
+int   cfg_icache_mem = 0; /* MiB */
+int   cfg_readahead = 16;
+int   cfg_gopcache = 0;
 int   max_decoder_threads = 8;
+int   cfg_codec_threads = 0;  /* 0: number of CPUs */
+int   cfg_frame_threads = -1; /* -1: sequential access only */
+int   cfg_lowres = 3;
+int   cfg_lowres_skip = 1;
+int   cfg_queue_timeout = 2000; /* ms */
 unsigned short  cfg_port = DEFAULT_PORT;
 unsigned int    cfg_host = 0; /* = htonl(INADDR_ANY) */
 
@@ -79,18 +93,47 @@ static void usage (int status) {
   printf ("Usage: %s [OPTION] [document-root]\n", program_name);
   printf ("\n"
 "Options:\n"
+"  -a <frames>, --readahead <frames>\n"
+"                             max. number of frames to decode ahead when\n"
+"                             frames are requested sequentially (default: 16)\n"
+"                             0 disables read-ahead\n"
 "  -A <cmdlist>, --admin <cmdlist>\n"
 "                             space separated list of allowed admin commands.\n"
 "                             An exclamation-mark before a command disables it.\n"
 "                             default: 'flush_cache';\n"
 "                             available: flush_cache, purge_cache, shutdown\n"
+"  -b <frames>, --gop-cache <frames>\n"
+"                             max. number of frames that are decoded while\n"
+"                             seeking to a requested frame to keep in the\n"
+"                             frame-cache (default: 0, discard them)\n"
 "  -c <path>, --chroot <path>\n"
 "                             change system root - jails server to this path\n"
 "  -C <frames>                set initial frame-cache size (default: 128)\n"
+"                             ignored if --cache-mem is given\n"
 "  -D, --daemonize            fork into background and detach from TTY\n"
+"  -E <opts>, --jpeg <opts>\n"
+"                             space separated list of jpeg encoder settings.\n"
+"                             default: 'baseline dct=auto';\n"
+"                             available: progressive, baseline, optimize,\n"
+"                             dct=auto, dct=islow, dct=ifast, dct=float\n"
 "  -g <name>, --groupname <name>\n"
 "                             assume this user-group\n"
 "  -h, --help                 display this help and exit\n"
+"  -i <MiB>, --image-cache-mem <MiB>\n"
+"                             memory limit of the encoded image cache\n"
+"                             (default: 0, limit to 4 times the frame-cache size)\n"
+"  -j <num>, --codec-threads <num>\n"
+"                             max. number of threads used by all decoders\n"
+"                             together (default: number of CPUs, 1: disable)\n"
+"  -J <mode>, --frame-threads <mode>\n"
+"                             use frame-threading in addition to slice-\n"
+"                             threading: 'on', 'off' or 'auto' (default)\n"
+"                             'auto' only enables it while frames are\n"
+"                             requested sequentially\n"
+"  -k <path>, --index-dir <path>\n"
+"                             directory to store keyframe index files in,\n"
+"                             'none' disables the keyframe index.\n"
+"                             default: hidden file next to the video-file\n"
 "  -F <feat>, --features <feat>\n"
 "                             space separated list of optional features.\n"
 "                             An exclamation-mark before a features disables it.\n"
@@ -98,11 +141,24 @@ static void usage (int status) {
 "                             available: index, seek, flatindex, keepraw\n"
 "  -l <path>, --logfile <path>\n"
 "                             specify file for log messages\n"
+"  -L <level>, --lowres <level>\n"
+"                             decode frames that are requested at less than\n"
+"                             half the original size at 1/2, 1/4 or 1/8\n"
+"                             resolution if the codec supports it.\n"
+"                             max. level 0..3 (default: 3, 0: disable)\n"
+"  -m <MiB>, --cache-mem <MiB>\n"
+"                             memory limit of the raw frame-cache\n"
+"                             (default: 0, limit the number of frames: -C)\n"
 "  -M, --memlock              attempt to lock memory (prevent cache paging)\n"
 "  -p <num>, --port <num>     TCP port to listen on (default %i)\n"
 "  -P <listenaddr>            IP address to listen on (default 0.0.0.0)\n"
 "  -q, --quiet, --silent      inhibit usual output (may be used thrice)\n"
 "  -s, --syslog               send messages to syslog\n"
+"  -S <level>, --skip-filter <level>\n"
+"                             reduce the decode quality of frames that are\n"
+"                             requested at reduced size (see --lowres):\n"
+"                             0: off, 1: skip loop-filter for non-reference\n"
+"                             frames (default), 2: skip loop-filter and IDCT\n"
 "  -t <thread-limit>          set maximum decoder-threads (default: 8)\n"
 "  -T <sec>, --timeout <secs>\n"
 "                             set a timeout after which the server will\n"
@@ -111,6 +167,16 @@ static void usage (int status) {
 "                             server will act as this user\n"
 "  -v, --verbose              print more information (may be used twice)\n"
 "  -V, --version              print version information and exit\n"
+"  -w <ms>, --queue-timeout <ms>\n"
+"                             max. time a request waits for a decoder when\n"
+"                             all are busy (default: 2000)\n"
+"  -Z <opts>, --png <opts>\n"
+"                             space separated list of png encoder settings.\n"
+"                             default: libpng's 'level=6 strategy=filtered\n"
+"                             filter=all'; available: level=0..9,\n"
+"                             strategy=default|filtered|huffman|rle|fixed,\n"
+"                             filter=auto|none|sub|up|avg|paeth|all and\n"
+"                             fast (alias for 'level=1 strategy=rle filter=up')\n"
 "\n"
 "The default document-root (if unspecified) is the system root: / or C:\\.\n"
 "\n"
@@ -130,6 +196,11 @@ static void usage (int status) {
 "encoded image are kept in cache. The default is to invaldate the RGB frame\n"
 "after encoding the image.\n"
 "\n"
+"The first time a video file is opened, harvid scans it in the background\n"
+"and records the position of all frames and keyframes. Once the index is\n"
+"available seeking is frame-accurate and decodes at most one GOP. Index\n"
+"files are re-created when the video file is modified.\n"
+"\n"
 "Examples:\n"
 "harvid -A '!flush_cache purge_cache shutdown' -C 256 /tmp/\n"
 "\n"
@@ -144,25 +215,37 @@ static void usage (int status) {
 
 static struct option const long_options[] =
 {
+  {"readahead", required_argument, 0, 'a'},
   {"admin", required_argument, 0, 'A'},
+  {"gop-cache", required_argument, 0, 'b'},
   {"chroot", required_argument, 0, 'c'},
   {"cache-size", required_argument, 0, 'C'},
   {"debug", required_argument, 0, 'd'},
   {"daemonize", no_argument, 0, 'D'},
   {"groupname", required_argument, 0, 'g'},
   {"help", no_argument, 0, 'h'},
+  {"image-cache-mem", required_argument, 0, 'i'},
+  {"codec-threads", required_argument, 0, 'j'},
+  {"frame-threads", required_argument, 0, 'J'},
+  {"jpeg", required_argument, 0, 'E'},
+  {"index-dir", required_argument, 0, 'k'},
   {"features", required_argument, 0, 'F'},
   {"logfile", required_argument, 0, 'l'},
+  {"lowres", required_argument, 0, 'L'},
+  {"cache-mem", required_argument, 0, 'm'},
   {"memlock", no_argument, 0, 'M'},
   {"port", required_argument, 0, 'p'},
   {"listenip", required_argument, 0, 'P'},
   {"quiet", no_argument, 0, 'q'},
   {"silent", no_argument, 0, 'q'},
   {"syslog", no_argument, 0, 's'},
+  {"skip-filter", required_argument, 0, 'S'},
   {"timeout", required_argument, 0, 'T'},
   {"username", required_argument, 0, 'u'},
   {"verbose", no_argument, 0, 'v'},
   {"version", no_argument, 0, 'V'},
+  {"queue-timeout", required_argument, 0, 'w'},
+  {"png", required_argument, 0, 'Z'},
   {NULL, 0, NULL, 0}
 };
 
@@ -172,25 +255,37 @@ static struct option const long_options[] =
 static int decode_switches (int argc, char **argv) {
   int c;
   while ((c = getopt_long (argc, argv,
+         "a:"	/* readahead */
          "A:"	/* admin */
+         "b:"	/* gop cache */
          "c:"	/* chroot-dir */
          "C:" 	/* initial cache size */
          "d:"	/* debug */
          "D"	/* daemonize */
+         "E:"	/* jpeg encoder */
          "g:"	/* setGroup */
          "h"	/* help */
+         "i:"	/* image cache memory limit */
+         "j:"	/* codec threads */
+         "J:"	/* frame threading */
+         "k:"	/* keyframe index dir */
          "F:"	/* interaction */
          "l:"	/* logfile */
+         "L:"	/* lowres */
+         "m:"	/* frame cache memory limit */
          "M"	/* memlock */
          "p:"	/* port */
          "P:"	/* IP */
          "q"	/* quiet or silent */
          "s"	/* syslog */
+         "S:"	/* skip filter */
          "t:"	/* threads */
          "T:"	/* timeout */
          "u:"	/* setUser */
          "v"	/* verbose */
-         "V",	/* version */
+         "V"	/* version */
+         "w:"	/* decoder queue timeout */
+         "Z:",	/* png encoder */
          long_options, (int *) 0)) != EOF)
   {
     switch (c) {
@@ -209,6 +304,11 @@ static int decode_switches (int argc, char **argv) {
         debug_level=DLOG_INFO;
         break;
 
+      case 'a':		/* --readahead */
+        cfg_readahead = atoi(optarg);
+        if (cfg_readahead < 0 || cfg_readahead > 1024)
+          cfg_readahead = 16;
+        break;
       case 'A':		/* --admin */
         if (strstr(optarg, "shutdown")) cfg_adminmask|=ADM_SHUTDOWN;
         if (strstr(optarg, "purge_cache")) cfg_adminmask|=ADM_PURGECACHE;
@@ -217,6 +317,11 @@ static int decode_switches (int argc, char **argv) {
         if (strstr(optarg, "!purge_cache")) cfg_adminmask&=~ADM_PURGECACHE;
         if (strstr(optarg, "!flush_cache")) cfg_adminmask&=~ADM_FLUSHCACHE;
         break;
+      case 'b':		/* --gop-cache */
+        cfg_gopcache = atoi(optarg);
+        if (cfg_gopcache < 0 || cfg_gopcache > 64)
+          cfg_gopcache = 0;
+        break;
       case 'c':		/* --chroot */
         cfg_chroot = optarg;
         break;
@@ -248,14 +353,63 @@ static int decode_switches (int argc, char **argv) {
         if (strstr(optarg, "!flatindex")) cfg_usermask &= ~USR_FLATINDEX;
         if (strstr(optarg, "!keepraw"))   cfg_usermask &= ~USR_KEEPRAW;
         break;
+      case 'E':		/* --jpeg */
+        if (strstr(optarg, "progressive"))  cfg_jpegmask |=  JPG_PROGRESSIVE;
+        if (strstr(optarg, "optimize"))     cfg_jpegmask |=  JPG_OPTIMIZE;
+        if (strstr(optarg, "!progressive")) cfg_jpegmask &= ~JPG_PROGRESSIVE;
+        if (strstr(optarg, "!optimize"))    cfg_jpegmask &= ~JPG_OPTIMIZE;
+        if (strstr(optarg, "baseline"))     cfg_jpegmask &= ~JPG_PROGRESSIVE;
+        if (strstr(optarg, "dct=")) {
+          cfg_jpegmask &= ~JPG_DCT_MASK;
+          if (strstr(optarg, "dct=islow")) cfg_jpegmask |= JPG_DCT_ISLOW;
+          if (strstr(optarg, "dct=ifast")) cfg_jpegmask |= JPG_DCT_IFAST;
+          if (strstr(optarg, "dct=float")) cfg_jpegmask |= JPG_DCT_FLOAT;
+        }
+        break;
       case 'g':		/* --group */
         cfg_groupname = optarg;
         break;
+      case 'i':		/* --image-cache-mem */
+        cfg_icache_mem = atoi(optarg);
+        if (cfg_icache_mem < 0 || cfg_icache_mem > 1048576)
+          cfg_icache_mem = 0;
+        break;
+      case 'j':		/* --codec-threads */
+        cfg_codec_threads = atoi(optarg);
+        if (cfg_codec_threads < 0 || cfg_codec_threads > 256)
+          cfg_codec_threads = 0;
+        break;
+      case 'J':		/* --frame-threads */
+        if (!strcmp(optarg, "on")) cfg_frame_threads = 1;
+        else if (!strcmp(optarg, "off")) cfg_frame_threads = 0;
+        else cfg_frame_threads = -1;
+        break;
+      case 'L':		/* --lowres */
+        cfg_lowres = atoi(optarg);
+        if (cfg_lowres < 0 || cfg_lowres > 3)
+          cfg_lowres = 3;
+        break;
+      case 'S':		/* --skip-filter */
+        cfg_lowres_skip = atoi(optarg);
+        if (cfg_lowres_skip < 0 || cfg_lowres_skip > 2)
+          cfg_lowres_skip = 1;
+        break;
+      case 'k':		/* --index-dir */
+        if (cfg_indexdir) free(cfg_indexdir);
+        cfg_indexdir = NULL;
+        cfg_keyindex = strcmp(optarg, "none") ? 1 : 0;
+        if (cfg_keyindex) cfg_indexdir = strdup(optarg);
+        break;
       case 'l':		/* --logfile */
         cfg_syslog = 0;
         if (cfg_logfile) free(cfg_logfile);
         cfg_logfile = strdup(optarg);
         break;
+      case 'm':		/* --cache-mem */
+        cfg_cache_mem = atoi(optarg);
+        if (cfg_cache_mem < 0 || cfg_cache_mem > 1048576)
+          cfg_cache_mem = 0;
+        break;
       case 'M':		/* --memlock */
         cfg_memlock = 1;
         break;
@@ -287,6 +441,34 @@ static int decode_switches (int argc, char **argv) {
       case 'V':
         printversion();
         exit(0);
+      case 'w':		/* --queue-timeout */
+        cfg_queue_timeout = atoi(optarg);
+        if (cfg_queue_timeout < 1 || cfg_queue_timeout > 60000)
+          cfg_queue_timeout = 2000;
+        break;
+      case 'Z':		/* --png */
+        {
+          char *opts = strdup(optarg);
+          char *tok, *save = NULL;
+          for (tok = strtok_r(opts, " ,", &save); tok; tok = strtok_r(NULL, " ,", &save)) {
+            char *val = strchr(tok, '=');
+            int field, mask;
+            if (!strcmp(tok, "fast")) {
+              cfg_pngmask = PNGENC_FAST;
+              continue;
+            }
+            if (!val) continue;
+            *val++ = '\0';
+            field = png_option(tok, val, &mask);
+            if (!mask) {
+              fprintf(stderr, "harvid: ignored unknown png option '%s'\n", tok);
+              continue;
+            }
+            cfg_pngmask = (cfg_pngmask & ~mask) | field;
+          }
+          free(opts);
+        }
+        break;
       case 'h':
         usage (0);
       default:
@@ -364,12 +546,25 @@ int main (int argc, char **argv) {
   }
 
   ff_initialize();
+  ff_index_configure(cfg_keyindex, cfg_indexdir);
+#ifdef _SC_NPROCESSORS_ONLN
+  if (cfg_codec_threads == 0) {
+    cfg_codec_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+#endif
+  ff_threads_configure(cfg_codec_threads, cfg_frame_threads);
 
   vcache_create(&vc);
   vcache_resize(&vc, initial_cache_size);
+  vcache_resize_mem(&vc, (size_t)cfg_cache_mem << 20);
+  vcache_readahead(vc, cfg_readahead);
+  vcache_gopcache(vc, cfg_gopcache);
   icache_create(&ic);
   icache_resize(ic, initial_cache_size*4);
+  icache_resize_mem(ic, (size_t)cfg_icache_mem << 20);
   dctrl_create(&dc, max_decoder_threads, initial_cache_size);
+  dctrl_lowres(dc, cfg_lowres, cfg_lowres_skip);
+  dctrl_queue_timeout(dc, cfg_queue_timeout);
 
   if (cfg_memlock) {
 #ifndef HAVE_WINDOWS
@@ -390,13 +585,16 @@ int main (int argc, char **argv) {
   /* all systems go */
 
   dlog(DLOG_INFO, "Initialization complete. Starting server.\n");
-  exitstatus = start_tcp_server(cfg_host, cfg_port, docroot, cfg_uid, cfg_gid, cfg_timeout, NULL);
+  /* one request handler per decoder, plus some to serve cached frames,
+   * index pages, etc. while all decoders are busy. */
+  exitstatus = start_tcp_server(cfg_host, cfg_port, docroot, cfg_uid, cfg_gid, cfg_timeout,
+      max_decoder_threads + 4, NULL);
 
   /* cleanup */
 
+  vcache_destroy(&vc); // stops read-ahead, before decoders are closed
   ff_cleanup();
   dctrl_destroy(&dc);
-  vcache_destroy(&vc);
   icache_destroy(&ic);
 errexit:
   dlog_close();
@@ -411,7 +609,20 @@ errexit:
 #include "ics_handler.h"
 #include "htmlconst.h"
 
-#define HPSIZE 4096 // max size of homepage in bytes.
+#ifndef MAX
+#define MAX(A,B) ( ( (A) > (B) ) ? (A) : (B) )
+#endif
+#ifndef MIN
+#define MIN(A,B) ( ( (A) < (B) ) ? (A) : (B) )
+#endif
+
+#define STRIP_MAX 64       // max. number of frames in a strip
+#define STRIP_WIDTH 16384  // max. width of a strip in pixels
+#define FRAMES_MAX 1024    // max. number of frames in a batch
+#define FRAMES_BOUNDARY "harvid-frame-boundary"
+#define STREAM_FPS_MAX 120 // max. playback rate of a stream
+
+#define HPSIZE 8192 // max size of homepage in bytes.
 char *hdl_homepage_html (CONN *c) {
   char *msg = malloc(HPSIZE * sizeof(char));
   int off = 0;
@@ -443,7 +654,7 @@ char *hdl_homepage_html (CONN *c) {
   off+=snprintf(msg+off, HPSIZE-off, "<div style=\"clear:both;\"></div><hr/>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">The default request handler decodes images and requires a <code>?frame=NUM&amp;file=PATH</code> URL query or post parameters. Video frames are counted starting at zero. Default options are <code>w=0&amp;h=0&amp;format=png</code> which serves the image pre-scaled to its effective size as png.</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<p>The <code>/info</code> request handler requires a <code>?file=PATH</code> query parameter and optionally takes a <code>format</code> (default is html). All other handlers (/status, /rc, /version, /admin/) take no arguments.</p>\n");
-  off+=snprintf(msg+off, HPSIZE-off, "<p>Available query parameters: <code>frame</code>, <code>w</code>, <code>h</code>, <code>file</code>, <code>format</code>.</p>\n");
+  off+=snprintf(msg+off, HPSIZE-off, "<p>Available query parameters: <code>frame</code>, <code>w</code>, <code>h</code>, <code>file</code>, <code>format</code>, <code>snap</code>, <code>priority</code>.</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<p>Frame (frame-number), w (width) and h (height) are unsigned integers.</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<p>Supported image output pixel formats:</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<ul>\n<li><em>Encoded</em>: jpg, jpeg, png, ppm</li>\n");
@@ -452,8 +663,13 @@ char *hdl_homepage_html (CONN *c) {
   off+=snprintf(msg+off, HPSIZE-off, "<p>Available info output formats:</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<ul>\n<li><em>Human Readable</em>: html, xhtml</li>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<li><em>Machine Readable</em>: json, csv, plain</li>\n</ul>\n");
-  off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">The jpg (and jpeg) <em>format</em> parameter can be postfixed number to specify the jpeg quality. e.g. <code>&format=jpeg90</code>. The default is 75. Note that 'jpg' is just an alias for 'jpeg', and 'html' is an alias for 'xhtml'.</p>\n");
+  off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">The jpg (and jpeg) <em>format</em> parameter can be postfixed number to specify the jpeg quality. e.g. <code>&format=jpeg90</code>. The default is 75. Note that 'jpg' is just an alias for 'jpeg', and 'html' is an alias for 'xhtml'. The jpeg encoder can be configured with <code>&amp;progressive=0|1</code>, <code>&amp;optimize=0|1</code> and <code>&amp;dct=auto|islow|ifast|float</code>. Likewise the png zlib level can be given as postfix, e.g. <code>&amp;format=png1</code>, together with <code>&amp;strategy=default|filtered|huffman|rle|fixed</code> and <code>&amp;filter=auto|none|sub|up|avg|paeth|all</code>.</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">If either only <em>width</em> or <em>height</em> is specified with a value greater than 15, the other is calculated according to the movie's effective aspect-ratio. However the minimum size is 16x16, requesting geometries smaller than 16x16 will return the image in its original size.</p>\n");
+  off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">With <code>&amp;snap=key</code> the keyframe at or before the requested frame is returned instead, which is a lot faster for thumbnails. Only keyframes are decoded. The number of the frame that is returned is sent in the <code>X-Harvid-Frame</code> header.</p>\n");
+  off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">Background work such as thumbnails should be requested with <code>&amp;priority=bulk</code>. Interactive requests (the default, e.g. scrubbing) are served first when all decoders are busy, and one decoder is always left to them. Bulk requests do not trigger read-ahead and give up right away if the frame cache is full.</p>\n");
+  off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">The <code>/strip</code> request handler returns <code>n</code> (default 10, max %d) evenly spaced frames between <code>from</code> and <code>to</code> (default: first and last frame) side by side as a single image, e.g. <code>/strip?file=PATH&amp;n=20&amp;h=48&amp;format=jpeg</code>. <code>w</code> and <code>h</code> specify the size of each frame.</p>\n", STRIP_MAX);
+  off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">The <code>/frames</code> request handler streams up to %d frames in a single <code>multipart/mixed</code> reply, e.g. <code>/frames?file=PATH&amp;list=10,20,30</code> or <code>&amp;list=START:END:STEP</code>. With <code>&amp;container=bin</code> each image is preceded by its frame-number (64 bit) and length (32 bit), big-endian.</p>\n", FRAMES_MAX);
+  off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:justify;\">The <code>/stream</code> request handler plays the range <code>from</code>..<code>to</code> as motion-jpeg at <code>fps</code> frames per second (default: the file's framerate, 0: as fast as possible), e.g. <code>&lt;img src=\"/stream?file=PATH&amp;h=240\"/&gt;</code>. Frames are dropped if the client falls behind.</p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "<p style=\"text-align:center\"><a href=\"http://x42.github.com/harvid/\">harvid @ GitHub</a></p>\n");
   off+=snprintf(msg+off, HPSIZE-off, "</div>\n");
   off+=snprintf(msg+off, HPSIZE-off, HTMLFOOTER, c->d->local_addr, c->d->local_port);
@@ -473,6 +689,9 @@ char *hdl_server_status_html (CONN *c) {
   raprintf(sm, off, ss, "<h2>harvid status</h2>\n");
   raprintf(sm, off, ss, "<!--status: ok, online.-->\n"); // ardour3 reads this
   raprintf(sm, off, ss, "<p>Concurrent connections: (current / max-seen / limit) %d / %d / %d</p>\n", c->d->num_clients, c->d->max_clients, MAXCONNECTIONS);
+#ifdef HAVE_EPOLL
+  raprintf(sm, off, ss, "<p>Request handler threads: %d</p>\n", c->d->num_workers);
+#endif
 #ifdef USAGE_FREQUENCY_STATISTICS
   time_t i;
   const time_t n = time(NULL);
@@ -582,9 +801,9 @@ char *hdl_file_info (CONN *c, ics_request_args *a) {
   jvi_init(&ji);
   if ((err=dctrl_get_info(dc, vid, &ji))) {
     if (err == 503) {
-      httperror(c->fd, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+      httperror(c, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
     } else {
-      httperror(c->fd, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+      httperror(c, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
     }
     return NULL;
   }
@@ -736,14 +955,102 @@ char *hdl_server_version (CONN *c, ics_request_args *a) {
 
 /////////////
 
-int hdl_decode_frame(int fd, httpheader *h, ics_request_args *a) {
+static char *image_ctype(int render_fmt) {
+  switch (render_fmt) {
+    case FMT_RAW:
+      return "image/raw";
+    case FMT_JPG:
+      return "image/jpeg";
+    case FMT_PNG:
+      return "image/png";
+    case FMT_PPM:
+      return "image/ppm";
+    default:
+      return "image/unknown";
+  }
+}
+
+/* look up or decode and encode a frame.
+ * returns the image, *bptr is set if the image was decoded into the frame cache.
+ * when a->snap is set, *frame is updated to the keyframe that was used.
+ * the result must be handed to image_done() */
+static uint8_t *image_get(unsigned short vid, int64_t *frame, ics_request_args *a, VInfo *ji, size_t *olen, size_t *oalloc, uint8_t **bptr, void **cptr, int *err) {
+  uint8_t *optr = NULL;
+  int64_t key = -1;
+  *olen = 0;
+  *oalloc = 0;
+  *bptr = NULL;
+  *cptr = NULL;
+
+  if (a->snap) {
+    /* use the keyframe at or before the requested frame, if it is known */
+    key = dctrl_keyframe(dc, vid, *frame);
+    if (key >= 0) *frame = key;
+  }
+
+  /* try encoded cache if a->render_fmt != FMT_RAW */
+  if (a->render_fmt != FMT_RAW) {
+     optr = icache_get_buffer(ic, vid, *frame, a->render_fmt, a->misc_int, ji->out_width, ji->out_height, olen, cptr);
+  }
+  if (*olen > 0) {
+    return optr;
+  }
+
+  /* get frame from cache - or decode it into the cache */
+  if (a->snap) {
+    *bptr = vcache_get_keyframe(vc, dc, vid, frame, key, ji->out_width, ji->out_height, a->decode_fmt, a->prio, cptr, err);
+  } else {
+    *bptr = vcache_get_buffer(vc, dc, vid, *frame, ji->out_width, ji->out_height, a->decode_fmt, a->prio, cptr, err);
+  }
+  if (!*bptr) {
+    return NULL;
+  }
+
+  switch (a->render_fmt) {
+    case FMT_RAW:
+      *olen = ji->buffersize;
+      optr = *bptr;
+      break;
+    default:
+      *olen = format_image(&optr, a->render_fmt, a->misc_int, ji, a->decode_fmt, *bptr, oalloc);
+      break;
+  }
+  return optr;
+}
+
+/* release an image returned by image_get() after it was sent,
+ * adds freshly encoded images to the image cache */
+static void image_done(unsigned short vid, int64_t frame, ics_request_args *a, VInfo *ji, uint8_t *optr, size_t olen, size_t oalloc, uint8_t *bptr, void *cptr) {
+  if (bptr && a->render_fmt != FMT_RAW && optr) {
+    if (olen == 0) {
+      free(optr);
+    /* image was read from raw frame cache end encoded just now */
+    } else if (icache_add_buffer(ic, vid, frame, a->render_fmt, a->misc_int, ji->out_width, ji->out_height, optr, olen, oalloc)) {
+      /* image was not added to image cache -> unreference the buffer */
+      free(optr);
+    } else if (! (cfg_usermask & USR_KEEPRAW)) {
+      /* delete raw frame when encoded frame was cached */
+      vcache_invalidate_buffer(vc, cptr);
+    }
+  }
+
+  if (bptr)
+    vcache_release_buffer(vc, cptr);
+  else if (cptr)
+    icache_release_buffer(ic, cptr);
+}
+
+int hdl_decode_frame(CONN *c, httpheader *h, ics_request_args *a) {
+  const int fd = c->fd;
   VInfo ji;
   unsigned short vid;
   void *cptr = NULL;
   uint8_t *optr = NULL;
   size_t olen = 0;
+  size_t oalloc = 0;
   uint8_t *bptr = NULL;
   int err = 0;
+  char xframe[48];
 
   vid = dctrl_get_id(vc, dc, a->file_name);
   jvi_init(&ji);
@@ -756,84 +1063,445 @@ int hdl_decode_frame(int fd, httpheader *h, ics_request_args *a) {
   if ((err=dctrl_get_info_scale(dc, vid, &ji, a->out_width, a->out_height, a->decode_fmt)) || ji.buffersize < 1) {
     if (err == 503) {
       dlog(DLOG_WARNING, "VID: no decoder available (server overload).\n", fd);
-      httperror(fd, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+      httperror(c, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
     } else {
       dlog(DLOG_WARNING, "VID: no decoder available (invalid file or unsupported codec).\n", fd);
-      httperror(fd, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+      httperror(c, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
     }
     return 0;
   }
 
-  /* try encoded cache if a->render_fmt != FMT_RAW */
+  optr = image_get(vid, &a->frame, a, &ji, &olen, &oalloc, &bptr, &cptr, &err);
+
+  if (!optr && !bptr) {
+    dlog(DLOG_ERR, "VID: error decoding video file for fd:%d err:%d\n", fd, err);
+    if (err == 503) {
+      httperror(c, 503, "Service Temporarily Unavailable", "<p>Video cache is unavailable. The server is currently busy or overloaded.</p>");
+    } else {
+      httperror(c, 500, "Service Unavailable", "<p>No decoder or cache is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+    }
+    jvi_free(&ji);
+    return 0;
+  }
+
+  if(olen > 0 && optr) {
+    debugmsg(DEBUG_ICS, "VID: sending %li bytes to fd:%d.\n", (long int) olen, fd);
+    h->ctype = image_ctype(a->render_fmt);
+    if (a->snap) {
+      /* tell the client which frame it got */
+      snprintf(xframe, sizeof(xframe), "X-Harvid-Frame: %"PRId64, a->frame);
+      h->extra = xframe;
+    }
+    http_tx(c, 200, h, olen, optr);
+  } else {
+    dlog(DLOG_ERR, "VID: error formatting image for fd:%d\n", fd);
+    httperror(c, 500, NULL, NULL);
+  }
+
+  image_done(vid, a->frame, a, &ji, optr, olen, oalloc, bptr, cptr);
+  jvi_free(&ji);
+  return (0);
+}
+
+typedef struct {
+  unsigned short vid;
+  int64_t from;
+  int64_t to;
+  int n;
+  int w;
+  int h;
+  int fmt;
+  int prio;
+  uint8_t *buf;
+  int next; // next tile to decode
+  int err;
+} stripjob;
+
+static void *strip_worker(void *arg) {
+  stripjob *s = (stripjob*) arg;
+  int i;
+  while ((i = __sync_fetch_and_add(&s->next, 1)) < s->n) {
+    const int64_t frame = s->n > 1 ? s->from + (s->to - s->from) * i / (s->n - 1) : s->from;
+    const int rv = dctrl_decode_tile(dc, s->vid, frame, s->buf, s->w, s->h, s->fmt, i * s->w, s->n * s->w, s->prio);
+    if (rv > 0) {
+      __sync_lock_test_and_set(&s->err, rv);
+    }
+  }
+  return NULL;
+}
+
+/* decode evenly spaced frames side by side into a single image */
+int hdl_decode_strip(CONN *c, httpheader *h, ics_request_args *a) {
+  const int fd = c->fd;
+  VInfo ji;
+  stripjob job;
+  pthread_t threads[STRIP_MAX];
+  int nthreads, i;
+  uint8_t *optr = NULL;
+  size_t olen = 0;
+  int err;
+
+  memset(&job, 0, sizeof(stripjob));
+  job.vid = dctrl_get_id(vc, dc, a->file_name);
+  jvi_init(&ji);
+
+  if (a->out_width < 0 || a->out_width > 16384) a->out_width = 0;
+  if (a->out_height < 0 || a->out_height > 16384) a->out_height = 0;
+
+  if (a->count < 1 || a->count > STRIP_MAX) {
+    httperror(c, 400, "Bad Request", "<p>Invalid number of frames.</p>");
+    return 0;
+  }
   if (a->render_fmt != FMT_RAW) {
-     optr = icache_get_buffer(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height, &olen, &cptr);
+    /* tiles are packed side by side */
+    a->decode_fmt = AV_PIX_FMT_RGB24;
+  } else if (a->decode_fmt != AV_PIX_FMT_RGB24 && a->decode_fmt != AV_PIX_FMT_BGR24
+      && a->decode_fmt != AV_PIX_FMT_RGBA && a->decode_fmt != AV_PIX_FMT_ARGB && a->decode_fmt != AV_PIX_FMT_BGRA) {
+    httperror(c, 400, "Bad Request", "<p>Strips are only available in packed RGB formats.</p>");
+    return 0;
   }
 
-  if (olen == 0) {
-    /* get frame from cache - or decode it into the cache */
-    bptr = vcache_get_buffer(vc, dc, vid, a->frame, ji.out_width, ji.out_height, a->decode_fmt, &cptr, &err);
+  /* get canonical size of a single frame */
+  if ((err=dctrl_get_info_scale(dc, job.vid, &ji, a->out_width, a->out_height, a->decode_fmt)) || ji.buffersize < 1) {
+    if (err == 503) {
+      httperror(c, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+    } else {
+      httperror(c, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+    }
+    return 0;
+  }
 
-    if (!bptr) {
-      dlog(DLOG_ERR, "VID: error decoding video file for fd:%d err:%d\n", fd, err);
-      if (err == 503) {
-        httperror(fd, 503, "Service Temporarily Unavailable", "<p>Video cache is unavailable. The server is currently busy or overloaded.</p>");
-      } else {
-        httperror(fd, 500, "Service Unavailable", "<p>No decoder or cache is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
-      }
-      return 0;
+  if (ji.out_width * a->count > STRIP_WIDTH) {
+    httperror(c, 400, "Bad Request", "<p>The strip is too wide, reduce the height or number of frames.</p>");
+    return 0;
+  }
+
+  job.from = MAX(0, MIN(a->frame, ji.frames - 1));
+  job.to = (a->frame_to < 0) ? ji.frames - 1 : MAX(job.from, MIN(a->frame_to, ji.frames - 1));
+  job.n = a->count;
+  job.w = ji.out_width;
+  job.h = ji.out_height;
+  job.fmt = a->decode_fmt;
+  job.prio = a->prio;
+
+  /* the strip is a single image */
+  ji.out_width *= job.n;
+  ji.buffersize *= job.n;
+  if (!(job.buf = malloc(ji.buffersize))) {
+    httperror(c, 503, "Service Temporarily Unavailable", "<p>Out of memory.</p>");
+    return 0;
+  }
+
+  /* decode in parallel, leave some decoders for other requests */
+  nthreads = MIN(job.n, MAX(1, max_decoder_threads / 2)) - 1;
+  for (i = 0; i < nthreads; ++i) {
+    if (pthread_create(&threads[i], NULL, strip_worker, &job)) {
+      break;
     }
+  }
+  nthreads = i;
+  strip_worker(&job);
+  for (i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
 
-    switch (a->render_fmt) {
-      case FMT_RAW:
-        olen = ji.buffersize;
-        optr = bptr;
-        break;
-      default:
-        olen = format_image(&optr, a->render_fmt, a->misc_int, &ji, bptr);
-        break;
+  if (job.err) {
+    dlog(DLOG_ERR, "VID: error decoding strip for fd:%d err:%d\n", fd, job.err);
+    if (job.err == 503) {
+      httperror(c, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+    } else {
+      httperror(c, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
     }
+    free(job.buf);
+    return 0;
   }
 
-  if(olen > 0 && optr) {
-    debugmsg(DEBUG_ICS, "VID: sending %li bytes to fd:%d.\n", (long int) olen, fd);
-    switch (a->render_fmt) {
-      case FMT_RAW:
-        h->ctype = "image/raw";
-        break;
-      case FMT_JPG:
-        h->ctype = "image/jpeg";
-        break;
-      case FMT_PNG:
-        h->ctype = "image/png";
-        break;
-      case FMT_PPM:
-        h->ctype = "image/ppm";
-        break;
-      default:
-        h->ctype = "image/unknown";
+  if (a->render_fmt == FMT_RAW) {
+    olen = ji.buffersize;
+    optr = job.buf;
+    job.buf = NULL;
+  } else {
+    olen = format_image(&optr, a->render_fmt, a->misc_int, &ji, job.fmt, job.buf, NULL);
+  }
+
+  if (olen > 0 && optr) {
+    debugmsg(DEBUG_ICS, "VID: sending %li bytes strip to fd:%d.\n", (long int) olen, fd);
+    h->ctype = image_ctype(a->render_fmt);
+    http_tx(c, 200, h, olen, optr);
+  } else {
+    dlog(DLOG_ERR, "VID: error formatting image for fd:%d\n", fd);
+    httperror(c, 500, NULL, NULL);
+  }
+
+  free(optr);
+  free(job.buf);
+  jvi_free(&ji);
+  return (0);
+}
+
+static int cmp_frame(const void *a, const void *b) {
+  const int64_t fa = *((const int64_t*)a);
+  const int64_t fb = *((const int64_t*)b);
+  return (fa > fb) - (fa < fb);
+}
+
+/* parse "10,20,30" or "start:end[:step]" into a sorted list of unique frames.
+ * returns the number of frames, or -1 if the list is invalid or too long */
+static int parse_frame_list(const char *list, int64_t *frames, int64_t last) {
+  int n = 0, i, u;
+  char *end;
+  if (strchr(list, ':')) {
+    int64_t start, stop, step = 1;
+    const char *s = list;
+    start = strtoll(s, &end, 10);
+    if (end == s || *end != ':') return -1;
+    s = end + 1;
+    stop = strtoll(s, &end, 10);
+    if (end == s) return -1;
+    if (*end == ':') step = strtoll(end + 1, &end, 10);
+    if (*end != '\0' || step < 1 || start < 0) return -1;
+    if (stop > last) stop = last;
+    for (; start <= stop; start += step) {
+      if (n >= FRAMES_MAX) return -1;
+      frames[n++] = start;
     }
-    http_tx(fd, 200, h, olen, optr);
-
-    if (bptr && a->render_fmt != FMT_RAW) {
-      /* image was read from raw frame cache end encoded just now */
-      if (icache_add_buffer(ic, vid, a->frame, a->render_fmt, a->misc_int, ji.out_width, ji.out_height, optr, olen)) {
-        /* image was not added to image cache -> unreference the buffer */
-        free(optr);
-      } else if (! (cfg_usermask & USR_KEEPRAW)) {
-        /* delete raw frame when encoded frame was cached */
-        vcache_invalidate_buffer(vc, cptr);
+  } else {
+    const char *s = list;
+    while (*s) {
+      const int64_t f = strtoll(s, &end, 10);
+      if (end == s || (*end != ',' && *end != '\0')) return -1;
+      if (f >= 0 && f <= last) {
+        if (n >= FRAMES_MAX) return -1;
+        frames[n++] = f;
       }
+      s = (*end == ',') ? end + 1 : end;
     }
+  }
+  if (n < 2) return n;
+  /* decode in frame order, each frame once */
+  qsort(frames, n, sizeof(int64_t), cmp_frame);
+  for (i = 1, u = 1; i < n; ++i) {
+    if (frames[i] != frames[u - 1]) frames[u++] = frames[i];
+  }
+  return u;
+}
+
+/* send a single frame of a batch, olen == 0 signals a frame that could not be decoded */
+static int frames_tx_part(CONN *c, int container, int render_fmt, int64_t frame, size_t olen, const uint8_t *optr) {
+  if (container == CNT_BINARY) {
+    /* big-endian: 8 bytes frame-number, 4 bytes length; followed by the data */
+    uint8_t hd[12];
+    int i;
+    for (i = 0; i < 8; ++i) hd[i] = (uint8_t) (((uint64_t)frame) >> (56 - 8 * i));
+    for (i = 0; i < 4; ++i) hd[8 + i] = (uint8_t) (((uint32_t)olen) >> (24 - 8 * i));
+    if (http_tx_data(c, sizeof(hd), hd)) return -1;
   } else {
-    dlog(DLOG_ERR, "VID: error formatting image for fd:%d\n", fd);
-    httperror(fd, 500, NULL, NULL);
+    char hd[256];
+    snprintf(hd, sizeof(hd), "--%s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nX-Harvid-Frame: %"PRId64"\r\n\r\n",
+        FRAMES_BOUNDARY, image_ctype(render_fmt), (unsigned long) olen, frame);
+    if (http_tx_data(c, strlen(hd), (const uint8_t*) hd)) return -1;
   }
+  if (olen > 0 && http_tx_data(c, olen, optr)) return -1;
+  if (container != CNT_BINARY && http_tx_data(c, 2, (const uint8_t*) "\r\n")) return -1;
+  http_tx_flush(c);
+  return 0;
+}
 
-  if (bptr)
-    vcache_release_buffer(vc, cptr);
-  else
-    icache_release_buffer(ic, cptr);
+/* decode a list of frames and stream them in a single reply */
+int hdl_decode_frames(CONN *c, httpheader *h, ics_request_args *a) {
+  const int fd = c->fd;
+  VInfo ji;
+  unsigned short vid;
+  int64_t *frames;
+  int n, i;
+  int err = 0;
+
+  vid = dctrl_get_id(vc, dc, a->file_name);
+  jvi_init(&ji);
+
+  if (a->out_width < 0 || a->out_width > 16384) a->out_width = 0;
+  if (a->out_height < 0 || a->out_height > 16384) a->out_height = 0;
+
+  /* get canonical output width/height and corresponding buffersize */
+  if ((err=dctrl_get_info_scale(dc, vid, &ji, a->out_width, a->out_height, a->decode_fmt)) || ji.buffersize < 1) {
+    if (err == 503) {
+      httperror(c, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+    } else {
+      httperror(c, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+    }
+    return 0;
+  }
+
+  if (!(frames = malloc(FRAMES_MAX * sizeof(int64_t)))) {
+    httperror(c, 503, "Service Temporarily Unavailable", "<p>Out of memory.</p>");
+    jvi_free(&ji);
+    return 0;
+  }
+
+  if ((n = parse_frame_list(a->frame_list, frames, ji.frames - 1)) < 1) {
+    httperror(c, 400, "Bad Request", "<p>Invalid or empty frame list.</p>");
+    free(frames);
+    jvi_free(&ji);
+    return 0;
+  }
+
+  /* frames are sent as they are decoded */
+  h->ctype = (a->container == CNT_BINARY) ? "application/octet-stream" : "multipart/mixed; boundary=" FRAMES_BOUNDARY;
+  http_tx_begin(c, 200, h);
+
+  /* frames are requested in ascending order from this thread: the
+   * decoder that delivered the previous frame is the closest one
+   * and continues decoding forward, instead of seeking */
+  for (i = 0; i < n; ++i) {
+    void *cptr = NULL;
+    uint8_t *bptr = NULL;
+    size_t olen = 0;
+    size_t oalloc = 0;
+    int64_t frame = frames[i];
+    uint8_t *optr = image_get(vid, &frame, a, &ji, &olen, &oalloc, &bptr, &cptr, &err);
+
+    if (!optr) {
+      dlog(DLOG_ERR, "VID: error decoding frame %"PRId64" for fd:%d err:%d\n", frame, fd, err);
+      olen = 0;
+    }
+    err = frames_tx_part(c, a->container, a->render_fmt, frame, olen, optr);
+    image_done(vid, frame, a, &ji, optr, olen, oalloc, bptr, cptr);
+    if (err) {
+      break; // client disconnected
+    }
+  }
+
+  if (!err && a->container != CNT_BINARY) {
+    CSEND(fd, "--" FRAMES_BOUNDARY "--\r\n");
+  }
+  debugmsg(DEBUG_ICS, "VID: sent %d/%d frames to fd:%d.\n", i, n, fd);
+
+  free(frames);
+  jvi_free(&ji);
+  return (0);
+}
+
+static double stream_now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int active_streams = 0;
+
+/* play a range of frames as motion-jpeg (multipart/x-mixed-replace).
+ * A decoder is reserved for the stream, frames are decoded sequentially and
+ * sent when they are due; frames are skipped if the client falls behind. */
+int hdl_stream(CONN *c, httpheader *h, ics_request_args *a) {
+  const int fd = c->fd;
+  VInfo ji;
+  unsigned short vid;
+  void *dec;
+  uint8_t *buf;
+  int64_t from, to, next;
+  int64_t sent = 0, skipped = 0;
+  double fps, t0;
+  int err = 0;
+
+  vid = dctrl_get_id(vc, dc, a->file_name);
+  jvi_init(&ji);
+
+  if (a->out_width < 0 || a->out_width > 16384) a->out_width = 0;
+  if (a->out_height < 0 || a->out_height > 16384) a->out_height = 0;
+  /* jpeg is the only format that browsers play this way */
+  if (a->render_fmt != FMT_JPG) a->misc_int = cfg_jpegmask;
+  a->render_fmt = FMT_JPG;
+  a->decode_fmt = AV_PIX_FMT_YUV420P;
+
+  if ((err=dctrl_get_info_scale(dc, vid, &ji, a->out_width, a->out_height, a->decode_fmt)) || ji.buffersize < 1) {
+    if (err == 503) {
+      httperror(c, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+    } else {
+      httperror(c, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+    }
+    return 0;
+  }
+
+  from = MAX(0, MIN(a->frame, ji.frames - 1));
+  to = (a->frame_to < 0) ? ji.frames - 1 : MAX(from, MIN(a->frame_to, ji.frames - 1));
+  fps = (a->fps < 0) ? timecode_rate_to_double(&ji.framerate) : MIN(a->fps, STREAM_FPS_MAX);
+
+  /* each stream occupies a decoder, leave some for other requests */
+  if (__sync_add_and_fetch(&active_streams, 1) > MAX(1, max_decoder_threads / 2)) {
+    __sync_sub_and_fetch(&active_streams, 1);
+    httperror(c, 503, "Service Temporarily Unavailable", "<p>Too many streams.</p>");
+    jvi_free(&ji);
+    return 0;
+  }
+
+  if (!(buf = malloc(ji.buffersize))) {
+    __sync_sub_and_fetch(&active_streams, 1);
+    httperror(c, 503, "Service Temporarily Unavailable", "<p>Out of memory.</p>");
+    jvi_free(&ji);
+    return 0;
+  }
+
+  if (!(dec = dctrl_pin_decoder(dc, vid, from, ji.out_width, ji.out_height, a->decode_fmt, &err))) {
+    __sync_sub_and_fetch(&active_streams, 1);
+    if (err == 503) {
+      httperror(c, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+    } else {
+      httperror(c, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+    }
+    free(buf);
+    jvi_free(&ji);
+    return 0;
+  }
+
+  h->ctype = "multipart/x-mixed-replace; boundary=" FRAMES_BOUNDARY;
+  http_tx_begin(c, 200, h);
+
+  t0 = stream_now();
+  next = from;
+  while (next <= to && c->d->run) {
+    uint8_t *optr = NULL;
+    size_t olen = 0;
+
+    if (fps > 0) {
+      /* the frame that should be displayed now */
+      const double elapsed = stream_now() - t0;
+      const int64_t due = from + (int64_t) floor(elapsed * fps);
+      if (due > next) {
+        /* decoding or sending is too slow -> drop frames */
+        skipped += MIN(due, to + 1) - next;
+        next = due;
+        if (next > to) break;
+      } else if (due < next) {
+        /* wait in short steps, to notice a server shutdown */
+        const double delay = (next - from) / fps - elapsed;
+        mymsleep((int) ceil(MIN(delay, .2) * 1000.0));
+        continue;
+      }
+    }
+
+    err = dctrl_decode_pinned(dec, next, buf, ji.out_width, ji.out_height);
+    if (err == 503) {
+      dlog(DLOG_INFO, "VID: cache purged, ending stream fd:%d\n", fd);
+      break;
+    } else if (err) {
+      dlog(DLOG_ERR, "VID: error decoding frame %"PRId64" for stream fd:%d\n", next, fd);
+    }
+    olen = format_image(&optr, a->render_fmt, a->misc_int, &ji, a->decode_fmt, buf, NULL);
+    /* blocks until the client read the previous frames */
+    err = frames_tx_part(c, CNT_MULTIPART, a->render_fmt, next, olen, optr);
+    free(optr);
+    if (err) {
+      break; // client disconnected
+    }
+    ++sent;
+    ++next;
+  }
+
+  debugmsg(DEBUG_ICS, "VID: stream fd:%d sent %"PRId64" skipped %"PRId64" frames.\n", fd, sent, skipped);
 
+  dctrl_unpin_decoder(dec);
+  __sync_sub_and_fetch(&active_streams, 1);
+  free(buf);
   jvi_free(&ji);
   return (0);
 }
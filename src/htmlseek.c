@@ -20,9 +20,9 @@ char *hdl_file_seek (CONN *c, ics_request_args *a) {
   jvi_init(&ji);
   if ((err=dctrl_get_info(dc, vid, &ji))) {
     if (err == 503) {
-      httperror(c->fd, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
+      httperror(c, 503, "Service Temporarily Unavailable", "<p>No decoder is available. The server is currently busy or overloaded.</p>");
     } else {
-      httperror(c->fd, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
+      httperror(c, 500, "Service Unavailable", "<p>No decoder is available: File is invalid (no video track, unknown codec, invalid geometry,..)</p>");
     }
     return NULL;
   }
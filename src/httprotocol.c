@@ -31,6 +31,17 @@
 #include <time.h>
 #include <stdint.h>
 
+#ifndef HAVE_WINDOWS
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#else
+struct iovec {
+  void  *iov_base;
+  size_t iov_len;
+};
+#endif
+
 #include <dlog.h>
 #include "socket_server.h"
 #include "httprotocol.h"
@@ -39,24 +50,27 @@
 
 /* -=-=-=-=-=-=-=-=-=-=- HTTP helper functions */
 
+static const char *http_status_title(int *status) {
+  switch (*status) {
+    case 200: return "OK";
+  //case 302: return "Found";
+  //case 304: return "Not Modified";
+    case 400: return "Bad Request";
+  //case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 415: return "Unsupported Media Type";
+  //case 408: return "Request Timeout";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Temporarily Unavailable";
+    default:  *status = 500; return "Internal Server Error";
+  }
+}
+
 const char * send_http_status_fd (int fd, int status) {
   char http_head[128];
-  const char *title;
-  switch (status) {
-    case 200: title = "OK"; break;
-  //case 302: title = "Found"; break;
-  //case 304: title = "Not Modified"; break;
-    case 400: title = "Bad Request"; break;
-  //case 401: title = "Unauthorized"; break;
-    case 403: title = "Forbidden"; break;
-    case 404: title = "Not Found"; break;
-    case 415: title = "Unsupported Media Type"; break;
-  //case 408: title = "Request Timeout"; break;
-    case 500: title = "Internal Server Error"; break;
-    case 501: title = "Not Implemented"; break;
-    case 503: title = "Service Temporarily Unavailable"; break;
-    default:  title = "Internal Server Error"; status = 500; break;
-  }
+  const char *title = http_status_title(&status);
   snprintf(http_head, sizeof(http_head), "%s %d %s\015\012", PROTOCOL, status, title);
   CSEND(fd, http_head);
   return title;
@@ -64,15 +78,14 @@ const char * send_http_status_fd (int fd, int status) {
 
 #define HTHSIZE (1024)
 
-void send_http_header_fd(int fd , int s, httpheader *h) {
-  char hd[HTHSIZE];
-  int off = 0;
+/* format HTTP header lines into hd, starting at offset off */
+static void format_http_header(char *hd, int off, int s, httpheader *h) {
   time_t now;
   char timebuf[100];
 
   now = time(NULL);
   strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
-  off += snprintf(hd+off, HTHSIZE-off, "Date: %s\n", timebuf);
+  off += snprintf(hd+off, HTHSIZE-off, "Date: %s\r\n", timebuf);
   off += snprintf(hd+off, HTHSIZE-off, "Server: %s\r\n", SERVERVERSION);
 
   if (h && h->ctype)
@@ -98,42 +111,41 @@ void send_http_header_fd(int fd , int s, httpheader *h) {
     off += snprintf(hd+off, HTHSIZE-off, "Last-Modified: %s\r\n", timebuf);
   }
 
-  off += snprintf(hd+off, HTHSIZE-off, "Connection: close\r\n");
+  if (h && h->keepalive && h->length > 0)
+    off += snprintf(hd+off, HTHSIZE-off, "Connection: keep-alive\r\n");
+  else
+    off += snprintf(hd+off, HTHSIZE-off, "Connection: close\r\n");
   off += snprintf(hd+off, HTHSIZE-off, "\r\n");
-  CSEND(fd, hd);
 }
 
-void httperror(int fd , int s, const char *title, const char *str) {
-  char hd[HTHSIZE];
-  int off = 0;
-
-  const char *t = send_http_status_fd(fd, s);
-  send_http_header_fd(fd, s, NULL);
-
-  if (!title) title = t;
-  off += snprintf(hd+off, HTHSIZE-off, DOCTYPE HTMLOPEN);
-  off += snprintf(hd+off, HTHSIZE-off, "<title>Error %i %s</title></head>", s, title);
-  off += snprintf(hd+off, HTHSIZE-off, "<body><h1>%s</h1>", title);
+/* format HTTP status-line and header */
+static const char *format_http_reply(char *hd, int s, httpheader *h) {
+  const char *title = http_status_title(&s);
+  int off = snprintf(hd, HTHSIZE, "%s %d %s\015\012", PROTOCOL, s, title);
+  format_http_header(hd, off, s, h);
+  return title;
+}
 
-  if (str && strlen(str)>0) {
-    off += snprintf(hd+off, HTHSIZE-off, "<p>%s</p>\r\n", str);
-  } else {
-    off += snprintf(hd+off, HTHSIZE-off, "<p>%s</p>\r\n", "Sorry.");
-  }
-  off += snprintf(hd+off, HTHSIZE-off, ERRFOOTER);
+void send_http_header_fd(int fd , int s, httpheader *h) {
+  char hd[HTHSIZE];
+  format_http_header(hd, 0, s, h);
   CSEND(fd, hd);
 }
 
-int http_tx(int fd, int s, httpheader *h, size_t len, const uint8_t *buf) {
-  h->length = len;
-  send_http_status_fd(fd, s);
-  send_http_header_fd(fd, s, h);
+/* write all buffers, using as few system calls as possible.
+ * @return number of bytes written */
+static size_t tx_iov(int fd, struct iovec *iov, int cnt) {
+  size_t len = 0;
+  size_t offset = 0;
+  int i;
+  for (i = 0; i < cnt; ++i) {
+    len += iov[i].iov_len;
+  }
 
   // select
   #define WRITE_TIMEOUT (50) // TODO make configurable
   int timeout = WRITE_TIMEOUT;
-  size_t offset = 0;
-  while (timeout > 0) {
+  while (timeout > 0 && offset < len) {
     fd_set rd_set, wr_set;
     struct timeval tv;
 
@@ -143,39 +155,148 @@ int http_tx(int fd, int s, httpheader *h, size_t len, const uint8_t *buf) {
     FD_ZERO(&wr_set);
     FD_SET(fd, &wr_set);
     int ready = select(fd+1, &rd_set, &wr_set, NULL, &tv);
-    if(ready < 0) return (-1); // error
+    if(ready < 0) break; // error
     if(!ready) timeout--;
     else {
+      while (cnt > 0 && iov->iov_len == 0) {
+        ++iov; --cnt;
+      }
 #ifndef HAVE_WINDOWS
-      int rv = write(fd, buf+offset, len-offset);
-      debugmsg(DEBUG_HTTP, "  written (%d/%zu) @%zu on fd:%i\n", rv, len-offset, offset, fd);
+      ssize_t rv = writev(fd, iov, cnt);
+      debugmsg(DEBUG_HTTP, "  written (%zd/%zu) @%zu on fd:%i\n", rv, len-offset, offset, fd);
 #else
-      int rv = send(fd, (const char*) (buf+offset), (size_t) (len-offset), 0);
+      int rv = send(fd, (const char*) iov->iov_base, iov->iov_len, 0);
       debugmsg(DEBUG_HTTP, "  written (%d/%lu) @%lu on fd:%i\n", rv, (unsigned long)(len-offset), (unsigned long) offset, fd);
 #endif
       if (rv < 0) {
         dlog(DLOG_WARNING, "HTTP: write to socket failed: %s\n", strerror(errno));
         break; // TODO: don't break on EAGAIN, ENOBUFS, ENOMEM or similar
-      } else if (rv != len-offset) {
-         dlog(DLOG_WARNING, "HTTP: short-write (%u/%u) @%u on fd:%i\n", rv, len-offset, offset, fd);
-         timeout = WRITE_TIMEOUT;
-         offset += rv;
-      } else {
-         offset += rv;
-        break;
+      }
+      offset += rv;
+      if (offset < len) {
+        dlog(DLOG_WARNING, "HTTP: short-write (%u/%u) @%u on fd:%i\n", rv, len-offset, offset, fd);
+        timeout = WRITE_TIMEOUT;
+      }
+      /* skip the data that was written */
+      while (rv > 0) {
+        const size_t n = (size_t)rv < iov->iov_len ? (size_t)rv : iov->iov_len;
+        iov->iov_base = (uint8_t*)iov->iov_base + n;
+        iov->iov_len -= n;
+        rv -= n;
+        if (iov->iov_len == 0) {
+          ++iov; --cnt;
+        }
       }
     }
   }
   if (!timeout)
     dlog(DLOG_ERR, "HTTP: write timeout fd:%i\n", fd);
+  return offset;
+}
+
+static void tcp_cork(int fd, int on) {
+#ifdef TCP_CORK
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(int));
+#endif
+}
+
+static void send_http_error_fd(int fd, int s, const char *title, const char *str, int keepalive) {
+  char hd[HTHSIZE];
+  char bd[HTHSIZE];
+  int off = 0;
+  httpheader h;
+  struct iovec iov[2];
+
+  memset(&h, 0, sizeof(httpheader));
+  h.keepalive = keepalive;
+
+  const char *t = http_status_title(&s);
+  if (!title) title = t;
+  off += snprintf(bd+off, HTHSIZE-off, DOCTYPE HTMLOPEN);
+  off += snprintf(bd+off, HTHSIZE-off, "<title>Error %i %s</title></head>", s, title);
+  off += snprintf(bd+off, HTHSIZE-off, "<body><h1>%s</h1>", title);
+
+  if (str && strlen(str)>0) {
+    off += snprintf(bd+off, HTHSIZE-off, "<p>%s</p>\r\n", str);
+  } else {
+    off += snprintf(bd+off, HTHSIZE-off, "<p>%s</p>\r\n", "Sorry.");
+  }
+  off += snprintf(bd+off, HTHSIZE-off, ERRFOOTER);
+
+  h.length = strlen(bd);
+  format_http_reply(hd, s, &h);
+
+  iov[0].iov_base = hd;
+  iov[0].iov_len = strlen(hd);
+  iov[1].iov_base = bd;
+  iov[1].iov_len = h.length;
+  tx_iov(fd, iov, 2);
+}
+
+void httperror(CONN *c, int s, const char *title, const char *str) {
+  send_http_error_fd(c->fd, s, title, str, c->keepalive);
+}
+
+int http_tx(CONN *c, int s, httpheader *h, size_t len, const uint8_t *buf) {
+  const int fd = c->fd;
+  char hd[HTHSIZE];
+  struct iovec iov[2];
+  size_t hlen, offset;
+
+  h->length = len;
+  h->keepalive = c->keepalive && len > 0;
+  if (!h->keepalive) c->keepalive = 0;
+  format_http_reply(hd, s, h);
+  hlen = strlen(hd);
+
+  /* send header and body with a single system call,
+   * the body is written straight from the given (cache) buffer */
+  iov[0].iov_base = hd;
+  iov[0].iov_len = hlen;
+  iov[1].iov_base = (void*) buf;
+  iov[1].iov_len = len;
+  offset = tx_iov(fd, iov, 2);
+
+  if (offset != hlen + len) {
+    offset = offset > hlen ? offset - hlen : 0;
+    dlog(DLOG_WARNING, "HTTP: write to fd:%d failed at (%u/%u) = %.2f%%\n", fd, offset, len, len > 0 ? (float)offset*100.0/(float)len : 0);
+    c->keepalive = 0;
+    return (1);
+  }
+  return (0);
+}
 
+void http_tx_begin(CONN *c, int s, httpheader *h) {
+  char hd[HTHSIZE];
+  /* the end of the reply is signalled by closing the connection */
+  h->length = 0;
+  h->keepalive = 0;
+  c->keepalive = 0;
+  format_http_reply(hd, s, h);
+  /* hold back partial frames until http_tx_flush() */
+  tcp_cork(c->fd, 1);
+  CSEND(c->fd, hd);
+}
+
+int http_tx_data(CONN *c, size_t len, const uint8_t *buf) {
+  struct iovec iov;
+  size_t offset;
+  iov.iov_base = (void*) buf;
+  iov.iov_len = len;
+  offset = tx_iov(c->fd, &iov, 1);
   if (offset != len) {
-    dlog(DLOG_WARNING, "HTTP: write to fd:%d failed at (%u/%u) = %.2f%%\n", fd, offset, len, (float)offset*100.0/(float)len);
+    dlog(DLOG_WARNING, "HTTP: write to fd:%d failed at (%u/%u) = %.2f%%\n", c->fd, offset, len, (float)offset*100.0/(float)len);
+    c->keepalive = 0;
     return (1);
   }
   return (0);
 }
 
+void http_tx_flush(CONN *c) {
+  tcp_cork(c->fd, 0);
+  tcp_cork(c->fd, 1);
+}
+
 // from libcurl - thanks to GPL and Daniel Stenberg <daniel@haxx.se>
 char *url_escape(const char *string, int inlength) {
   if (!string) return strdup("");
@@ -282,7 +403,7 @@ char *url_unescape(const char *string, int length, int *olen) {
  * int protocol_error(int fd, int status);
  */
 void protocol_error(int fd, int status, char *msg) {
-  httperror(fd, status, "Error", msg?msg:"Unspecified Error.");
+  send_http_error_fd(fd, status, "Error", msg?msg:"Unspecified Error.", 0);
 }
 
 void protocol_response(int fd, char *msg) {
@@ -318,25 +439,32 @@ static int compare_accept(char *line) {
   return rv;
 }
 
-/*
- * HTTP protocol handler implements virtual
- * int protocol_handler(fd_set rd_set, CONN *c);
- * for: HTTP & ics-query
- */
-int protocol_handler(CONN *c, void *unused) {
-#ifndef HAVE_WINDOWS
-  int num = read(c->fd, c->buf, BUFSIZ);
-#else
-  int num = recv(c->fd, c->buf, BUFSIZ, 0);
-#endif
-  if (num < 0 && (errno == EINTR || errno == EAGAIN)) return(0);
-  if (num < 0) return(-1);
-  if (num == 0) return(-1); // end of input
-  c->buf[num] = '\0';
+/* length of the request header including the terminating empty line,
+ * or 0 if the header is not yet complete */
+static int http_header_length(const char *buf, int len) {
+  int i;
+  for (i = 0; i < len; ++i) {
+    if (buf[i] != '\n') continue;
+    if (i + 1 < len && buf[i+1] == '\n') return i + 2;
+    if (i + 2 < len && buf[i+1] == '\r' && buf[i+2] == '\n') return i + 3;
+  }
+  return 0;
+}
+
+/* Content-Length of the request, needed to find the start of the next one */
+static long int http_content_length(const char *buf, int hlen) {
+  const char *p = buf;
+  while ((p = memchr(p, '\n', hlen - (p - buf))) && ++p < buf + hlen) {
+    if (strncasecmp(p, "Content-Length:", 15) == 0) return atol(p + 15);
+  }
+  return 0;
+}
 
+/* parse and process a single, complete request in c->buf */
+static void http_request(CONN *c) {
 #if 0 // non HTTP commands - security issue
-  if (!strncmp(c->buf, "quit", 4)) {c->run = 0; return(0);}
-  else if (!strncmp(c->buf, "shutdown", 8)) { c->d->run = 0; return(0);}
+  if (!strncmp(c->buf, "quit", 4)) {c->run = 0; return;}
+  else if (!strncmp(c->buf, "shutdown", 8)) { c->d->run = 0; return;}
 #endif
 
   debugmsg(DEBUG_HTTP, "HTTP: CON raw-input: '%s'\n", c->buf);
@@ -347,17 +475,17 @@ int protocol_handler(CONN *c, void *unused) {
   /* Parse the first line of the request. */
   method_str = c->buf;
   if (method_str == (char*) 0) {
-    httperror(c->fd, 400, "Bad Request", "Can't parse request method."); c->run = 0; return(0);
+    httperror(c, 400, "Bad Request", "Can't parse request method."); c->run = 0; return;
   }
   path = strpbrk(method_str, " \t\012\015");
   if (path == (char*) 0) {
-    httperror(c->fd, 400, "Bad Request", "Can't parse request path."); c->run = 0; return(0);
+    httperror(c, 400, "Bad Request", "Can't parse request path."); c->run = 0; return;
   }
   *path++ = '\0';
   path += strspn(path, " \t\012\015");
   protocol = strpbrk(path, " \t\012\015");
   if (protocol == (char*) 0) {
-    httperror(c->fd, 400, "Bad Request", "Can't parse request protocol."); c->run = 0; return(0);
+    httperror(c, 400, "Bad Request", "Can't parse request protocol."); c->run = 0; return;
   }
   *protocol++ = '\0';
   protocol += strspn(protocol, " \t\012\015");
@@ -370,8 +498,8 @@ int protocol_handler(CONN *c, void *unused) {
 
   char *header = strpbrk(protocol, "\n\r \t\012\015");
   if (!header && strncmp(protocol, "HTTP/0.9", 8)) {
-    httperror(c->fd, 400, "Bad Request", "Can't parse request header.");
-    c->run = 0; return(0);
+    httperror(c, 400, "Bad Request", "Can't parse request header.");
+    c->run = 0; return;
   } else if (!header)
     header = "";
   else {
@@ -389,6 +517,7 @@ int protocol_handler(CONN *c, void *unused) {
 
   char *cookie = NULL, *host = NULL, *referer = NULL, *useragent = NULL;
   char *contenttype = NULL, *accept = NULL; long int contentlength = 0;
+  char *connection = NULL;
   char *cp, *line;
 
   /* Parse the rest of the request headers. */
@@ -414,8 +543,8 @@ int protocol_handler(CONN *c, void *unused) {
         cp += strspn(cp, " \t");
         host = cp;
         if (strchr(host, '/') != (char*) 0 || host[0] == '.') {
-          httperror(c->fd, 400, "Bad Request", "Can't parse request.");
-          c->run = 0; return(0);
+          httperror(c, 400, "Bad Request", "Can't parse request.");
+          c->run = 0; return;
         }
       }
     else if (strncasecmp(line, "Referer:", 8) == 0)
@@ -442,6 +571,12 @@ int protocol_handler(CONN *c, void *unused) {
         cp += strspn(cp, " \t");
         contentlength = atoll(cp);
         }
+    else if (strncasecmp(line, "Connection:", 11) == 0)
+        {
+        cp = &line[11];
+        cp += strspn(cp, " \t");
+        connection = cp;
+        }
     else
         debugmsg(DEBUG_HTTP, "HTTP: CON header not parsed: '%s'\n", line);
 
@@ -451,6 +586,14 @@ int protocol_handler(CONN *c, void *unused) {
 
   /* process headers */
 
+  /* persistent connection: default for HTTP/1.1, opt-in for HTTP/1.0 */
+  if (c->d->run && c->num_req < KEEPALIVE_MAXREQ) {
+    if (strncmp(protocol, "HTTP/1.0", 8) && strncmp(protocol, "HTTP/0.9", 8))
+      c->keepalive = !(connection && strncasecmp(connection, "close", 5) == 0);
+    else
+      c->keepalive = connection && strncasecmp(connection, "keep-alive", 10) == 0;
+  }
+
   int ac = accept?0:-1;
   line = accept;
   while (line && (cp = strchr(line, ','))) {
@@ -462,9 +605,9 @@ int protocol_handler(CONN *c, void *unused) {
     ac |= compare_accept(line);
 
   if (ac == 0) {
-    httperror(c->fd, 415, "", "Your client does not accept any files that this server can produce.\n");
-    c->run = 0;
-    return(0);
+    httperror(c, 415, "", "Your client does not accept any files that this server can produce.\n");
+    if (!c->keepalive) c->run = 0;
+    return;
   }
 
   debugmsg(DEBUG_CON, "HTTP: Proto: '%s', method: '%s', path: '%s' query:'%s'\n", protocol, method_str, path, query);
@@ -472,8 +615,7 @@ int protocol_handler(CONN *c, void *unused) {
   /* pre-process request */
   if (!strcmp("POST", method_str)
       && (contenttype && !strcmp(contenttype, "application/x-www-form-urlencoded"))
-      && (contentlength > 0 && contentlength <= strlen(header) /* - (header-c->buf) */ /* -num */)
-      && (num < BUFSIZ)
+      && (contentlength > 0 && contentlength <= strlen(header))
       ) {
       header[contentlength] = '\0';
 #ifdef HAVE_WINDOWS
@@ -489,6 +631,68 @@ int protocol_handler(CONN *c, void *unused) {
   /* process request */
   ics_http_handler(c, host, protocol, path, method_str, query, cookie);
 
+  if (!c->keepalive) c->run = 0;
+}
+
+/*
+ * HTTP protocol handler implements virtual
+ * int protocol_handler(fd_set rd_set, CONN *c);
+ * for: HTTP & ics-query
+ *
+ * Requests are collected in c->buf until they are complete; pipelined
+ * requests are processed in order.
+ */
+int protocol_handler(CONN *c, void *unused) {
+#ifndef HAVE_WINDOWS
+  int num = read(c->fd, c->buf + c->buf_len, BUFSIZ - 1 - c->buf_len);
+#else
+  int num = recv(c->fd, c->buf + c->buf_len, BUFSIZ - 1 - c->buf_len, 0);
+#endif
+  if (num < 0 && (errno == EINTR || errno == EAGAIN)) return(0);
+  if (num < 0) return(-1);
+  if (num == 0) return(-1); // end of input
+  c->buf_len += num;
+  c->buf[c->buf_len] = '\0';
+  c->timeout_cnt = 0;
+
+  while (c->run && c->buf_len > 0) {
+    const int hlen = http_header_length(c->buf, c->buf_len);
+    long int clen;
+    int rlen;
+    char save;
+
+    c->keepalive = 0;
+    if (hlen == 0) {
+      if (c->buf_len >= BUFSIZ - 1) {
+        httperror(c, 400, "Bad Request", "Request header is too large.");
+        c->run = 0;
+      }
+      break; // wait for more data
+    }
+
+    clen = http_content_length(c->buf, hlen);
+    if (clen < 0 || clen >= BUFSIZ - hlen) {
+      httperror(c, 400, "Bad Request", "Request is too large.");
+      c->run = 0;
+      break;
+    }
+    if (hlen + clen > c->buf_len) {
+      break; // wait for request body
+    }
+
+    rlen = hlen + clen;
+    save = c->buf[rlen];
+    c->buf[rlen] = '\0';
+
+    ++c->num_req;
+    count_request(c);
+    http_request(c);
+
+    c->buf[rlen] = save;
+    c->buf_len -= rlen;
+    memmove(c->buf, c->buf + rlen, c->buf_len);
+    c->buf[c->buf_len] = '\0';
+  }
   return(0);
 }
 
@@ -34,10 +34,13 @@
 #include <winsock.h>
 #endif
 
+#include "socket_server.h"
+
 #define DOCTYPE "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Strict//EN\"\n\"http://www.w3.org/TR/xhtml1/DTD/xhtml1-strict.dtd\">\n"
 #define HTMLOPEN "<html xmlns=\"http://www.w3.org/1999/xhtml\">\n<head><meta http-equiv=\"Content-Type\" content=\"text/html;charset=utf-8\" />\n"
 
-#define PROTOCOL "HTTP/1.0" ///< HTTP protocol version for replies
+#define PROTOCOL "HTTP/1.1" ///< HTTP protocol version for replies
+#define KEEPALIVE_MAXREQ (1000) ///< max. number of requests per persistent connection
 #define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT" ///< time format used in HTTP header
 
 #ifdef HAVE_WINDOWS
@@ -72,26 +75,60 @@ typedef struct {
   char  *encoding; ///< Content-Encoding (default: NUll - not sent)
   char  *ctype; ///< Content-type (default: text/html)
   char  *retryafter; ///< for 503 errors: Retry-After time value in seconds (default: 5)
+  int    keepalive; ///< keep the connection open after this reply (requires length > 0)
 } httpheader;
 
 /**
  * send a HTTP error reply.
- * @param fd socket file descriptor
+ * @param c client connection
  * @param s HTTP status code
  * @param title optional HTTP status-code message (may be NULL)
  * @param str optional text body explaining the error (may be NULL)
  */
-void httperror(int fd , int s, const char *title, const char *str);
+void httperror(CONN *c, int s, const char *title, const char *str);
 
 /**
  * send HTTP reply status, header and transmit data.
- * @param fd socket file descriptor
+ *
+ * The connection is kept open for further requests if the client asked
+ * for it (\ref CONN::keepalive) and \a len > 0.
+ *
+ * @param c client connection
  * @param s HTTP status code (usually 200)
  * @param h HTTP header information to send
  * @param len number of bytes to send
  * @param buf data to send
  */
-int http_tx(int fd, int s, httpheader *h, size_t len, const uint8_t *buf);
+int http_tx(CONN *c, int s, httpheader *h, size_t len, const uint8_t *buf);
+
+/**
+ * send HTTP reply status and header for a reply of unknown length.
+ *
+ * The body is sent with \ref http_tx_data() and the end of the reply
+ * is signalled by closing the connection.
+ *
+ * @param c client connection
+ * @param s HTTP status code (usually 200)
+ * @param h HTTP header information to send
+ */
+void http_tx_begin(CONN *c, int s, httpheader *h);
+
+/**
+ * transmit data, without HTTP header.
+ *
+ * @param c client connection
+ * @param len number of bytes to send
+ * @param buf data to send
+ * @return 0 on success, 1 if the data could not be sent
+ */
+int http_tx_data(CONN *c, size_t len, const uint8_t *buf);
+
+/**
+ * push out data that was sent with \ref http_tx_data()
+ * e.g. after a complete frame of a stream.
+ * @param c client connection
+ */
+void http_tx_flush(CONN *c);
 
 /**
  * internal, private function to send the HTTP status line
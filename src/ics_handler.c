@@ -25,13 +25,17 @@
 
 #include <dlog.h>
 #include <ffcompat.h> // harvid.h
+#include <decoder_ctrl.h>
 #include "httprotocol.h"
 #include "ics_handler.h"
 #include "htmlconst.h"
 #include "enums.h"
+#include "image_format.h"
 
 extern int cfg_usermask;
 extern int cfg_adminmask;
+extern int cfg_jpegmask;
+extern int cfg_pngmask;
 
 /** Compare Transport Protocol request */
 #define CTP(CMPPATH) \
@@ -40,18 +44,14 @@ extern int cfg_adminmask;
   && strcasecmp (method_str, "GET") == 0)
 
 #define SEND200(MSG) \
-  send_http_status_fd(c->fd, 200); \
-  send_http_header_fd(c->fd, 200, NULL); \
-  CSEND(c->fd, MSG);
+  SEND200CT(MSG, NULL)
 
 #define SEND200CT(MSG,CT) \
   { \
     httpheader h; \
     memset(&h, 0, sizeof(httpheader)); \
     h.ctype = CT; \
-    send_http_status_fd(c->fd, 200); \
-    send_http_header_fd(c->fd, 200, &h); \
-    CSEND(c->fd, MSG); \
+    http_tx(c, 200, &h, strlen(MSG), (const uint8_t*) (MSG)); \
   }
 
 #define CONTENT_TYPE_SWITCH(fmt) \
@@ -81,10 +81,15 @@ struct queryparserstate {
   ics_request_args *a;
   char *fn;
   int doit;
+  int jpeg_set; // JPG_* flags given in the query
+  int jpeg_val;
+  int png_set; // PNGENC_* fields given in the query
+  int png_val;
 };
 
 void parse_param(struct queryparserstate *qps, char *kvp) {
   char *sep;
+  int mask;
   if (!(sep = strchr(kvp, '='))) return;
   *sep = '\0';
   char *val = sep+1;
@@ -92,9 +97,15 @@ void parse_param(struct queryparserstate *qps, char *kvp) {
 
   debugmsg(DEBUG_ICS, "QUERY '%s'->'%s'\n", kvp, val);
 
-  if (!strcmp (kvp, "frame")) {
+  if (!strcmp (kvp, "frame") || !strcmp (kvp, "from")) {
     qps->a->frame = atoi(val);
     qps->doit |= 1;
+  } else if (!strcmp (kvp, "to")) {
+    qps->a->frame_to = atoi(val);
+  } else if (!strcmp (kvp, "fps")) {
+    qps->a->fps = atof(val);
+  } else if (!strcmp (kvp, "n")) {
+    qps->a->count = atoi(val);
   } else if (!strcmp (kvp, "w")) {
     qps->a->out_width  = atoi(val);
   } else if (!strcmp (kvp, "h")) {
@@ -102,12 +113,49 @@ void parse_param(struct queryparserstate *qps, char *kvp) {
   } else if (!strcmp (kvp, "file")) {
     qps->fn = url_unescape(val, 0, NULL);
     qps->doit |= 2;
+  } else if (!strcmp (kvp, "list")) {
+    /* unescape in place, the list is used while the query is processed */
+    char *l = url_unescape(val, 0, NULL);
+    if (l) {
+      strcpy(val, l);
+      free(l);
+    }
+    qps->a->frame_list = val;
+    qps->doit |= 1;
+  } else if (!strcmp (kvp, "container")) {
+    qps->a->container = strcmp(val, "bin") ? CNT_MULTIPART : CNT_BINARY;
+  } else if (!strcmp (kvp, "progressive")) {
+    qps->jpeg_set |= JPG_PROGRESSIVE;
+    qps->jpeg_val = atoi(val) ? (qps->jpeg_val | JPG_PROGRESSIVE) : (qps->jpeg_val & ~JPG_PROGRESSIVE);
+  } else if (!strcmp (kvp, "optimize")) {
+    qps->jpeg_set |= JPG_OPTIMIZE;
+    qps->jpeg_val = atoi(val) ? (qps->jpeg_val | JPG_OPTIMIZE) : (qps->jpeg_val & ~JPG_OPTIMIZE);
+  } else if (!strcmp (kvp, "dct")) {
+    qps->jpeg_set |= JPG_DCT_MASK;
+    qps->jpeg_val &= ~JPG_DCT_MASK;
+         if (!strcmp(val, "islow")) qps->jpeg_val |= JPG_DCT_ISLOW;
+    else if (!strcmp(val, "ifast")) qps->jpeg_val |= JPG_DCT_IFAST;
+    else if (!strcmp(val, "float")) qps->jpeg_val |= JPG_DCT_FLOAT;
+  } else if (!strcmp (kvp, "strategy") || !strcmp (kvp, "filter")) {
+    int field = png_option(kvp, val, &mask);
+    qps->png_set |= mask;
+    qps->png_val = (qps->png_val & ~mask) | field;
+  } else if (!strcmp (kvp, "priority")) {
+    qps->a->prio = strcmp(val, "bulk") ? DCTL_PRIO_INTERACTIVE : DCTL_PRIO_BULK;
+  } else if (!strcmp (kvp, "snap")) {
+    qps->a->snap = strcmp(val, "key") ? 0 : 1;
   } else if (!strcmp (kvp, "flatindex")) {
     qps->a->idx_option |= OPT_FLAT;
   } else if (!strcmp (kvp, "format")) {
-         if (!strncmp(val, "jpg",3))  {qps->a->render_fmt = FMT_JPG; qps->a->misc_int = atoi(&val[3]);}
-    else if (!strncmp(val, "jpeg",4)) {qps->a->render_fmt = FMT_JPG; qps->a->misc_int = atoi(&val[4]);}
-    else if (!strcmp(val, "png"))      qps->a->render_fmt = FMT_PNG;
+         if (!strncmp(val, "jpg",3))  {qps->a->render_fmt = FMT_JPG; qps->a->decode_fmt = AV_PIX_FMT_YUV420P; qps->a->misc_int = atoi(&val[3]);}
+    else if (!strncmp(val, "jpeg",4)) {qps->a->render_fmt = FMT_JPG; qps->a->decode_fmt = AV_PIX_FMT_YUV420P; qps->a->misc_int = atoi(&val[4]);}
+    else if (!strncmp(val, "png",3))  {
+      qps->a->render_fmt = FMT_PNG;
+      if (val[3] >= '0' && val[3] <= '9') {
+        qps->png_set |= PNGENC_LEVEL_MASK;
+        qps->png_val = (qps->png_val & ~PNGENC_LEVEL_MASK) | png_option("level", &val[3], &mask);
+      }
+    }
     else if (!strcmp(val, "ppm"))      qps->a->render_fmt = FMT_PPM;
     else if (!strcmp(val, "yuv"))     {qps->a->render_fmt = FMT_RAW; qps->a->decode_fmt = AV_PIX_FMT_YUV420P;}
     else if (!strcmp(val, "yuv420"))  {qps->a->render_fmt = FMT_RAW; qps->a->decode_fmt = AV_PIX_FMT_YUV420P;}
@@ -144,14 +192,29 @@ static int parse_http_query(CONN *c, char *query, httpheader *h, ics_request_arg
   a->decode_fmt = AV_PIX_FMT_RGB24;
   a->render_fmt = FMT_PNG;
   a->frame = 0;
+  a->frame_to = -1;
+  a->count = 10;
   a->misc_int = 0;
+  a->snap = 0;
+  a->container = CNT_MULTIPART;
+  a->fps = -1;
+  a->prio = DCTL_PRIO_INTERACTIVE;
   a->out_width = a->out_height = -1; // auto-set
 
   parse_http_query_params(&qps, query);
 
+  if (a->render_fmt == FMT_JPG) {
+    /* quality and encoder settings, the server's unless given */
+    if (a->misc_int < 5 || a->misc_int > 100) a->misc_int = 0;
+    a->misc_int |= (cfg_jpegmask & ~qps.jpeg_set) | (qps.jpeg_val & qps.jpeg_set);
+  } else if (a->render_fmt == FMT_PNG) {
+    /* compression profile, field-wise the server's unless given */
+    a->misc_int = (cfg_pngmask & ~qps.png_set) | (qps.png_val & qps.png_set);
+  }
+
   /* check for illegal paths */
   if (!qps.fn || check_path(qps.fn)) {
-    httperror(c->fd, 404, "File not found.", "File not found.");
+    httperror(c, 404, "File not found.", "File not found.");
     return(-1);
   }
 
@@ -171,14 +234,14 @@ static int parse_http_query(CONN *c, char *query, httpheader *h, ics_request_arg
     struct stat sb;
     if (stat(a->file_name, &sb)) {
       dlog(DLOG_WARNING, "CON: file not found: '%s'\n", a->file_name);
-      httperror(c->fd, 404, "Not Found", "file not found.");
+      httperror(c, 404, "Not Found", "file not found.");
       return(-1);
     }
 
     /* check file permissions */
     if (access(a->file_name, R_OK)) {
       dlog(DLOG_WARNING, "CON: permission denied for file: '%s'\n", a->file_name);
-      httperror(c->fd, 403, NULL, NULL);
+      httperror(c, 403, NULL, NULL);
       return(-1);
     }
 
@@ -193,7 +256,10 @@ static int parse_http_query(CONN *c, char *query, httpheader *h, ics_request_arg
 // Callbacks -- request handlers
 
 // harvid.c
-int   hdl_decode_frame (int fd, httpheader *h, ics_request_args *a);
+int   hdl_decode_frame (CONN *c, httpheader *h, ics_request_args *a);
+int   hdl_decode_strip (CONN *c, httpheader *h, ics_request_args *a);
+int   hdl_decode_frames (CONN *c, httpheader *h, ics_request_args *a);
+int   hdl_stream (CONN *c, httpheader *h, ics_request_args *a);
 char *hdl_homepage_html (CONN *c);
 char *hdl_server_status_html (CONN *c);
 char *hdl_file_info (CONN *c, ics_request_args *a);
@@ -262,7 +328,6 @@ void ics_http_handler(
     char *status = hdl_server_status_html(c);
     SEND200(status);
     free(status);
-    c->run = 0;
   } else if (CTP("/favicon.ico")) {
     #include "favicon.h"
     httpheader h;
@@ -270,24 +335,21 @@ void ics_http_handler(
     h.ctype = "image/x-icon";
     h.length = sizeof(favicon_data);
     h.mtime = 1361225638 ; // TODO compile time check image timestamp
-    http_tx(c->fd, 200, &h, sizeof(favicon_data), favicon_data);
-    c->run = 0;
+    http_tx(c, 200, &h, sizeof(favicon_data), favicon_data);
   } else if (CTP("/logo.jpg")) {
     httpheader h;
     memset(&h, 0, sizeof(httpheader));
     h.ctype = "image/jpeg";
     h.length = LDLEN(doc_harvid_jpg);
     h.mtime = 1361225638 ; // TODO compile time check image timestamp
-    http_tx(c->fd, 200, &h, h.length, LDVAR(doc_harvid_jpg));
-    c->run = 0;
+    http_tx(c, 200, &h, h.length, LDVAR(doc_harvid_jpg));
   } else if ((cfg_usermask & USR_WEBSEEK) && CTP("/seek.js")) {
     httpheader h;
     memset(&h, 0, sizeof(httpheader));
     h.ctype = "application/javascript";
     h.length = LDLEN(doc_seek_js);
     h.mtime = 1361225638 ; // TODO compile time check image timestamp
-    http_tx(c->fd, 200, &h, h.length, LDVAR(doc_seek_js));
-    c->run = 0;
+    http_tx(c, 200, &h, h.length, LDVAR(doc_seek_js));
   } else if ((cfg_usermask & USR_WEBSEEK) && CTP("/seek")) {
     ics_request_args a;
     memset(&a, 0, sizeof(ics_request_args));
@@ -301,11 +363,10 @@ void ics_http_handler(
         free(info);
       }
     } else {
-      httperror(c->fd, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
+      httperror(c, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
     }
     if (a.file_name) free(a.file_name);
     if (a.file_qurl) free(a.file_qurl);
-    c->run = 0;
   } else if (CTP("/info")) { /* /info -> /file/info !! */
     ics_request_args a;
     memset(&a, 0, sizeof(ics_request_args));
@@ -319,11 +380,55 @@ void ics_http_handler(
         free(info);
       }
     } else {
-      httperror(c->fd, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
+      httperror(c, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
+    }
+    if (a.file_name) free(a.file_name);
+    if (a.file_qurl) free(a.file_qurl);
+  } else if (CTP("/strip")) {
+    ics_request_args a;
+    httpheader h;
+    memset(&a, 0, sizeof(ics_request_args));
+    memset(&h, 0, sizeof(httpheader));
+    int rv = parse_http_query(c, query, &h, &a);
+    if (rv < 0) {
+      ;
+    } else if (rv&2) {
+      hdl_decode_strip(c, &h, &a);
+    } else {
+      httperror(c, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
+    }
+    if (a.file_name) free(a.file_name);
+    if (a.file_qurl) free(a.file_qurl);
+  } else if (CTP("/frames")) {
+    ics_request_args a;
+    httpheader h;
+    memset(&a, 0, sizeof(ics_request_args));
+    memset(&h, 0, sizeof(httpheader));
+    int rv = parse_http_query(c, query, &h, &a);
+    if (rv < 0) {
+      ;
+    } else if ((rv&2) && a.frame_list) {
+      hdl_decode_frames(c, &h, &a);
+    } else {
+      httperror(c, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
+    }
+    if (a.file_name) free(a.file_name);
+    if (a.file_qurl) free(a.file_qurl);
+  } else if (CTP("/stream")) {
+    ics_request_args a;
+    httpheader h;
+    memset(&a, 0, sizeof(ics_request_args));
+    memset(&h, 0, sizeof(httpheader));
+    int rv = parse_http_query(c, query, &h, &a);
+    if (rv < 0) {
+      ;
+    } else if (rv&2) {
+      hdl_stream(c, &h, &a);
+    } else {
+      httperror(c, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
     }
     if (a.file_name) free(a.file_name);
     if (a.file_qurl) free(a.file_qurl);
-    c->run = 0;
   } else if (CTP("/rc")) {
     ics_request_args a;
     struct queryparserstate qps = {&a, NULL, 0};
@@ -333,7 +438,6 @@ void ics_http_handler(
     SEND200CT(info, CONTENT_TYPE_SWITCH(a.render_fmt));
     free(info);
     free(qps.fn);
-    c->run = 0;
   } else if (CTP("/version")) {
     ics_request_args a;
     struct queryparserstate qps = {&a, NULL, 0};
@@ -343,7 +447,6 @@ void ics_http_handler(
     SEND200CT(info, CONTENT_TYPE_SWITCH(a.render_fmt));
     free(info);
     free(qps.fn);
-    c->run = 0;
   } else if (CTP("/index/")) { /* /index/  -> /file/index/ ?! */
     struct stat sb;
     char *dp = url_unescape(&(path[7]), 0, NULL);
@@ -357,15 +460,15 @@ void ics_http_handler(
       }
 #endif
     if (! (cfg_usermask & USR_INDEX)) {
-      httperror(c->fd, 403, NULL, NULL);
+      httperror(c, 403, NULL, NULL);
     } else if (!dp || check_path(dp)) {
-      httperror(c->fd, 400, "Bad Request", "Illegal filename.");
+      httperror(c, 400, "Bad Request", "Illegal filename.");
     } else if (stat(abspath, &sb) || !S_ISDIR(sb.st_mode)) {
       dlog(DLOG_WARNING, "CON: dir not found: '%s'\n", abspath);
-      httperror(c->fd, 404, "Not Found", "file not found.");
+      httperror(c, 404, "Not Found", "file not found.");
     } else if (access(abspath, R_OK)) {
       dlog(DLOG_WARNING, "CON: permission denied for dir: '%s'\n", abspath);
-      httperror(c->fd, 403, NULL, NULL);
+      httperror(c, 403, NULL, NULL);
     } else {
       debugmsg(DEBUG_ICS, "indexing dir: '%s'\n", abspath);
       ics_request_args a;
@@ -375,13 +478,16 @@ void ics_http_handler(
       parse_http_query_params(&qps, query);
       snprintf(base_url, 1024, "http://%s%s", host, path);
       if (! (cfg_usermask & USR_FLATINDEX)) a.idx_option &= ~OPT_FLAT;
-      SEND200CT("", CONTENT_TYPE_SWITCH(a.render_fmt));
+      /* the index is streamed, the end of the reply is signalled by closing the connection */
+      httpheader h;
+      memset(&h, 0, sizeof(httpheader));
+      h.ctype = CONTENT_TYPE_SWITCH(a.render_fmt);
+      http_tx_begin(c, 200, &h);
       hdl_index_dir(c->fd, c->d->docroot, base_url, dp, a.render_fmt, a.idx_option);
       free(dp);
       free(qps.fn);
     }
     free(abspath);
-    c->run = 0;
   } else if (CTP("/admin")) { /* /admin/ */
     if (strncasecmp(path,  "/admin/check", 12) == 0) {
       SEND200("ok\n");
@@ -390,31 +496,29 @@ void ics_http_handler(
         hdl_clear_cache();
         SEND200(OK200MSG("cache flushed\n"));
       } else {
-        httperror(c->fd, 403, NULL, NULL);
+        httperror(c, 403, NULL, NULL);
       }
     } else if (strncasecmp(path,  "/admin/purge_cache", 18) == 0) {
       if (cfg_adminmask & ADM_PURGECACHE) {
         hdl_purge_cache();
         SEND200(OK200MSG("cache purged\n"));
       } else {
-        httperror(c->fd, 403, NULL, NULL);
+        httperror(c, 403, NULL, NULL);
       }
     } else if (strncasecmp(path,  "/admin/shutdown", 15) == 0) {
       if (cfg_adminmask & ADM_SHUTDOWN) {
         SEND200(OK200MSG("shutdown queued\n"));
         c->d->run = 0;
       } else {
-        httperror(c->fd, 403, NULL, NULL);
+        httperror(c, 403, NULL, NULL);
       }
     } else {
-      httperror(c->fd, 400, "Bad Request", "Nonexistent admin command.");
+      httperror(c, 400, "Bad Request", "Nonexistent admin command.");
     }
-    c->run = 0;
   } else if (CTP("/") && !strcmp(path, "/") && strlen(query) == 0) { /* HOMEPAGE */
     char *msg = hdl_homepage_html(c);
     SEND200(msg);
     free(msg);
-    c->run = 0;
   }
   else if (  (strncasecmp(protocol,  "HTTP/", 5) == 0) /* /?file= -> /file/frame?.. !! */
            &&(strcasecmp (method_str, "GET") == 0)
@@ -428,18 +532,16 @@ void ics_http_handler(
     if (rv < 0) {
       ;
     } else if (rv == 3) {
-      hdl_decode_frame(c->fd, &h, &a);
+      hdl_decode_frame(c, &h, &a);
     } else {
-      httperror(c->fd, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
+      httperror(c, 400, "Bad Request", "<p>Insufficient query parameters.</p>");
     }
     if (a.file_name) free(a.file_name);
     if (a.file_qurl) free(a.file_qurl);
-    c->run = 0;
   }
   else
   {
-    httperror(c->fd, 500, "", "server does not know what to make of this.\n");
-    c->run = 0;
+    httperror(c, 500, "", "server does not know what to make of this.\n");
   }
 }
 
@@ -31,12 +31,19 @@ typedef struct {
   char *file_name;
   char *file_qurl;
   int64_t frame;
+  int64_t frame_to; // last frame of a strip, -1: end of file
+  int count;        // number of frames in a strip
   int decode_fmt;
   int render_fmt;
   int out_width;
   int out_height;
   int idx_option;
-  int misc_int; // currently used for jpeg quality only
+  int misc_int; // encoder options: jpeg quality or-ed with JPG_* flags, or PNGENC_* profile
+  int snap;     // snap to the keyframe at or before the frame
+  char *frame_list; // frames of a batch: "10,20,30" or "start:end[:step]" (points into the query)
+  int container;    // reply format of a batch
+  double fps;       // playback rate of a stream, 0: as fast as possible, < 0: file's framerate
+  int prio;         // DCTL_PRIO_INTERACTIVE or DCTL_PRIO_BULK
 } ics_request_args;
 
 void ics_http_handler(
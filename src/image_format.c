@@ -29,20 +29,155 @@
 #include <stdlib.h>
 #include <string.h>
 #include <jpeglib.h>
+#include <jerror.h>
 #include <png.h>
+#include <zlib.h>
+#include <pthread.h>
 
 #include <dlog.h>
 #include <vinfo.h> // harvid.h
+#include <ffcompat.h> // AV_PIX_FMT_*
 #include "enums.h"
 
 #define JPEG_QUALITY 75
 
-static int write_jpeg(VInfo *ji, uint8_t *buffer, int quality, FILE *x) {
+/* -=-=-=-=-=-=-=-=-=-=- output buffer */
+
+/* images are encoded directly into a malloc()ed buffer that is handed
+ * to the caller (and possibly kept by the image-cache).
+ * To avoid growing the buffer while encoding, its initial size is
+ * taken from the previous image of the same format and geometry. */
+
+#define IMGBUF_CLASS (4096) // allocation granularity
+#define IMGHINT_SIZE (64)   // number of remembered geometries
+
+typedef struct {
+  uint8_t *buf;
+  size_t size; // allocated bytes
+  size_t len;  // used bytes
+  int err;
+} imgbuf;
+
+typedef struct {
+  int fmt;
+  int opt; // e.g. jpeg quality
+  int w, h;
+  size_t bytes;
+} imghint;
+
+static imghint hints[IMGHINT_SIZE];
+static pthread_mutex_t hint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hint_slot(int fmt, int opt, int w, int h) {
+  return ((unsigned int)w * 31u + (unsigned int)h * 17u + (unsigned int)fmt * 7u + (unsigned int)opt) % IMGHINT_SIZE;
+}
+
+static size_t size_class(size_t bytes) {
+  return (bytes + IMGBUF_CLASS - 1) / IMGBUF_CLASS * IMGBUF_CLASS;
+}
+
+/* expected size of an encoded image */
+static size_t hint_get(int fmt, int opt, int w, int h) {
+  size_t bytes = 0;
+  imghint *ih = &hints[hint_slot(fmt, opt, w, h)];
+  pthread_mutex_lock(&hint_lock);
+  if (ih->fmt == fmt && ih->opt == opt && ih->w == w && ih->h == h) {
+    bytes = ih->bytes + ih->bytes / 8;
+  }
+  pthread_mutex_unlock(&hint_lock);
+  if (bytes == 0) {
+    /* first image of this kind: guess */
+    switch (fmt) {
+      case FMT_JPG: bytes = (size_t)w * h / 2; break;
+      case FMT_PNG: bytes = (size_t)w * h * 2; break;
+      default: bytes = (size_t)w * h * 3 + 32; break;
+    }
+  }
+  return size_class(bytes);
+}
+
+static void hint_set(int fmt, int opt, int w, int h, size_t bytes) {
+  imghint *ih = &hints[hint_slot(fmt, opt, w, h)];
+  pthread_mutex_lock(&hint_lock);
+  ih->fmt = fmt; ih->opt = opt; ih->w = w; ih->h = h;
+  ih->bytes = bytes;
+  pthread_mutex_unlock(&hint_lock);
+}
+
+static int imgbuf_reserve(imgbuf *ib, size_t bytes) {
+  uint8_t *b;
+  if (ib->len + bytes <= ib->size) return 0;
+  size_t size = ib->size * 2;
+  if (size < ib->len + bytes) size = ib->len + bytes;
+  size = size_class(size);
+  if (!(b = realloc(ib->buf, size))) {
+    ib->err = 1;
+    return -1;
+  }
+  debugmsg(DEBUG_ICS, "IMF: grow image buffer %zu -> %zu\n", ib->size, size);
+  ib->buf = b;
+  ib->size = size;
+  return 0;
+}
+
+static void imgbuf_write(imgbuf *ib, const uint8_t *data, size_t len) {
+  if (imgbuf_reserve(ib, len)) return;
+  memcpy(ib->buf + ib->len, data, len);
+  ib->len += len;
+}
+
+/* -=-=-=-=-=-=-=-=-=-=- encoders */
+
+typedef struct {
+  struct jpeg_destination_mgr pub;
+  imgbuf *ib;
+} jpeg_imgbuf_dest;
+
+static void jpeg_imgbuf_init(j_compress_ptr cinfo) {
+  jpeg_imgbuf_dest *dest = (jpeg_imgbuf_dest*) cinfo->dest;
+  dest->pub.next_output_byte = dest->ib->buf + dest->ib->len;
+  dest->pub.free_in_buffer = dest->ib->size - dest->ib->len;
+}
+
+static boolean jpeg_imgbuf_empty(j_compress_ptr cinfo) {
+  jpeg_imgbuf_dest *dest = (jpeg_imgbuf_dest*) cinfo->dest;
+  /* the whole buffer is full */
+  dest->ib->len = dest->ib->size;
+  if (imgbuf_reserve(dest->ib, IMGBUF_CLASS)) {
+    ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+  }
+  dest->pub.next_output_byte = dest->ib->buf + dest->ib->len;
+  dest->pub.free_in_buffer = dest->ib->size - dest->ib->len;
+  return TRUE;
+}
+
+static void jpeg_imgbuf_term(j_compress_ptr cinfo) {
+  jpeg_imgbuf_dest *dest = (jpeg_imgbuf_dest*) cinfo->dest;
+  dest->ib->len = dest->ib->size - dest->pub.free_in_buffer;
+}
+
+/* apply quality and encoder flags (JPG_*), after jpeg_set_defaults() */
+static void jpeg_options(j_compress_ptr cjpeg, int quality, int flags) {
+  jpeg_set_quality (cjpeg, quality, TRUE);
+  switch (flags & JPG_DCT_MASK) {
+    case JPG_DCT_ISLOW: cjpeg->dct_method = JDCT_ISLOW; break;
+    case JPG_DCT_IFAST: cjpeg->dct_method = JDCT_IFAST; break;
+    case JPG_DCT_FLOAT: cjpeg->dct_method = JDCT_FLOAT; break;
+    default: cjpeg->dct_method = quality > 90? JDCT_DEFAULT : JDCT_FASTEST; break;
+  }
+  cjpeg->optimize_coding = (flags & JPG_OPTIMIZE) ? TRUE : FALSE;
+  if (flags & JPG_PROGRESSIVE) {
+    jpeg_simple_progression(cjpeg);
+  }
+}
+
+static int write_jpeg(VInfo *ji, uint8_t *buffer, int quality, int flags, imgbuf *ib) {
   uint8_t *line;
   int n, y = 0, i, line_width;
 
   struct jpeg_compress_struct cjpeg;
   struct jpeg_error_mgr jerr;
+  jpeg_imgbuf_dest dest;
   JSAMPROW row_ptr[1];
 
   line = malloc(ji->out_width * 3);
@@ -59,12 +194,14 @@ static int write_jpeg(VInfo *ji, uint8_t *buffer, int quality, FILE *x) {
   cjpeg.in_color_space = JCS_RGB;
 
   jpeg_set_defaults (&cjpeg);
-  jpeg_set_quality (&cjpeg, quality, TRUE);
-  cjpeg.dct_method = quality > 90? JDCT_DEFAULT : JDCT_FASTEST;
+  jpeg_options (&cjpeg, quality, flags);
 
-  jpeg_simple_progression(&cjpeg);
+  dest.pub.init_destination = jpeg_imgbuf_init;
+  dest.pub.empty_output_buffer = jpeg_imgbuf_empty;
+  dest.pub.term_destination = jpeg_imgbuf_term;
+  dest.ib = ib;
+  cjpeg.dest = &dest.pub;
 
-  jpeg_stdio_dest (&cjpeg, x);
   jpeg_start_compress (&cjpeg, TRUE);
   row_ptr[0] = line;
   line_width = ji->out_width * 3;
@@ -87,7 +224,137 @@ static int write_jpeg(VInfo *ji, uint8_t *buffer, int quality, FILE *x) {
   return(0);
 }
 
-static int write_png(VInfo *ji, uint8_t *image, FILE *x) {
+/* JPEG (JFIF) uses full-range YCbCr, the decoder delivers limited-range */
+static void yuv_range_lut(uint8_t *ylut, uint8_t *clut) {
+  int i;
+  for (i = 0; i < 256; ++i) {
+    const int y = ((i - 16) * 255 + 109) / 219;
+    const int c = 128 + ((i - 128) * 255 + ((i < 128) ? -112 : 112)) / 224;
+    ylut[i] = y < 0 ? 0 : (y > 255 ? 255 : y);
+    clut[i] = c < 0 ? 0 : (c > 255 ? 255 : c);
+  }
+}
+
+/* copy a row, expand the range and pad it by repeating the last pixel */
+static void yuv_row(uint8_t *dst, const uint8_t *src, int w, int padded, const uint8_t *lut) {
+  int x;
+  for (x = 0; x < w; ++x) {
+    dst[x] = lut[src[x]];
+  }
+  for (; x < padded; ++x) {
+    dst[x] = dst[w - 1];
+  }
+}
+
+/* encode planar YUV 4:2:0 as is, without converting it to RGB and back */
+static int write_jpeg_yuv420(VInfo *ji, uint8_t *buffer, int quality, int flags, imgbuf *ib) {
+  const int w = ji->out_width;
+  const int h = ji->out_height;
+  const int cw = (w + 1) / 2;
+  const int ch = (h + 1) / 2;
+  const int yw = (w + 15) & ~15; // MCU-aligned
+  const uint8_t *py = buffer;
+  const uint8_t *pu = py + w * h;
+  const uint8_t *pv = pu + cw * ch;
+  uint8_t ylut[256], clut[256];
+  uint8_t *rows;
+  int y, i;
+
+  struct jpeg_compress_struct cjpeg;
+  struct jpeg_error_mgr jerr;
+  jpeg_imgbuf_dest dest;
+  JSAMPROW yrow[16], urow[8], vrow[8];
+  JSAMPARRAY planes[3] = {yrow, urow, vrow};
+
+  rows = malloc(16 * yw + 2 * 8 * (yw / 2));
+  if (!rows) {
+    dlog(DLOG_CRIT, "IMF: OUT OF MEMORY, Exiting...\n");
+    exit(1);
+  }
+  for (i = 0; i < 16; ++i) {
+    yrow[i] = rows + i * yw;
+  }
+  for (i = 0; i < 8; ++i) {
+    urow[i] = rows + 16 * yw + i * (yw / 2);
+    vrow[i] = rows + 16 * yw + 8 * (yw / 2) + i * (yw / 2);
+  }
+  yuv_range_lut(ylut, clut);
+
+  cjpeg.err = jpeg_std_error(&jerr);
+  jpeg_create_compress (&cjpeg);
+  cjpeg.image_width  = w;
+  cjpeg.image_height = h;
+  cjpeg.input_components = 3;
+  cjpeg.in_color_space = JCS_YCbCr;
+
+  jpeg_set_defaults (&cjpeg);
+  cjpeg.raw_data_in = TRUE;
+  cjpeg.comp_info[0].h_samp_factor = 2;
+  cjpeg.comp_info[0].v_samp_factor = 2;
+  cjpeg.comp_info[1].h_samp_factor = 1;
+  cjpeg.comp_info[1].v_samp_factor = 1;
+  cjpeg.comp_info[2].h_samp_factor = 1;
+  cjpeg.comp_info[2].v_samp_factor = 1;
+  jpeg_options (&cjpeg, quality, flags);
+
+  dest.pub.init_destination = jpeg_imgbuf_init;
+  dest.pub.empty_output_buffer = jpeg_imgbuf_empty;
+  dest.pub.term_destination = jpeg_imgbuf_term;
+  dest.ib = ib;
+  cjpeg.dest = &dest.pub;
+
+  jpeg_start_compress (&cjpeg, TRUE);
+
+  /* one MCU row at a time, rows below the image repeat the last row */
+  for (y = 0; y < h; y += 16) {
+    for (i = 0; i < 16; ++i) {
+      const int sy = (y + i < h) ? y + i : h - 1;
+      yuv_row(yrow[i], py + sy * w, w, yw, ylut);
+    }
+    for (i = 0; i < 8; ++i) {
+      const int sy = (y / 2 + i < ch) ? y / 2 + i : ch - 1;
+      yuv_row(urow[i], pu + sy * cw, cw, yw / 2, clut);
+      yuv_row(vrow[i], pv + sy * cw, cw, yw / 2, clut);
+    }
+    jpeg_write_raw_data (&cjpeg, planes, 16);
+  }
+  jpeg_finish_compress (&cjpeg);
+  jpeg_destroy_compress (&cjpeg);
+  free(rows);
+  return(0);
+}
+
+static void png_imgbuf_write(png_structp png_ptr, png_bytep data, png_size_t length) {
+  imgbuf *ib = (imgbuf*) png_get_io_ptr(png_ptr);
+  imgbuf_write(ib, data, length);
+  if (ib->err) png_error(png_ptr, "out of memory");
+}
+
+static void png_imgbuf_flush(png_structp png_ptr) { ; }
+
+/* apply compression profile (PNGENC_*) */
+static void png_options(png_structp png_ptr, int opts) {
+  const int level = opts & PNGENC_LEVEL_MASK;
+  const int strategy = (opts & PNGENC_STRATEGY_MASK) >> 4;
+  const int filter = (opts & PNGENC_FILTER_MASK) >> 8;
+  if (level > 0) {
+    png_set_compression_level(png_ptr, level - 1);
+  }
+  if (strategy > 0) {
+    png_set_compression_strategy(png_ptr, strategy - 1);
+  }
+  switch (filter) {
+    case PNGENC_FILTER_NONE:  png_set_filter(png_ptr, 0, PNG_FILTER_NONE); break;
+    case PNGENC_FILTER_SUB:   png_set_filter(png_ptr, 0, PNG_FILTER_SUB); break;
+    case PNGENC_FILTER_UP:    png_set_filter(png_ptr, 0, PNG_FILTER_UP); break;
+    case PNGENC_FILTER_AVG:   png_set_filter(png_ptr, 0, PNG_FILTER_AVG); break;
+    case PNGENC_FILTER_PAETH: png_set_filter(png_ptr, 0, PNG_FILTER_PAETH); break;
+    case PNGENC_FILTER_ALL:   png_set_filter(png_ptr, 0, PNG_ALL_FILTERS); break;
+    default: break;
+  }
+}
+
+static int write_png(VInfo *ji, uint8_t *image, int opts, imgbuf *ib) {
   register int y;
   png_bytep rowpointers[ji->out_height];
   png_infop info_ptr;
@@ -102,12 +369,13 @@ static int write_png(VInfo *ji, uint8_t *image, FILE *x) {
     return(1);
   }
   if (setjmp(png_jmpbuf(png_ptr))) {
-  /* If we get here, we had a problem reading the file */
+  /* If we get here, we had a problem writing the file */
     png_destroy_write_struct(&png_ptr, &info_ptr);
     return (1);
   }
 
-  png_init_io (png_ptr, x);
+  png_set_write_fn (png_ptr, ib, png_imgbuf_write, png_imgbuf_flush);
+  png_options (png_ptr, opts);
   png_set_IHDR (png_ptr, info_ptr, ji->out_width, ji->out_height,
 		8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
 		PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
@@ -121,12 +389,12 @@ static int write_png(VInfo *ji, uint8_t *image, FILE *x) {
   return(0);
 }
 
-static int write_ppm(VInfo *ji, uint8_t *image, FILE *x) {
-
-  fprintf(x, "P6\n%d %d\n255\n", ji->out_width, ji->out_height);
-  fwrite(image, ji->out_height, 3*ji->out_width, x);
-
-  return(0);
+static int write_ppm(VInfo *ji, uint8_t *image, imgbuf *ib) {
+  char hd[32];
+  snprintf(hd, sizeof(hd), "P6\n%d %d\n255\n", ji->out_width, ji->out_height);
+  imgbuf_write(ib, (uint8_t*) hd, strlen(hd));
+  imgbuf_write(ib, image, (size_t) ji->out_height * 3 * ji->out_width);
+  return(ib->err);
 }
 
 static FILE *open_outfile(char *filename) {
@@ -134,114 +402,124 @@ static FILE *open_outfile(char *filename) {
   return fopen(filename, "w+");
 }
 
-size_t format_image(uint8_t **out, int render_fmt, int misc_int, VInfo *ji, uint8_t *buf) {
-#ifdef HAVE_WINDOWS
-  char tfn[64] = "";
-#endif
-#ifdef __USE_XOPEN2K8
-  size_t rs = 0;
-  FILE *x = open_memstream((char**) out, &rs);
-#else
-  FILE *x = tmpfile();
-#endif
-#ifdef HAVE_WINDOWS
-  if (!x) {
-    // wine and ancient version of windows don't support tmpfile()
-    // srand is per thread :(
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    srand(tv.tv_sec * tv.tv_usec * 100000);
-    snprintf(tfn, sizeof(tfn), "harvid.tmp.%d", rand());
-    x = fopen(tfn, "w+b"); // we should really use open(tfn, O_RDWR | O_CREAT | O_EXCL, 0600); and fdopen
+int png_option(const char *key, const char *val, int *mask) {
+  int i;
+  if (!strcmp(key, "level")) {
+    i = atoi(val);
+    if (i < 0 || i > 9) return 0;
+    *mask = PNGENC_LEVEL_MASK;
+    return i + 1;
   }
-#endif
-  if (!x) {
-    dlog(LOG_ERR, "IMF: tmpfile() creation failed.\n");
+  if (!strcmp(key, "strategy")) {
+    static const char *names[] = {"default", "filtered", "huffman", "rle", "fixed"};
+    static const int strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED};
+    *mask = PNGENC_STRATEGY_MASK;
+    for (i = 0; i < 5; ++i) {
+      if (!strcmp(val, names[i])) return (strategies[i] + 1) << 4;
+    }
+    return 0;
+  }
+  if (!strcmp(key, "filter")) {
+    static const char *names[] = {"auto", "none", "sub", "up", "avg", "paeth", "all"};
+    *mask = PNGENC_FILTER_MASK;
+    for (i = 0; i < 7; ++i) {
+      if (!strcmp(val, names[i])) return i << 8;
+    }
+    return 0;
+  }
+  *mask = 0;
+  return 0;
+}
+
+size_t format_image(uint8_t **out, int render_fmt, int misc_int, VInfo *ji, int pix_fmt, uint8_t *buf, size_t *allocated) {
+  imgbuf ib = {NULL, 0, 0, 0};
+  int quality = 0;
+  int rv;
+
+  *out = NULL;
+  if (allocated) *allocated = 0;
+  if (render_fmt == FMT_JPG) {
+    quality = misc_int & JPG_QUALITY_MASK;
+    if (quality < 5 || quality > 100) {
+      quality = JPEG_QUALITY;
+      misc_int = (misc_int & ~JPG_QUALITY_MASK) | quality;
+    }
+  } else if (render_fmt == FMT_PNG) {
+    misc_int &= PNGENC_LEVEL_MASK | PNGENC_STRATEGY_MASK | PNGENC_FILTER_MASK;
+  } else {
+    misc_int = 0;
+  }
+
+  if (imgbuf_reserve(&ib, hint_get(render_fmt, misc_int, ji->out_width, ji->out_height))) {
+    dlog(LOG_ERR, "IMF: out of memory.\n");
     return(0);
   }
 
+  if (pix_fmt != AV_PIX_FMT_RGB24 && !(render_fmt == FMT_JPG && pix_fmt == AV_PIX_FMT_YUV420P)) {
+    dlog(LOG_ERR, "IMF: Unsupported pixel format %d\n", pix_fmt);
+    render_fmt = -1;
+  }
+
   switch (render_fmt) {
-    case 1:
-      {
-        if (misc_int < 5 || misc_int > 100)
-          misc_int = JPEG_QUALITY;
-      if (write_jpeg(ji, buf, misc_int, x))
+    case FMT_JPG:
+      if (pix_fmt == AV_PIX_FMT_YUV420P)
+        rv = write_jpeg_yuv420(ji, buf, quality, misc_int & ~JPG_QUALITY_MASK, &ib);
+      else
+        rv = write_jpeg(ji, buf, quality, misc_int & ~JPG_QUALITY_MASK, &ib);
+      if (rv)
         dlog(LOG_ERR, "IMF: Could not write jpeg\n");
       break;
-      }
-    case 2:
-      if (write_png(ji, buf, x))
+    case FMT_PNG:
+      if ((rv = write_png(ji, buf, misc_int, &ib)))
         dlog(LOG_ERR, "IMF: Could not write png\n");
       break;
-    case 3:
-      if (write_ppm(ji, buf, x))
+    case FMT_PPM:
+      if ((rv = write_ppm(ji, buf, &ib)))
         dlog(LOG_ERR, "IMF: Could not write ppm\n");
       break;
     default:
-        dlog(LOG_ERR, "IMF: Unknown outformat %d\n", render_fmt);
-        fclose(x);
-        return 0;
+      dlog(LOG_ERR, "IMF: Unknown outformat %d\n", render_fmt);
+      rv = -1;
       break;
   }
-#ifdef __USE_XOPEN2K8
-  fclose(x);
-  return rs;
-#elif defined HAVE_WINDOWS
-  if (strlen(tfn) > 0) {
-    fclose(x);
-    x = fopen(tfn, "rb");
-  } else {
-    fflush(x);
+
+  if (rv || ib.err || ib.len == 0) {
+    free(ib.buf);
+    return(0);
   }
-#else
-  fflush(x);
-#endif
-  /* re-read image from tmp-file */
-  fseek (x , 0 , SEEK_END);
-  long int rsize = ftell (x);
-  rewind(x);
-  if (fseek(x, 0L, SEEK_SET) < 0) {
-    dlog(LOG_WARNING, "IMF: fseek failed\n");
-  }
-  fflush(x);
-  *out = (uint8_t*) malloc(rsize*sizeof(uint8_t));
-  if (fread(*out, sizeof(char), rsize, x) != rsize) {
-    dlog(LOG_WARNING, "IMF: short read. - possibly incomplete image\n");
-  }
-  fclose(x);
-#ifdef HAVE_WINDOWS
-  if (strlen(tfn) > 0) {
-    unlink(tfn);
+
+  hint_set(render_fmt, misc_int, ji->out_width, ji->out_height, ib.len);
+
+  /* the buffer may be kept in the image-cache, don't waste memory */
+  if (ib.size - ib.len >= IMGBUF_CLASS && ib.len < ib.size / 2) {
+    uint8_t *b = realloc(ib.buf, ib.len);
+    if (b) {
+      ib.buf = b;
+      ib.size = ib.len;
+    }
   }
-#endif
-  return (rsize);
+  *out = ib.buf;
+  if (allocated) *allocated = ib.size;
+  return (ib.len);
 }
 
 void write_image(char *file_name, int render_fmt, VInfo *ji, uint8_t *buf) {
   FILE *x;
+  uint8_t *img = NULL;
+  size_t len;
+  if (!(len = format_image(&img, render_fmt, JPG_PROGRESSIVE, ji, AV_PIX_FMT_RGB24, buf, NULL))) {
+    dlog(LOG_ERR, "IMF: Could not format image: %s\n", file_name);
+    return;
+  }
   if ((x = open_outfile(file_name))) {
-    switch (render_fmt) {
-      case FMT_JPG:
-	if (write_jpeg(ji, buf, JPEG_QUALITY, x))
-	  dlog(LOG_ERR, "IMF: Could not write jpeg: %s\n", file_name);
-	break;
-      case FMT_PNG:
-	if (write_png(ji, buf, x))
-	  dlog(LOG_ERR, "IMF: Could not write png: %s\n", file_name);
-	break;
-      case FMT_PPM:
-	if (write_ppm(ji, buf, x))
-	  dlog(LOG_ERR, "IMF: Could not write ppm: %s\n", file_name);
-	break;
-      default:
-	dlog(LOG_ERR, "IMF: Unknown outformat %d\n", render_fmt);
-	break;
-    }
+    if (fwrite(img, 1, len, x) != len)
+      dlog(LOG_ERR, "IMF: Could not write image: %s\n", file_name);
     if (strcmp(file_name, "-")) fclose(x);
     dlog(LOG_INFO, "IMF: Outputfile %s closed\n", file_name);
   }
   else
     dlog(LOG_ERR, "IMF: Could not open outfile: %s\n", file_name);
+  free(img);
   return;
 }
 
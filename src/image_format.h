@@ -22,10 +22,24 @@
 
 /** write image to memory-buffer 
  * @param out pointer to memory-area for the formatted image
+ * @param misc_int jpeg: quality (5..100, 0: default) or-ed with JPG_* encoder flags,
+ * png: PNGENC_* compression profile
  * @param ji input data description (width, height, stride,..)
+ * @param pix_fmt pixel format of buf: AV_PIX_FMT_RGB24, or AV_PIX_FMT_YUV420P for jpeg
  * @param buf raw image data to format
+ * @param allocated if not NULL, set to the size of the memory-area allocated for \a out
+ * @return length of the formatted image, 0 on error
  */
-size_t format_image(uint8_t **out, int render_fmt, int misc_int, VInfo *ji, uint8_t *buf);
+size_t format_image(uint8_t **out, int render_fmt, int misc_int, VInfo *ji, int pix_fmt, uint8_t *buf, size_t *allocated);
+
+/** parse a png compression setting
+ * @param key "level" (0..9), "strategy" (default, filtered, huffman, rle, fixed)
+ * or "filter" (auto, none, sub, up, avg, paeth, all)
+ * @param val value of the setting
+ * @param mask set to the PNGENC_* field that the setting belongs to, 0 if \a key is unknown
+ * @return value of the field, 0 (libpng's default) if \a val is invalid
+ */
+int png_option(const char *key, const char *val, int *mask);
 
 /** write image to file
  * @param ji input data description (width, height, stride,..)
@@ -26,6 +26,7 @@
 #else
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <signal.h>
@@ -37,6 +38,10 @@
 
 #include "socket_server.h"
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifndef uint8_t
 #define uint8_t unsigned char
 #endif
@@ -59,8 +64,9 @@
 
 //#define VERBOSE_SHUTDOWN 1
 
-/** called to spawn thread for an incoming connection */
-static int create_client(void *(*cli)(void *), void *arg) {
+/** called to spawn thread for an incoming connection or a worker,
+ * if \a tid is NULL the thread is detached. */
+static int create_client(void *(*cli)(void *), void *arg, pthread_t *tid) {
   pthread_t thread;
 #ifdef HAVE_PTHREAD_SIGMASK
   sigset_t newmask, oldmask;
@@ -79,14 +85,16 @@ static int create_client(void *(*cli)(void *), void *arg) {
 #endif /* HAVE_PTHREAD_SIGMASK */
   pthread_attr_t pth_attr;
   pthread_attr_init(&pth_attr);
-  pthread_attr_setdetachstate(&pth_attr, PTHREAD_CREATE_DETACHED);
+  if (!tid) pthread_attr_setdetachstate(&pth_attr, PTHREAD_CREATE_DETACHED);
 
-  if(pthread_create(&thread, &pth_attr, cli, arg)) {
+  if(pthread_create(tid ? tid : &thread, &pth_attr, cli, arg)) {
+    pthread_attr_destroy(&pth_attr);
 #ifdef HAVE_PTHREAD_SIGMASK
     pthread_sigmask(SIG_SETMASK, &oldmask, NULL); /* restore the mask */
 #endif /* HAVE_PTHREAD_SIGMASK */
     return -1;
   }
+  pthread_attr_destroy(&pth_attr);
 #ifdef HAVE_PTHREAD_SIGMASK
   pthread_sigmask(SIG_SETMASK, &oldmask, NULL); /* restore the mask */
 #endif /* HAVE_PTHREAD_SIGMASK */
@@ -160,8 +168,8 @@ static int server_bind(ICI *d, struct sockaddr_in addr) {
 /* -=-=-=-=-=-=-=-=-=-=- TCP socket connection */
 #define SLEEP_STEP (2)
 //#define CON_TIMEOUT (cfg->timeout) // -- TODO - configuration param
-//#define CON_TIMEOUT (30) // -- HTTP 30 sec
-#define CON_TIMEOUT (300) // ICSP 5 min
+#define CON_TIMEOUT (30) // -- HTTP 30 sec, idle keep-alive connection
+//#define CON_TIMEOUT (300) // ICSP 5 min
 
 static int global_shutdown = 0;
 #ifdef CATCH_SIGNALS
@@ -173,6 +181,69 @@ void catchsig (int sig) {
 }
 #endif
 
+/** account a request: usage statistics and server idle-timeout */
+void count_request(CONN *c) {
+  ICI *d = c->d;
+  pthread_mutex_lock(&d->lock);
+  d->age = 0;
+#ifdef USAGE_FREQUENCY_STATISTICS
+  d->stat_count++;
+  d->req_stats[time(NULL) % FREQ_LEN]++;
+#endif
+  pthread_mutex_unlock(&d->lock);
+}
+
+#ifdef USAGE_FREQUENCY_STATISTICS
+/** clear the request counter of the upcoming second(s) */
+static void stats_advance(ICI *d, time_t *last, time_t now) {
+  time_t t;
+  for (t = *last + 2; t <= now + 1 && t <= *last + 1 + FREQ_LEN; ++t) {
+    d->req_stats[t % FREQ_LEN] = 0;
+  }
+  *last = now;
+}
+#endif
+
+/** close the socket and free the connection handle */
+static void close_connection(CONN *c) {
+#ifndef HAVE_WINDOWS
+  close(c->fd);
+#else
+  closesocket(c->fd);
+#endif
+
+  pthread_mutex_lock(&c->d->lock);
+  c->d->num_clients--;
+  pthread_mutex_unlock(&c->d->lock);
+
+  dlog(DLOG_INFO, "SRV: closed client connection (%u) from %s:%d.\n", c->fd, c->client_address, c->client_port);
+  debugmsg(DEBUG_SRV, "SRV: now %i connections active\n", c->d->num_clients);
+
+  if (c->client_address) free(c->client_address);
+  free(c);
+}
+
+/** allocate a connection handle for an accepted socket */
+static CONN *new_connection(ICI *d, int fd, char *rh, unsigned short rp) {
+  pthread_mutex_lock(&d->lock);
+  d->num_clients++;
+  if (d->num_clients > d->max_clients) d->max_clients = d->num_clients;
+  pthread_mutex_unlock(&d->lock);
+
+  CONN *c = calloc(1, sizeof(CONN));
+  c->run = 1;
+  c->fd = fd;
+  c->d = d;
+  c->client_address = strdup(rh);
+  c->client_port = rp;
+#ifdef SOCKET_WRITE
+  c->cq = NULL;
+#endif
+  c->userdata = NULL;
+  return c;
+}
+
+#ifndef HAVE_EPOLL
 /* this is the main client connection loop - one for each connection */
 static void *socket_handler(void *cn) {
   CONN *c = (CONN*) cn;
@@ -226,43 +297,15 @@ static void *socket_handler(void *cn) {
 
   }
   debugmsg(DEBUG_SRV, "SRV: protocol ended. closing connection fd:%d\n", c->fd);
-#ifndef HAVE_WINDOWS
-  close(c->fd);
-#else
-  closesocket(c->fd);
-#endif
-
-  pthread_mutex_lock(&c->d->lock);
-  c->d->num_clients--;
-  pthread_mutex_unlock(&c->d->lock);
-
-  dlog(DLOG_INFO, "SRV: closed client connection (%u) from %s:%d.\n", c->fd, c->client_address, c->client_port);
-  debugmsg(DEBUG_SRV, "SRV: now %i connections active\n", c->d->num_clients);
-
-  if (c->client_address) free(c->client_address);
-  free(c);
+  close_connection(c);
   return NULL; /* end close connection */
 }
 
 /**launch handler for each incoming connection. */
 static void start_child(ICI *d, int fd, char *rh, unsigned short rp) {
-  pthread_mutex_lock(&d->lock);
-  d->num_clients++;
-  if (d->num_clients > d->max_clients) d->max_clients = d->num_clients;
-  pthread_mutex_unlock(&d->lock);
-
-  CONN *c = calloc(1, sizeof(CONN));
-  c->run = 1;
-  c->fd = fd;
-  c->d = d;
-  c->client_address = strdup(rh);
-  c->client_port = rp;
-#ifdef SOCKET_WRITE
-  c->cq = NULL;
-#endif
-  c->userdata = NULL;
+  CONN *c = new_connection(d, fd, rh, rp);
 
-  if(create_client(&socket_handler, c)) {
+  if(create_client(&socket_handler, c, NULL)) {
     if(fd >= 0)
 #ifndef HAVE_WINDOWS
       close(fd);
@@ -280,6 +323,8 @@ static void start_child(ICI *d, int fd, char *rh, unsigned short rp) {
   debugmsg(DEBUG_SRV, "SRV: Connection started: now %i connections active\n", d->num_clients);
 }
 
+#endif
+
 /** handshake - accept incoming connection  */
 static int accept_connection(ICI *d, char **remotehost, unsigned short *rport) {
   struct sockaddr_in addr;
@@ -313,6 +358,14 @@ static int accept_connection(ICI *d, char **remotehost, unsigned short *rport) {
     return (-1);
   }
 
+  /* replies are sent with a single write, don't delay small ones */
+  int nodelay = 1;
+#ifndef HAVE_WINDOWS
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+#else
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (void*) &nodelay, sizeof(int));
+#endif
+
   // check if we should use SO_KEEPALIVE here
   //int val = 1; setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &val,  sizeof(int));
   // or set non-blocking i/o ...
@@ -320,36 +373,12 @@ static int accept_connection(ICI *d, char **remotehost, unsigned short *rport) {
   return(s);
 }
 
-static int main_loop (void *arg) {
-  ICI *d = arg;
-  struct sockaddr_in addr;
+#ifndef HAVE_EPOLL
+/** legacy accept loop: one thread per connection */
+static int select_loop (ICI *d) {
   int rv = 0;
-#ifndef HAVE_WINDOWS
-  signal(SIGPIPE, SIG_IGN);
-#endif
-
-  if ((d->fd = create_server_socket()) < 0) {rv = -1; goto daemon_end;}
-  server_sockaddr(d, &addr);
-  if(server_bind(d, addr)) {rv = -1; goto daemon_end;}
-
-  if (d->uid || d->gid) {
-    if (drop_privileges(d->uid, d->gid)) {rv = -1; goto daemon_end;}
-  }
-
-  if (strlen(d->docroot) > 0 && access(d->docroot, R_OK)) {
-    dlog(DLOG_CRIT, "SRV: can not read document-root (permission denied)\n");
-    rv = -1;
-    goto daemon_end;
-  }
-
-  global_shutdown = 0;
-#ifdef CATCH_SIGNALS
-  signal(SIGHUP, catchsig);
-  signal(SIGINT, catchsig);
-#endif
-
 #ifdef USAGE_FREQUENCY_STATISTICS
-  d->stat_start = time(NULL);
+  time_t stats_last = time(NULL);
 #endif
 
   while(d->run && !global_shutdown) {
@@ -365,7 +394,7 @@ static int main_loop (void *arg) {
       dlog(DLOG_WARNING, "SRV: unable to select the socket: %s\n", strerror(errno));
       if (errno != EINTR) {
         rv = -1;
-        goto daemon_end;
+        break;
       } else {
         continue;
       }
@@ -374,23 +403,18 @@ static int main_loop (void *arg) {
     char *rh = NULL;
     unsigned short rp = 0;
     int s = -1;
+#ifdef USAGE_FREQUENCY_STATISTICS
+    stats_advance(d, &stats_last, time(NULL));
+#endif
     if(FD_ISSET(d->fd, &rfds)) {
       s = accept_connection(d, &rh, &rp);
     } else {
       d->age++;
-#ifdef USAGE_FREQUENCY_STATISTICS
-      /* may not be accurate, select() may skip a second once in a while */
-      d->req_stats[time(NULL) % FREQ_LEN] = 0;
-#endif
     }
 
     if (s >= 0) {
       start_child(d, s, rh, rp);
       d->age=0;
-#ifdef USAGE_FREQUENCY_STATISTICS
-      d->stat_count++;
-      d->req_stats[time(NULL) % FREQ_LEN]++;
-#endif
       continue; // no need to check age.
     }
 
@@ -429,6 +453,284 @@ static int main_loop (void *arg) {
   } else {
     dlog(DLOG_INFO, "SRV: Closed all connections.\n");
   }
+  return rv;
+}
+
+#else
+/* -=-=-=-=-=-=-=-=-=-=- epoll event loop and worker pool */
+
+#define MAXEVENTS (64)
+
+/** (re)enable notification for incoming data on a connection,
+ * must be called with d->lock held. */
+static int epoll_arm(CONN *c, int op) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(struct epoll_event));
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = c;
+  if (epoll_ctl(c->d->efd, op, c->fd, &ev)) {
+    dlog(DLOG_WARNING, "SRV: epoll_ctl failed for fd:%d: %s\n", c->fd, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/** remove connection from ICI::clients, must be called with d->lock held. */
+static void unlink_connection(CONN *c) {
+  ICI *d = c->d;
+  if (c->prev) c->prev->next = c->next;
+  else d->clients = c->next;
+  if (c->next) c->next->prev = c->prev;
+  c->prev = c->next = NULL;
+}
+
+static void epoll_add_client(ICI *d, int fd, char *rh, unsigned short rp) {
+  CONN *c = new_connection(d, fd, rh, rp);
+  pthread_mutex_lock(&d->lock);
+  c->atime = time(NULL);
+  c->next = d->clients;
+  if (d->clients) d->clients->prev = c;
+  d->clients = c;
+  if (epoll_arm(c, EPOLL_CTL_ADD)) {
+    unlink_connection(c);
+    pthread_mutex_unlock(&d->lock);
+    close_connection(c);
+    return;
+  }
+  pthread_mutex_unlock(&d->lock);
+  debugmsg(DEBUG_SRV, "SRV: Connection started: now %i connections active\n", d->num_clients);
+}
+
+/** worker thread: handle requests of connections with pending input */
+static void *worker_thread(void *arg) {
+  ICI *d = (ICI*) arg;
+
+  while (1) {
+    CONN *c;
+    int rv = -1;
+
+    pthread_mutex_lock(&d->lock);
+    while (d->run && !d->queue_head) {
+      pthread_cond_wait(&d->queue_cond, &d->lock);
+    }
+    if (!d->queue_head) {
+      pthread_mutex_unlock(&d->lock);
+      break;
+    }
+    c = d->queue_head;
+    d->queue_head = c->qnext;
+    if (!d->queue_head) d->queue_tail = NULL;
+    c->qnext = NULL;
+    pthread_mutex_unlock(&d->lock);
+
+    // NOTE: set c->run = 0; is preferred to return(!0) in protocol_handler;
+    if (d->run) {
+      debugmsg(DEBUG_SRV, "SRV: read fd:%d\n", c->fd);
+      rv = protocol_handler(c, d->userdata);
+    }
+
+    pthread_mutex_lock(&d->lock);
+    if (rv || !c->run || !d->run) {
+      unlink_connection(c);
+      pthread_mutex_unlock(&d->lock);
+      debugmsg(DEBUG_SRV, "SRV: protocol ended. closing connection fd:%d\n", c->fd);
+      close_connection(c);
+      continue;
+    }
+    c->busy = 0;
+    c->atime = time(NULL);
+    if (epoll_arm(c, EPOLL_CTL_MOD)) {
+      unlink_connection(c);
+      pthread_mutex_unlock(&d->lock);
+      close_connection(c);
+      continue;
+    }
+    pthread_mutex_unlock(&d->lock);
+  }
+  return NULL;
+}
+
+/** close connections that have been idle for more than CON_TIMEOUT */
+static void epoll_sweep_idle(ICI *d, time_t now) {
+  CONN *c, *next, *expired = NULL;
+  pthread_mutex_lock(&d->lock);
+  for (c = d->clients; c; c = next) {
+    next = c->next;
+    if (c->busy || now - c->atime <= CON_TIMEOUT) continue;
+    unlink_connection(c);
+    c->qnext = expired;
+    expired = c;
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  for (c = expired; c; c = next) {
+    next = c->qnext;
+    dlog(DLOG_INFO, "SRV: connection timeout: connection reset\n");
+    close_connection(c);
+  }
+}
+
+/** accept connections and dispatch incoming data to the worker pool */
+static int epoll_loop (ICI *d) {
+  struct epoll_event ev[MAXEVENTS];
+  int i, rv = 0;
+  time_t last = time(NULL);
+#ifdef USAGE_FREQUENCY_STATISTICS
+  time_t stats_last = last;
+#endif
+
+  if ((d->efd = epoll_create(MAXCONNECTIONS)) < 0) {
+    dlog(DLOG_CRIT, "SRV: unable to create epoll instance: %s\n", strerror(errno));
+    return -1;
+  }
+
+  memset(&ev[0], 0, sizeof(struct epoll_event));
+  ev[0].events = EPOLLIN;
+  ev[0].data.ptr = NULL; // server socket
+  if (epoll_ctl(d->efd, EPOLL_CTL_ADD, d->fd, &ev[0])) {
+    dlog(DLOG_CRIT, "SRV: unable to add server socket to epoll: %s\n", strerror(errno));
+    close(d->efd);
+    return -1;
+  }
+
+  pthread_cond_init(&d->queue_cond, NULL);
+  d->workers = calloc(d->num_workers, sizeof(pthread_t));
+  for (i = 0; i < d->num_workers; ++i) {
+    if (create_client(&worker_thread, d, &d->workers[i])) {
+      dlog(DLOG_ERR, "SRV: failed to start worker thread.\n");
+      break;
+    }
+  }
+  d->num_workers = i;
+  if (d->num_workers == 0) {
+    d->run = 0;
+    rv = -1;
+  }
+  debugmsg(DEBUG_SRV, "SRV: started %d worker threads\n", d->num_workers);
+
+  while(d->run && !global_shutdown) {
+    const int n = epoll_wait(d->efd, ev, MAXEVENTS, 1000);
+    const time_t now = time(NULL);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      dlog(DLOG_WARNING, "SRV: epoll_wait failed: %s\n", strerror(errno));
+      rv = -1;
+      break;
+    }
+
+#ifdef USAGE_FREQUENCY_STATISTICS
+    stats_advance(d, &stats_last, now);
+#endif
+    if (now != last) {
+      d->age += now - last;
+    }
+
+    for (i = 0; i < n; ++i) {
+      CONN *c = (CONN*) ev[i].data.ptr;
+      if (!c) {
+        char *rh = NULL;
+        unsigned short rp = 0;
+        int s = accept_connection(d, &rh, &rp);
+        if (s < 0) continue;
+        epoll_add_client(d, s, rh, rp);
+        d->age = 0;
+        continue;
+      }
+      // data or hangup: queue for the worker pool, EPOLLONESHOT disables
+      // further events until a worker re-arms the connection.
+      pthread_mutex_lock(&d->lock);
+      c->busy = 1;
+      c->qnext = NULL;
+      if (d->queue_tail) d->queue_tail->qnext = c;
+      else d->queue_head = c;
+      d->queue_tail = c;
+      pthread_cond_signal(&d->queue_cond);
+      pthread_mutex_unlock(&d->lock);
+    }
+
+    if (now != last) {
+      epoll_sweep_idle(d, now);
+      last = now;
+    }
+
+    if (d->timeout > 0 && d->age > d->timeout) {
+      dlog(DLOG_INFO, "SRV: no request since %d seconds shutting down.\n", d->age);
+      global_shutdown = 1;
+    }
+  }
+
+#ifdef CATCH_SIGNALS
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+#endif
+
+  /* let workers complete pending requests */
+  if (d->num_clients > 0)
+    dlog(DLOG_INFO, "SRV: server shutdown procedure: waiting for active requests to complete..\n");
+
+  pthread_mutex_lock(&d->lock);
+  d->run = 0;
+  pthread_cond_broadcast(&d->queue_cond);
+  pthread_mutex_unlock(&d->lock);
+
+  for (i = 0; i < d->num_workers; ++i) {
+    pthread_join(d->workers[i], NULL);
+  }
+  free(d->workers);
+  d->workers = NULL;
+
+  /* close idle connections */
+  while (d->clients) {
+    CONN *c = d->clients;
+    unlink_connection(c);
+    close_connection(c);
+  }
+  dlog(DLOG_INFO, "SRV: Closed all connections.\n");
+
+  pthread_cond_destroy(&d->queue_cond);
+  close(d->efd);
+  return rv;
+}
+#endif
+
+static int main_loop (void *arg) {
+  ICI *d = arg;
+  struct sockaddr_in addr;
+  int rv = 0;
+#ifndef HAVE_WINDOWS
+  signal(SIGPIPE, SIG_IGN);
+#endif
+
+  if ((d->fd = create_server_socket()) < 0) {rv = -1; goto daemon_end;}
+  server_sockaddr(d, &addr);
+  if(server_bind(d, addr)) {rv = -1; goto daemon_end;}
+
+  if (d->uid || d->gid) {
+    if (drop_privileges(d->uid, d->gid)) {rv = -1; goto daemon_end;}
+  }
+
+  if (strlen(d->docroot) > 0 && access(d->docroot, R_OK)) {
+    dlog(DLOG_CRIT, "SRV: can not read document-root (permission denied)\n");
+    rv = -1;
+    goto daemon_end;
+  }
+
+  global_shutdown = 0;
+#ifdef CATCH_SIGNALS
+  signal(SIGHUP, catchsig);
+  signal(SIGINT, catchsig);
+#endif
+
+#ifdef USAGE_FREQUENCY_STATISTICS
+  d->stat_start = time(NULL);
+#endif
+
+#ifdef HAVE_EPOLL
+  rv = epoll_loop(d);
+#else
+  rv = select_loop(d);
+#endif
 
 daemon_end:
   close(d->fd);
@@ -447,7 +749,7 @@ daemon_end:
 // tcp server thread
 int start_tcp_server (const unsigned int hostnl, const unsigned short port,
     const char *docroot, const uid_t uid, const gid_t gid,
-    unsigned int timeout, void *userdata) {
+    unsigned int timeout, int workers, void *userdata) {
   ICI *d = calloc(1, sizeof(ICI));
   pthread_mutex_init(&d->lock, NULL);
   d->run = 1;
@@ -458,6 +760,7 @@ int start_tcp_server (const unsigned int hostnl, const unsigned short port,
   d->docroot    = docroot;
   d->age        = 0;
   d->timeout    = timeout;
+  d->num_workers = workers > 0 ? workers : 1;
   d->userdata   = userdata;
   return main_loop(d);
 }
@@ -28,8 +28,16 @@
 #include <stdio.h>
 #include <pthread.h>
 
+#if (defined __linux__ && !defined HAVE_WINDOWS && !defined NO_EPOLL)
+#define HAVE_EPOLL ///< use epoll event-loop and a worker-pool instead of a thread per connection
+#endif
+
 // limit number of connections per daemon
+#ifdef HAVE_EPOLL
+#define MAXCONNECTIONS (1024)
+#else
 #define MAXCONNECTIONS (120)
+#endif
 
 #ifndef NDEBUG
 #define USAGE_FREQUENCY_STATISTICS 1
@@ -67,6 +75,15 @@ typedef struct ICI {
   unsigned int age; ///< used for timeout -- in seconds
   unsigned int timeout; ///< if > 0 shut down serve if age reaches this value
   void *userdata;  ///< generic placeholder for usage specific data
+  int num_workers; ///< size of the request handler thread pool
+#ifdef HAVE_EPOLL
+  int efd;                     ///< epoll file descriptor
+  pthread_t *workers;          ///< request handler threads
+  pthread_cond_t queue_cond;   ///< signalled when a connection is queued
+  struct CONN *queue_head;     ///< connections with pending input, FIFO
+  struct CONN *queue_tail;
+  struct CONN *clients;        ///< list of all open connections
+#endif
 #ifdef USAGE_FREQUENCY_STATISTICS
   time_t       req_stats[FREQ_LEN];
   time_t       stat_start;
@@ -86,19 +103,29 @@ typedef struct CONN {
   char buf[BUFSIZ]; ///< Socket read buffer
   int buf_len; ///< Index of first unused byte in buf
   int timeout_cnt; ///< internal connectiontimeout counter
+  int keepalive; ///< persistent connection: the current request may be followed by more
+  int num_req;   ///< number of requests served on this connection
   char *client_address;///< IP address of the client
   unsigned short client_port; ///< port used by the client
 #ifdef SOCKET_WRITE
   void *cq; ///< outgoing command queue
 #endif
   void *userdata; ///< generic information for this connection
+#ifdef HAVE_EPOLL
+  time_t atime; ///< time of last activity -- used for idle timeout
+  int busy;     ///< connection is queued or handled by a worker
+  struct CONN *prev, *next; ///< ICI::clients list
+  struct CONN *qnext;       ///< ICI::queue
+#endif
 } CONN;
 
 
 /**
  * @brief allocates and initializes an ICI structure and enters the server thread.
  *
- * While the tcp server itself launches threads for each incoming connection,
+ * With epoll (Linux) a single thread waits for incoming data on all
+ * connections and hands them to a pool of \a workers threads, otherwise
+ * the tcp server launches a thread for each incoming connection.
  * start_tcp_server() does not return until this server has been shut down.
  * launching a server will activate the connection callbacks \ref protocol_handler()
  * and \ref protocol_droid().
@@ -108,11 +135,21 @@ typedef struct CONN {
  * @param docroot configure the document-root for all connections to this server.
  * @param uid specify the user-id that the server will assume. If \a uid is zero no suid is performed.
  * @param gid the unix group of the server; \a gid may be zero in which case the effective group ID of the calling process will remain unchanged.
+ * @param timeout shut down the server if no new connection arrives within this time (in seconds), 0: no timeout
+ * @param workers number of request handler threads (epoll only)
  * @param d user-data passed on to callbacks.
  */
 int start_tcp_server (const unsigned int hostnl, const unsigned short port,
 		const char *docroot, const uid_t uid, const gid_t gid,
-		unsigned int timeout, void *d);
+		unsigned int timeout, int workers, void *d);
+
+/**
+ * account a request for usage statistics and reset the server idle-timeout.
+ * to be called by the protocol handler for every request.
+ *
+ * @param c connection that received the request
+ */
+void count_request(CONN *c);
 
 // extern function virtual prototype(s)
 /**